@@ -3,11 +3,15 @@ import <iomanip>;
 import <iostream>;
 import <optional>;
 import <span>;
+import <sstream>;
 import <string_view>;
 import <variant>;
 import <vector>;
+import as.ast;
 import as.parser;
 import as.encode;
+import as.image;
+import as.symbols;
 
 #include <cassert>
 
@@ -27,6 +31,8 @@ struct flag {
 struct {
   const char* input;
   const char* output;
+  const char* symbols;
+  enum { intcode, binary } output_type;
   std::span<char*> positional;
 } args;
 
@@ -36,6 +42,21 @@ constexpr flag flags[] = {
   {"help", {}, "Displays the usage information.", show_usage_and_exit},
   {"input", "-", "File to read from.", +[](const char* x) { args.input = x; }},
   {"output", "-", "File to write to.", +[](const char* x) { args.output = x; }},
+  {"symbols", "", "File to write a symbol map to, for use by run.",
+   +[](const char* x) { args.symbols = x; }},
+  {"output_type", "intcode",
+   "Output format (intcode or binary). Binary images include the symbol map "
+   "and can be run without being parsed.",
+   +[](const char* x) {
+     if (x == std::string_view("intcode")) {
+       args.output_type = args.intcode;
+     } else if (x == std::string_view("binary")) {
+       args.output_type = args.binary;
+     } else {
+       std::cerr << "Invalid output type.\n";
+       std::exit(1);
+     }
+   }},
 };
 
 void show_usage_and_exit() {
@@ -63,12 +84,28 @@ void read_options(int& argc, char**& argv) {
     } else if (argument == "--") {
       options_done = true;
     } else {
+      // Values may be given either as --name=value or as --name value.
+      std::string_view name = argument.substr(2);
+      const char* value = nullptr;
+      if (auto equals = name.find('='); equals != name.npos) {
+        value = argv[i] + 2 + equals + 1;
+        name = name.substr(0, equals);
+      }
       for (const flag& f : flags) {
-        if (argument.substr(2) == f.name) {
+        if (name == f.name) {
           std::visit(overload{
-            [&](flag::load_bool* load) { load(); },
+            [&](flag::load_bool* load) {
+              if (value) {
+                std::cerr << "Unexpected argument for --" << f.name << ".\n";
+                std::exit(1);
+              }
+              load();
+            },
             [&](flag::load_value* load) {
-              if (++i < argc && !std::string_view(argv[i]).starts_with("--")) {
+              if (value) {
+                load(value);
+              } else if (++i < argc &&
+                         !std::string_view(argv[i]).starts_with("--")) {
                 load(argv[i]);
               } else {
                 std::cerr << "Missing argument for --" << f.name << ".\n";
@@ -102,17 +139,54 @@ auto load_input() {
   return as::parse(file, source);
 };
 
+// Writes the symbol map for the program to the file given by --symbols.
+void write_symbols(std::span<const as::statement> program) {
+  as::symbol_map symbols;
+  as::encode(program, symbols);
+  std::ofstream file(args.symbols);
+  if (!file.good()) {
+    std::cerr << "Could not open " << std::quoted(args.symbols)
+              << " for writing.\n";
+    std::exit(1);
+  }
+  file << symbols;
+}
+
 int main(int argc, char* argv[]) {
   read_options(argc, argv);
-  auto encoded = encode(load_input());
-  bool first = true;
-  for (auto x : encoded) {
-    if (first) {
-      first = false;
-    } else {
-      std::cout << ',';
+  auto program = load_input();
+  std::ofstream file;
+  std::ostream* output;
+  if (args.output == std::string_view("-")) {
+    output = &std::cout;
+  } else {
+    file.open(args.output, std::ios::binary);
+    if (!file.good()) {
+      std::cerr << "Could not open " << std::quoted(args.output)
+                << " for writing.\n";
+      return 1;
+    }
+    output = &file;
+  }
+  if (args.output_type == args.binary) {
+    as::symbol_map symbols;
+    std::int64_t bss_size;
+    const auto encoded = as::encode(program, symbols, bss_size);
+    std::ostringstream symbol_text;
+    symbol_text << symbols;
+    as::write_image(*output, {encoded, bss_size, symbol_text.str()});
+  } else {
+    auto encoded = encode(program);
+    bool first = true;
+    for (auto x : encoded) {
+      if (first) {
+        first = false;
+      } else {
+        *output << ',';
+      }
+      *output << x;
     }
-    std::cout << x;
+    *output << '\n';
   }
-  std::cout << '\n';
+  if (*args.symbols) write_symbols(program);
 }
@@ -1,31 +1,84 @@
 export module as.ast;
 
 import <cstdint>;
+import <deque>;
 import <iomanip>;
 import <iostream>;
 import <optional>;
 import <string>;
 import <string_view>;
+import <unordered_map>;
 import <variant>;
 
 namespace as {
 
+struct symbol_table {
+  // A deque never moves its elements, so the views in ids stay valid.
+  std::deque<std::string> names;
+  std::unordered_map<std::string_view, int> ids;
+};
+
+symbol_table& symbols() {
+  static symbol_table table;
+  return table;
+}
+
+// An interned name. Each distinct name is stored once and given a dense id in
+// the order that names are first seen, so that symbols can be compared by id
+// and tables of them can be indexed by id instead of hashing the name.
+export class symbol {
+ public:
+  symbol() : symbol(std::string_view()) {}
+  symbol(std::string_view name) : id_(intern(name)) {}
+  symbol(const std::string& name) : symbol(std::string_view(name)) {}
+  symbol(const char* name) : symbol(std::string_view(name)) {}
+
+  // Returns the number of distinct symbols, which is an upper bound on ids.
+  static int count() { return symbols().names.size(); }
+
+  // Returns the symbol with the given id, which must be less than count().
+  static symbol from_id(int id) { return symbol(id, 0); }
+
+  int id() const { return id_; }
+  const std::string& str() const { return symbols().names[id_]; }
+  operator const std::string&() const { return str(); }
+
+  bool operator==(const symbol&) const = default;
+
+ private:
+  symbol(int id, int) : id_(id) {}
+
+  static int intern(std::string_view name) {
+    auto& table = symbols();
+    if (auto i = table.ids.find(name); i != table.ids.end()) return i->second;
+    const int id = table.names.size();
+    table.ids.emplace(table.names.emplace_back(name), id);
+    return id;
+  }
+
+  int id_;
+};
+
+export std::ostream& operator<<(std::ostream& output, const symbol& s) {
+  return output << s.str();
+}
+
 export struct literal { std::int64_t value; };
-export struct name { std::string value; };
+export struct name { symbol value; };
 export using immediate = std::variant<literal, name>;
 export struct address { immediate value; };
 export struct relative { immediate value; };
 export struct output_param {
-  std::optional<std::string> label;
+  std::optional<symbol> label;
   std::variant<address, relative> output;
 };
 export struct input_param {
   using type = std::variant<address, immediate, relative>;
-  std::optional<std::string> label;
+  std::optional<symbol> label;
   type input;
 
   input_param() = default;
-  input_param(std::optional<std::string> label, type input)
+  input_param(std::optional<symbol> label, type input)
       : label(std::move(label)), input(std::move(input)) {}
   input_param(const output_param& o)
       : label(o.label),
@@ -51,11 +104,19 @@ export struct halt {};
 export using instruction = std::variant<literal, add, mul, input, output,
                                         jump_if_true, jump_if_false, less_than,
                                         equals, adjust_relative_base, halt>;
-export struct label { std::string name; };
-export struct define { std::string name; input_param value; };
+export struct label { symbol name; };
+export struct define { symbol name; input_param value; };
 export struct integer { immediate value; };
 export struct ascii { std::string value; };
-export using directive = std::variant<define, integer, ascii>;
+// Reserves the given number of cells, which are initially zero.
+export struct zero { std::int64_t size; };
+// Attributes the code which follows to a line of a function in a source file.
+export struct location { std::string file; int line; std::string function; };
+// Marks the jump which follows as a function call or a return.
+export struct call_site {};
+export struct return_site {};
+export using directive = std::variant<define, integer, ascii, zero, location,
+                                      call_site, return_site>;
 export using statement = std::variant<label, instruction, directive>;
 
 export std::ostream& operator<<(std::ostream& output, literal l) {
@@ -160,6 +221,23 @@ export std::ostream& operator<<(std::ostream& output, const ascii& a) {
   return output << ".ascii " << std::quoted(a.value);
 }
 
+export std::ostream& operator<<(std::ostream& output, zero z) {
+  return output << ".zero " << z.size;
+}
+
+export std::ostream& operator<<(std::ostream& output, const location& l) {
+  return output << ".loc " << std::quoted(l.file) << " " << l.line << " "
+                << l.function;
+}
+
+export std::ostream& operator<<(std::ostream& output, call_site) {
+  return output << ".call";
+}
+
+export std::ostream& operator<<(std::ostream& output, return_site) {
+  return output << ".return";
+}
+
 export std::ostream& operator<<(std::ostream& output, const directive& d) {
   std::visit([&](const auto& x) { output << x; }, d);
   return output;
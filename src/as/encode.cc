@@ -2,11 +2,12 @@ export module as.encode;
 
 import <iomanip>;
 import <iostream>;
-import <map>;
+import <optional>;
 import <span>;
 import <variant>;
 import <vector>;
 import as.ast;
+import as.symbols;
 
 namespace as {
 
@@ -81,7 +82,8 @@ std::int64_t immediate_value(const immediate& i) {
   return std::visit(overload{
     [](literal l) { return l.value; },
     [](name n) -> std::int64_t {
-      std::cerr << "Unresolved immediate " << std::quoted(n.value) << ".\n";
+      std::cerr << "Unresolved immediate " << std::quoted(n.value.str())
+                << ".\n";
       std::abort();
     },
   }, i);
@@ -144,16 +146,20 @@ void visit_params(Visitor&& visitor, const instruction& i) {
 }
 
 struct environment {
-  std::map<std::string, std::int64_t> constants;
-  std::map<std::string, input_param> macros;
-
-  environment(std::span<const statement> input) {
-    auto set = [](auto& output, std::string name, auto value) {
-      auto [i, done] = output.emplace(name, value);
-      if (!done) {
-        std::cerr << "Duplicate definition for " << std::quoted(name) << ".\n";
+  // Both tables are indexed by symbol id.
+  std::vector<std::optional<std::int64_t>> constants;
+  std::vector<std::optional<input_param>> macros;
+
+  environment(std::span<const statement> input)
+      : constants(symbol::count()), macros(symbol::count()) {
+    auto set = [](auto& output, const symbol& name, auto value) {
+      auto& entry = output[name.id()];
+      if (entry) {
+        std::cerr << "Duplicate definition for " << std::quoted(name.str())
+                  << ".\n";
         std::exit(1);
       }
+      entry = value;
     };
     std::int64_t offset = 0;
     for (const auto& statement : input) {
@@ -170,6 +176,8 @@ struct environment {
             [&](const define& d) { set(macros, d.name, d.value); },
             [&](const integer&) { offset++; },
             [&](const ascii& a) { offset += a.value.size() + 1; },
+            [&](const zero& z) { offset += z.size; },
+            [](const auto&) {},
           }, d);
         },
       }, statement);
@@ -180,10 +188,11 @@ struct environment {
     std::visit(overload{
       [](literal&) {},
       [&](name& n) {
-        if (auto i = constants.find(n.value); i != constants.end()) {
-          x = literal{i->second};
+        if (const auto& value = constants[n.value.id()]) {
+          x = literal{*value};
         } else {
-          std::cerr << "Undefined name " << std::quoted(n.value) << ".\n";
+          std::cerr << "Undefined name " << std::quoted(n.value.str())
+                    << ".\n";
           std::exit(1);
         }
       },
@@ -220,15 +229,29 @@ struct environment {
   void resolve(integer& i) const { resolve(i.value); }
 };
 
-export std::vector<std::int64_t> encode(std::span<const statement> input) {
+// Encodes the program, and fills in a symbol map describing the result unless
+// symbols is null. Zeroes at the end of the program are left out, since memory
+// beyond it is zero, and the number of them is stored in bss_size.
+std::vector<std::int64_t> encode(std::span<const statement> input,
+                                 symbol_map* symbols, std::int64_t& bss_size) {
   environment environment(input);
+  if (symbols) symbols->labels.resize(symbol::count());
   std::vector<std::int64_t> output;
+  // Cells reserved by .zero are only materialized if something follows them.
+  std::int64_t zeroes = 0;
+  const auto flush = [&] {
+    output.resize(output.size() + zeroes);
+    zeroes = 0;
+  };
   for (const auto& statement : input) {
     std::visit(overload{
-      [&](const label&) {},
+      [&](const label& l) {
+        if (symbols) symbols->labels[l.name.id()] = output.size() + zeroes;
+      },
       [&](const instruction& i) {
         instruction temp = i;
         environment.resolve(temp);
+        flush();
         encode(output, temp);
       },
       [&](const directive& d) {
@@ -237,18 +260,62 @@ export std::vector<std::int64_t> encode(std::span<const statement> input) {
           [&](const integer& i) {
             integer x = i;
             environment.resolve(x);
-            output.push_back(immediate_value(x.value));
+            const std::int64_t value = immediate_value(x.value);
+            if (value == 0) {
+              zeroes++;
+            } else {
+              flush();
+              output.push_back(value);
+            }
           },
           [&](const ascii& a) {
+            flush();
             std::copy(a.value.begin(), a.value.end() + 1,
                       std::back_inserter(output));
           },
+          [&](const zero& z) { zeroes += z.size; },
+          [&](const location& l) {
+            if (!symbols) return;
+            auto& locations = symbols->locations;
+            const std::int64_t address = output.size() + zeroes;
+            if (!locations.empty() && locations.back().address == address) {
+              locations.pop_back();
+            }
+            locations.push_back({address, l.file, l.line, l.function});
+          },
+          [&](call_site) {
+            if (symbols) symbols->calls.push_back(output.size() + zeroes);
+          },
+          [&](return_site) {
+            if (symbols) symbols->returns.push_back(output.size() + zeroes);
+          },
         }, d);
       },
     }, statement);
   }
-  while (!output.empty() && output.back() == 0) output.pop_back();
+  bss_size = zeroes;
+  while (!output.empty() && output.back() == 0) {
+    output.pop_back();
+    bss_size++;
+  }
   return output;
 }
 
+export std::vector<std::int64_t> encode(std::span<const statement> input,
+                                        symbol_map& symbols,
+                                        std::int64_t& bss_size) {
+  return encode(input, &symbols, bss_size);
+}
+
+export std::vector<std::int64_t> encode(std::span<const statement> input,
+                                        symbol_map& symbols) {
+  std::int64_t bss_size;
+  return encode(input, &symbols, bss_size);
+}
+
+export std::vector<std::int64_t> encode(std::span<const statement> input) {
+  std::int64_t bss_size;
+  return encode(input, nullptr, bss_size);
+}
+
 }  // namespace as
@@ -0,0 +1,107 @@
+export module as.image;
+
+import <bit>;
+import <cstdint>;
+import <iostream>;
+import <optional>;
+import <span>;
+import <string_view>;
+
+namespace as {
+
+// A binary image of an encoded program, which can be mapped into memory and run
+// in place instead of being parsed. An image starts with a header of
+// little-endian 64-bit fields:
+//
+//   magic         The bytes "INTCODE" followed by a zero byte.
+//   version       The version of the format, which is currently 1.
+//   code_size     The number of cells of code.
+//   bss_size      The number of zero cells reserved after the code.
+//   symbols_size  The number of bytes in the symbol section, or 0 if the image
+//                 has no symbol map.
+//
+// The header is followed by the code, as little-endian 64-bit integers, and
+// then by the symbol map in the text format written by operator<<. Since the
+// header is a whole number of cells, the code is suitably aligned for use in
+// place whenever the image itself is.
+export struct image {
+  std::span<const std::int64_t> code;
+  std::int64_t bss_size = 0;
+  std::optional<std::string_view> symbols;
+};
+
+constexpr std::string_view image_magic{"INTCODE\0", 8};
+constexpr std::int64_t image_version = 1;
+constexpr int header_fields = 5;
+constexpr std::int64_t header_size = header_fields * sizeof(std::int64_t);
+
+void write_field(std::ostream& output, std::uint64_t value) {
+  char bytes[sizeof(value)];
+  for (char& byte : bytes) {
+    byte = value & 0xFF;
+    value >>= 8;
+  }
+  output.write(bytes, sizeof(bytes));
+}
+
+std::uint64_t read_field(std::string_view data, int index) {
+  std::uint64_t value = 0;
+  for (int i = sizeof(value) - 1; i >= 0; i--) {
+    value = value << 8 | (unsigned char)data[index * sizeof(value) + i];
+  }
+  return value;
+}
+
+export void write_image(std::ostream& output, const image& image) {
+  const std::string_view symbols = image.symbols.value_or("");
+  output.write(image_magic.data(), image_magic.size());
+  write_field(output, image_version);
+  write_field(output, image.code.size());
+  write_field(output, image.bss_size);
+  write_field(output, symbols.size());
+  for (std::int64_t x : image.code) write_field(output, x);
+  output.write(symbols.data(), symbols.size());
+}
+
+// Checks whether the data starts like an image rather than some other format.
+export bool is_image(std::string_view data) {
+  return data.starts_with(image_magic);
+}
+
+// Reads the header of an image and returns views of its contents, which refer
+// to the data rather than copying it. The data must be aligned to a cell.
+export image parse_image(std::string_view file, std::string_view data) {
+  const auto fail = [&](std::string_view message) {
+    std::cerr << file << ": error: " << message << "\n";
+    std::exit(1);
+  };
+  if (std::endian::native != std::endian::little) {
+    fail("Images can only be loaded on little-endian machines.");
+  }
+  if (!is_image(data) || data.size() < header_size) fail("Not an image.");
+  if (read_field(data, 1) != image_version) {
+    fail("Unsupported image version.");
+  }
+  const std::uint64_t code_size = read_field(data, 2);
+  const std::uint64_t bss_size = read_field(data, 3);
+  const std::uint64_t symbols_size = read_field(data, 4);
+  const std::uint64_t available = data.size() - header_size;
+  if (code_size > available / sizeof(std::int64_t) ||
+      symbols_size != available - code_size * sizeof(std::int64_t) ||
+      (std::int64_t)bss_size < 0) {
+    fail("Corrupt image header.");
+  }
+  if ((std::uintptr_t)data.data() % alignof(std::int64_t) != 0) {
+    fail("Misaligned image.");
+  }
+  image result;
+  result.code = std::span<const std::int64_t>(
+      (const std::int64_t*)(data.data() + header_size), code_size);
+  result.bss_size = bss_size;
+  if (symbols_size) {
+    result.symbols = data.substr(data.size() - symbols_size);
+  }
+  return result;
+}
+
+}  // namespace as
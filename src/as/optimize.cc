@@ -0,0 +1,765 @@
+export module as.optimize;
+
+import <algorithm>;
+import <cstdint>;
+import <map>;
+import <optional>;
+import <set>;
+import <span>;
+import <string>;
+import <string_view>;
+import <utility>;
+import <variant>;
+import <vector>;
+import as.ast;
+
+namespace as {
+
+template <typename... Ts>
+struct overload : Ts... { using Ts::operator()...; };
+template <typename... Ts>
+overload(Ts...) -> overload<Ts...>;
+
+export enum class pass {
+  // Simplifies individual instructions, such as by folding constants.
+  peephole,
+  // Replaces reads of scratch cells with the values that were copied into
+  // them, and computes values directly into the cells that they are copied to.
+  copy_propagation,
+  // Retargets jumps which lead to other jumps, and removes jumps to the
+  // instruction which follows.
+  jump_threading,
+  // Removes instructions which can never run.
+  unreachable_code,
+  // Removes writes to scratch cells which are never read.
+  dead_stores,
+};
+
+export constexpr pass all_passes[] = {
+  pass::peephole,         pass::copy_propagation, pass::jump_threading,
+  pass::unreachable_code, pass::dead_stores,
+};
+
+constexpr std::pair<std::string_view, pass> pass_names[] = {
+  {"peephole", pass::peephole},
+  {"copy_propagation", pass::copy_propagation},
+  {"jump_threading", pass::jump_threading},
+  {"unreachable_code", pass::unreachable_code},
+  {"dead_stores", pass::dead_stores},
+};
+
+// Parses a comma-separated list of pass names.
+export std::optional<std::vector<pass>> parse_passes(std::string_view list) {
+  std::vector<pass> output;
+  while (!list.empty()) {
+    const auto comma = list.find(',');
+    const auto name = list.substr(0, comma);
+    list = comma == list.npos ? "" : list.substr(comma + 1);
+    auto i = std::find_if(
+        std::begin(pass_names), std::end(pass_names),
+        [&](const auto& entry) { return entry.first == name; });
+    if (i == std::end(pass_names)) return std::nullopt;
+    output.push_back(i->second);
+  }
+  return output;
+}
+
+const input_param::type& value(const input_param& p) { return p.input; }
+const std::variant<address, relative>& value(const output_param& p) {
+  return p.output;
+}
+
+// Returns the name of the cell that a parameter accesses directly, if any.
+template <typename Param>
+const symbol* named_cell(const Param& p) {
+  auto* a = std::get_if<address>(&value(p));
+  if (!a) return nullptr;
+  auto* n = std::get_if<name>(&a->value);
+  return n ? &n->value : nullptr;
+}
+
+std::optional<std::int64_t> literal_value(const input_param& p) {
+  if (p.label) return std::nullopt;
+  auto* i = std::get_if<immediate>(&p.input);
+  if (!i) return std::nullopt;
+  auto* l = std::get_if<literal>(i);
+  if (!l) return std::nullopt;
+  return l->value;
+}
+
+bool same(const input_param& a, const input_param& b) {
+  const auto key = [](const input_param& p) {
+    return std::visit(overload{
+      [](const address& a) { return std::pair(0, a.value); },
+      [](const immediate& i) { return std::pair(1, i); },
+      [](const relative& r) { return std::pair(2, r.value); },
+    }, p.input);
+  };
+  const auto [x, i] = key(a);
+  const auto [y, j] = key(b);
+  if (x != y || i.index() != j.index()) return false;
+  return std::visit(overload{
+    [&](const literal& l) { return l.value == std::get<literal>(j).value; },
+    [&](const name& n) { return n.value == std::get<name>(j).value; },
+  }, i);
+}
+
+// Calls f on each parameter that the instruction reads.
+template <typename F>
+void for_each_input(instruction& i, F&& f) {
+  std::visit(overload{
+    [](literal&) {},
+    [&](calculation& c) { f(c.a); f(c.b); },
+    [](input&) {},
+    [&](output& o) { f(o.x); },
+    [&](jump& j) { f(j.condition); f(j.target); },
+    [&](adjust_relative_base& a) { f(a.amount); },
+    [](halt&) {},
+  }, i);
+}
+
+// Returns the parameter that the instruction writes, if any.
+output_param* output_of(instruction& i) {
+  return std::visit(overload{
+    [](literal&) -> output_param* { return nullptr; },
+    [](calculation& c) { return &c.out; },
+    [](input& i) { return &i.out; },
+    [](output&) -> output_param* { return nullptr; },
+    [](jump&) -> output_param* { return nullptr; },
+    [](adjust_relative_base&) -> output_param* { return nullptr; },
+    [](halt&) -> output_param* { return nullptr; },
+  }, i);
+}
+
+// Checks whether any parameter of the instruction has a label. Such
+// parameters are modified while the program runs, so the instruction must be
+// left as it is.
+bool patched(instruction& i) {
+  bool result = false;
+  for_each_input(i, [&](const input_param& p) { result |= bool(p.label); });
+  if (auto* o = output_of(i)) result |= bool(o->label);
+  return result;
+}
+
+// Checks whether the directive occupies cells in the program.
+bool is_data(const directive& d) {
+  return std::holds_alternative<integer>(d) ||
+         std::holds_alternative<ascii>(d) || std::holds_alternative<zero>(d);
+}
+
+bool is_jump(const instruction& i) {
+  return std::holds_alternative<jump_if_true>(i) ||
+         std::holds_alternative<jump_if_false>(i);
+}
+
+const jump& get_jump(const instruction& i) {
+  if (auto* j = std::get_if<jump_if_true>(&i)) return *j;
+  return std::get<jump_if_false>(i);
+}
+
+jump& get_jump(instruction& i) {
+  if (auto* j = std::get_if<jump_if_true>(&i)) return *j;
+  return std::get<jump_if_false>(i);
+}
+
+enum class branch { never, maybe, always };
+
+branch taken(const instruction& i) {
+  if (!is_jump(i)) return branch::never;
+  const auto condition = literal_value(get_jump(i).condition);
+  if (!condition) return branch::maybe;
+  const bool if_true = std::holds_alternative<jump_if_true>(i);
+  return (*condition != 0) == if_true ? branch::always : branch::never;
+}
+
+// Returns the label that a jump goes to, if it is a constant.
+const symbol* jump_target(const instruction& i) {
+  if (!is_jump(i)) return nullptr;
+  const auto& target = get_jump(i).target;
+  if (target.label) return nullptr;
+  auto* x = std::get_if<immediate>(&target.input);
+  if (!x) return nullptr;
+  auto* n = std::get_if<name>(x);
+  return n ? &n->value : nullptr;
+}
+
+// The optimizations rely on the following properties of the program, which
+// hold for the output of the compiler:
+//
+//   * A cell which is labelled, holds an .int, and never has its address
+//     used as a value is a scratch cell. Scratch cells are only ever accessed
+//     directly by name, never through a pointer.
+//   * The program starts at the first instruction, and the only labels that
+//     are jumped to indirectly are those whose addresses are used as values.
+//   * The only code which is modified as the program runs is parameters that
+//     have labels.
+class optimizer {
+ public:
+  explicit optimizer(std::vector<statement>& program) : program_(program) {}
+
+  bool run(pass p) {
+    analyze();
+    switch (p) {
+      case pass::peephole: peephole(); break;
+      case pass::copy_propagation: copy_propagation(); break;
+      case pass::jump_threading: jump_threading(); break;
+      case pass::unreachable_code: unreachable_code(); break;
+      case pass::dead_stores: dead_stores(); break;
+    }
+    return compact();
+  }
+
+ private:
+  // A run of statements which starts at a label or after a jump and always
+  // executes in order. Data and directives between blocks belong to none.
+  struct block {
+    int begin, end;
+    // Whether execution can continue from the previous block into this one.
+    bool adjacent;
+    std::vector<int> successors;
+  };
+
+  using cells = std::vector<bool>;
+
+  instruction* get_instruction(int i) {
+    return std::get_if<instruction>(&program_[i]);
+  }
+
+  std::optional<int> scratch(const symbol* name) const {
+    if (!name || scratch_[name->id()] == -1) return std::nullopt;
+    return scratch_[name->id()];
+  }
+
+  // Returns the scratch cell written by an instruction, if any.
+  std::optional<int> def(instruction& i) const {
+    auto* o = output_of(i);
+    if (!o || o->label) return std::nullopt;
+    return scratch(named_cell(*o));
+  }
+
+  void analyze() {
+    const int n = program_.size();
+    changed_ = false;
+    removed_.assign(n, false);
+    const int num_symbols = symbol::count();
+    // Find every name which is used as a value rather than as a cell or as
+    // the target of a jump.
+    taken_.assign(num_symbols, false);
+    const auto take = [&](const immediate& x) {
+      if (auto* n = std::get_if<name>(&x)) taken_[n->value.id()] = true;
+    };
+    const auto take_param = [&](const auto& p) {
+      std::visit(overload{
+        [](const address&) {},
+        [&](const immediate& x) { take(x); },
+        [&](const relative& r) { take(r.value); },
+      }, value(p));
+    };
+    for (auto& statement : program_) {
+      std::visit(overload{
+        [](label&) {},
+        [&](instruction& i) {
+          for_each_input(i, [&](const input_param& p) {
+            if (is_jump(i) && &p == &get_jump(i).target && jump_target(i)) {
+              return;
+            }
+            take_param(p);
+          });
+          if (auto* o = output_of(i)) take_param(*o);
+        },
+        [&](directive& d) {
+          std::visit(overload{
+            [&](define& d) {
+              taken_[d.name.id()] = true;
+              take_param(d.value);
+            },
+            [&](integer& i) { take(i.value); },
+            [](auto&) {},
+          }, d);
+        },
+      }, statement);
+    }
+    scratch_.assign(num_symbols, -1);
+    num_scratch_ = 0;
+    for (int i = 0; i + 1 < n; i++) {
+      auto* l = std::get_if<label>(&program_[i]);
+      auto* d = std::get_if<directive>(&program_[i + 1]);
+      if (!l || !d || !std::holds_alternative<integer>(*d)) continue;
+      if (taken_[l->name.id()]) continue;
+      scratch_[l->name.id()] = num_scratch_++;
+    }
+    // Split the code into blocks.
+    blocks_.clear();
+    labels_.assign(num_symbols, -1);
+    bool open = false, adjacent = true;
+    const auto start = [&](int i) {
+      blocks_.push_back({i, i, adjacent, {}});
+      open = adjacent = true;
+    };
+    for (int i = 0; i < n; i++) {
+      std::visit(overload{
+        [&](const label& l) {
+          start(i);
+          labels_[l.name.id()] = blocks_.size() - 1;
+        },
+        [&](const instruction& x) {
+          if (!open) start(i);
+          if (is_jump(x) || std::holds_alternative<halt>(x)) open = false;
+        },
+        [&](const directive& d) {
+          if (is_data(d)) open = adjacent = false;
+        },
+      }, program_[i]);
+      if (open || std::holds_alternative<instruction>(program_[i])) {
+        blocks_.back().end = i + 1;
+      }
+    }
+    // Work out where each block can continue to.
+    std::vector<int> indirect;
+    for (int id = 0; id < num_symbols; id++) {
+      if (taken_[id] && labels_[id] != -1) indirect.push_back(labels_[id]);
+    }
+    const int num_blocks = blocks_.size();
+    for (int b = 0; b < num_blocks; b++) {
+      auto& successors = blocks_[b].successors;
+      const auto last = last_instruction(b);
+      const bool next = b + 1 < num_blocks && blocks_[b + 1].adjacent;
+      if (!last) {
+        if (next) successors.push_back(b + 1);
+        continue;
+      }
+      const instruction& i = *get_instruction(*last);
+      if (std::holds_alternative<halt>(i)) continue;
+      const branch t = taken(i);
+      if (t != branch::always && next) successors.push_back(b + 1);
+      if (t == branch::never) continue;
+      if (auto* target = jump_target(i)) {
+        if (const int j = labels_[target->id()]; j != -1) {
+          successors.push_back(j);
+          continue;
+        }
+      }
+      successors.insert(successors.end(), indirect.begin(), indirect.end());
+    }
+    // Find the blocks that can run.
+    reachable_.assign(num_blocks, false);
+    std::vector<int> stack = indirect;
+    if (num_blocks) stack.push_back(0);
+    while (!stack.empty()) {
+      const int b = stack.back();
+      stack.pop_back();
+      if (reachable_[b]) continue;
+      reachable_[b] = true;
+      stack.insert(stack.end(), blocks_[b].successors.begin(),
+                   blocks_[b].successors.end());
+    }
+  }
+
+  // Returns the index of the last instruction in a block, if it has any.
+  std::optional<int> last_instruction(int b) {
+    for (int i = blocks_[b].end - 1; i >= blocks_[b].begin; i--) {
+      if (get_instruction(i)) return i;
+    }
+    return std::nullopt;
+  }
+
+  // Returns the index of the first instruction which runs from the given
+  // statement onwards, without jumping.
+  std::optional<int> next_instruction(int i) {
+    const int n = program_.size();
+    for (; i < n; i++) {
+      if (removed_[i]) continue;
+      if (get_instruction(i)) return i;
+      if (auto* d = std::get_if<directive>(&program_[i]); d && is_data(*d)) {
+        return std::nullopt;
+      }
+    }
+    return std::nullopt;
+  }
+
+  // Checks whether the instruction is marked as a call or a return, in which
+  // case it must keep its target so that tools can follow the call stack.
+  bool marked(int i) const {
+    if (i == 0) return false;
+    auto* d = std::get_if<directive>(&program_[i - 1]);
+    return d && (std::holds_alternative<call_site>(*d) ||
+                 std::holds_alternative<return_site>(*d));
+  }
+
+  void remove(int i) {
+    removed_[i] = true;
+    changed_ = true;
+    if (marked(i)) removed_[i - 1] = true;
+  }
+
+  void replace(int i, instruction x) {
+    program_[i] = std::move(x);
+    changed_ = true;
+  }
+
+  bool compact() {
+    int j = 0;
+    for (int i = 0, n = program_.size(); i < n; i++) {
+      if (removed_[i]) continue;
+      if (i != j) program_[j] = std::move(program_[i]);
+      j++;
+    }
+    program_.resize(j);
+    return changed_;
+  }
+
+  // Computes the set of scratch cells which may be read before they are
+  // written, at the end of each block.
+  std::vector<cells> live_out() {
+    const int num_blocks = blocks_.size();
+    const int num_cells = num_scratch_;
+    std::vector<cells> in(num_blocks, cells(num_cells)), out = in;
+    bool changed = true;
+    while (changed) {
+      changed = false;
+      for (int b = num_blocks - 1; b >= 0; b--) {
+        cells live(num_cells);
+        for (int s : blocks_[b].successors) {
+          for (int c = 0; c < num_cells; c++) {
+            if (in[s][c]) live[c] = true;
+          }
+        }
+        out[b] = live;
+        for (int i = blocks_[b].end - 1; i >= blocks_[b].begin; i--) {
+          if (auto* x = get_instruction(i)) step_back(*x, live);
+        }
+        if (live != in[b]) {
+          in[b] = std::move(live);
+          changed = true;
+        }
+      }
+    }
+    return out;
+  }
+
+  // Updates the live cells from those after an instruction to those before.
+  void step_back(instruction& i, cells& live) const {
+    if (auto d = def(i)) live[*d] = false;
+    for_each_input(i, [&](const input_param& p) {
+      if (auto s = scratch(named_cell(p))) live[*s] = true;
+    });
+  }
+
+  // The instructions of a block in order, along with the cells which are live
+  // after each of them.
+  std::vector<std::pair<int, cells>> liveness(int b, cells live) {
+    std::vector<std::pair<int, cells>> output;
+    for (int i = blocks_[b].end - 1; i >= blocks_[b].begin; i--) {
+      auto* x = get_instruction(i);
+      if (!x) continue;
+      output.emplace_back(i, live);
+      step_back(*x, live);
+    }
+    std::reverse(output.begin(), output.end());
+    return output;
+  }
+
+  void peephole() {
+    for (int i = 0, n = program_.size(); i < n; i++) {
+      auto* x = get_instruction(i);
+      if (!x || patched(*x)) continue;
+      simplify(i, *x);
+    }
+    // eq x, 0, *t; jz *t, target => jnz x, target, if t isn't used again.
+    const auto live = live_out();
+    for (int b = 0, n = blocks_.size(); b < n; b++) {
+      const auto j = last_instruction(b);
+      if (!j || marked(*j) || removed_[*j]) continue;
+      auto& jump = *get_instruction(*j);
+      if (!is_jump(jump) || patched(jump)) continue;
+      const auto t = scratch(named_cell(get_jump(jump).condition));
+      if (!t || live[b][*t]) continue;
+      std::optional<int> e;
+      for (int i = *j - 1; i >= blocks_[b].begin; i--) {
+        if (get_instruction(i)) {
+          e = i;
+          break;
+        }
+      }
+      if (!e || removed_[*e]) continue;
+      auto& previous = *get_instruction(*e);
+      auto* eq = std::get_if<equals>(&previous);
+      if (!eq || patched(previous) || def(previous) != t) continue;
+      input_param x;
+      if (literal_value(eq->a) == 0) {
+        x = eq->b;
+      } else if (literal_value(eq->b) == 0) {
+        x = eq->a;
+      } else {
+        continue;
+      }
+      const auto& target = get_jump(jump).target;
+      if (std::holds_alternative<jump_if_false>(jump)) {
+        replace(*j, jump_if_true{{x, target}});
+      } else {
+        replace(*j, jump_if_false{{x, target}});
+      }
+      remove(*e);
+    }
+  }
+
+  void simplify(int i, instruction& x) {
+    const auto copy = [&](const output_param& out, input_param value) {
+      replace(i, add{{{{}, immediate{literal{0}}}, std::move(value), out}});
+    };
+    const auto constant = [&](const output_param& out, std::int64_t value) {
+      copy(out, {{}, immediate{literal{value}}});
+    };
+    std::visit(overload{
+      [&](add& a) {
+        const auto l = literal_value(a.a), r = literal_value(a.b);
+        if (l && r) {
+          if (*l != 0) constant(a.out, *l + *r);
+        } else if (r == 0) {
+          copy(a.out, a.a);
+        }
+      },
+      [&](mul& m) {
+        const auto l = literal_value(m.a), r = literal_value(m.b);
+        if (l && r) {
+          constant(m.out, *l * *r);
+        } else if (l == 0 || r == 0) {
+          constant(m.out, 0);
+        } else if (l == 1) {
+          copy(m.out, m.b);
+        } else if (r == 1) {
+          copy(m.out, m.a);
+        }
+      },
+      [&](less_than& l) {
+        const auto a = literal_value(l.a), b = literal_value(l.b);
+        if (a && b) constant(l.out, *a < *b);
+      },
+      [&](equals& e) {
+        const auto a = literal_value(e.a), b = literal_value(e.b);
+        if (a && b) {
+          constant(e.out, *a == *b);
+        } else if (same(e.a, e.b)) {
+          constant(e.out, 1);
+        }
+      },
+      [](literal&) {},
+      [](input&) {},
+      [](output&) {},
+      [&](jump& j) {
+        switch (taken(x)) {
+          case branch::never:
+            remove(i);
+            break;
+          case branch::always:
+            if (std::holds_alternative<jump_if_true>(x)) {
+              replace(i, jump_if_false{{{{}, literal{0}}, j.target}});
+            }
+            break;
+          case branch::maybe:
+            break;
+        }
+      },
+      [](adjust_relative_base&) {},
+      [](halt&) {},
+    }, x);
+  }
+
+  // Checks whether the instruction is add 0, x, out, and returns x if so.
+  static const input_param* copied_value(instruction& i) {
+    auto* a = std::get_if<add>(&i);
+    if (!a || literal_value(a->a) != 0) return nullptr;
+    return &a->b;
+  }
+
+  void copy_propagation() {
+    // Forwards the values copied into scratch cells to the instructions which
+    // read them, within each block.
+    for (const auto& b : blocks_) {
+      std::map<int, input_param> known;
+      // Forgets everything that depends on a parameter for which pred holds.
+      const auto forget = [&](auto&& pred) {
+        std::erase_if(known, [&](const auto& entry) {
+          return pred(entry.second);
+        });
+      };
+      const auto reads_memory = [&](const input_param& p) {
+        return std::holds_alternative<relative>(p.input) ||
+               (std::holds_alternative<address>(p.input) &&
+                !scratch(named_cell(p)));
+      };
+      for (int i = b.begin; i < b.end; i++) {
+        auto* x = get_instruction(i);
+        if (!x) continue;
+        for_each_input(*x, [&](input_param& p) {
+          if (p.label) return;
+          const auto s = scratch(named_cell(p));
+          if (!s) return;
+          if (auto k = known.find(*s); k != known.end()) {
+            p = k->second;
+            changed_ = true;
+          }
+        });
+        if (std::holds_alternative<adjust_relative_base>(*x)) {
+          forget([](const input_param& p) {
+            return std::holds_alternative<relative>(p.input);
+          });
+        }
+        auto* o = output_of(*x);
+        if (!o) continue;
+        const input_param written = *o;
+        if (o->label || (std::holds_alternative<address>(o->output) &&
+                         !named_cell(*o))) {
+          // The write could be to almost anywhere.
+          forget(reads_memory);
+          continue;
+        }
+        forget([&](const input_param& p) {
+          if (std::holds_alternative<relative>(p.input) &&
+              std::holds_alternative<relative>(written.input)) {
+            return true;
+          }
+          return same(p, written);
+        });
+        const auto s = scratch(named_cell(*o));
+        if (!s) continue;
+        known.erase(*s);
+        const auto* v = copied_value(*x);
+        if (v && !v->label && !same(*v, written)) known.emplace(*s, *v);
+      }
+    }
+    if (changed_) return;
+    // op a, b, *t; add 0, *t, out => op a, b, out, if t isn't used again.
+    const auto live = live_out();
+    for (int b = 0, n = blocks_.size(); b < n; b++) {
+      const auto instructions = liveness(b, live[b]);
+      for (int k = 0, m = instructions.size(); k + 1 < m; k++) {
+        const int i = instructions[k].first;
+        const auto& [j, after] = instructions[k + 1];
+        if (removed_[i] || removed_[j]) continue;
+        auto& x = *get_instruction(i);
+        auto& y = *get_instruction(j);
+        if (patched(x) || patched(y)) continue;
+        const auto t = def(x);
+        const auto* v = copied_value(y);
+        if (!t || !v || scratch(named_cell(*v)) != t || after[*t]) continue;
+        *output_of(x) = *output_of(y);
+        changed_ = true;
+        remove(j);
+      }
+    }
+  }
+
+  void jump_threading() {
+    const int n = program_.size();
+    // Returns the index of the first instruction at a label, if it has one.
+    const auto destination =
+        [&](const symbol& name) -> std::optional<int> {
+      const int b = labels_[name.id()];
+      if (b == -1) return std::nullopt;
+      return next_instruction(blocks_[b].begin);
+    };
+    // Checks for an unconditional jump to a constant target.
+    const auto is_goto = [&](int i) {
+      auto& x = *get_instruction(i);
+      return taken(x) == branch::always && jump_target(x) && !patched(x) &&
+             !marked(i);
+    };
+    for (int i = 0; i < n; i++) {
+      auto* x = get_instruction(i);
+      if (!x || removed_[i] || !jump_target(*x) || patched(*x) || marked(i)) {
+        continue;
+      }
+      // Follow chains of jumps to find where this one really ends up.
+      symbol target = *jump_target(*x);
+      std::set<int> seen = {target.id()};
+      while (true) {
+        const auto d = destination(target);
+        if (!d || !is_goto(*d)) break;
+        const symbol next = *jump_target(*get_instruction(*d));
+        if (!seen.insert(next.id()).second) break;
+        target = next;
+      }
+      if (target != *jump_target(*x)) {
+        get_jump(*x).target = {{}, immediate{name{target}}};
+        changed_ = true;
+      }
+      const auto d = destination(target);
+      const auto next = next_instruction(i + 1);
+      if (d && d == next) {
+        remove(i);
+        continue;
+      }
+      // jz x, a; jz 0, b; a: => jnz x, b
+      if (!next || !is_goto(*next) || taken(*x) != branch::maybe) continue;
+      bool labelled = false;
+      for (int k = i + 1; k < *next; k++) {
+        labelled |= std::holds_alternative<label>(program_[k]);
+      }
+      if (labelled || d != next_instruction(*next + 1)) continue;
+      const auto& condition = get_jump(*x).condition;
+      const auto& other = get_jump(*get_instruction(*next)).target;
+      if (std::holds_alternative<jump_if_false>(*x)) {
+        replace(i, jump_if_true{{condition, other}});
+      } else {
+        replace(i, jump_if_false{{condition, other}});
+      }
+      remove(*next);
+    }
+  }
+
+  void unreachable_code() {
+    for (int b = 0, n = blocks_.size(); b < n; b++) {
+      if (reachable_[b]) continue;
+      for (int i = blocks_[b].begin; i < blocks_[b].end; i++) {
+        auto* x = get_instruction(i);
+        if (x && !patched(*x)) remove(i);
+      }
+    }
+  }
+
+  void dead_stores() {
+    const auto live = live_out();
+    for (int b = 0, n = blocks_.size(); b < n; b++) {
+      cells now = live[b];
+      for (int i = blocks_[b].end - 1; i >= blocks_[b].begin; i--) {
+        auto* x = get_instruction(i);
+        if (!x) continue;
+        const auto d = def(*x);
+        if (d && !now[*d] && !std::holds_alternative<input>(*x) &&
+            !patched(*x)) {
+          remove(i);
+          continue;
+        }
+        step_back(*x, now);
+      }
+    }
+  }
+
+  std::vector<statement>& program_;
+  bool changed_;
+  std::vector<bool> removed_;
+  // Whether each name is used as a value, indexed by symbol id.
+  std::vector<bool> taken_;
+  // The number of each scratch cell, or -1 for other names, by symbol id.
+  std::vector<int> scratch_;
+  int num_scratch_;
+  std::vector<block> blocks_;
+  // The block starting at each label, or -1, indexed by symbol id.
+  std::vector<int> labels_;
+  std::vector<bool> reachable_;
+};
+
+// Runs the passes in order, repeatedly until none of them changes anything.
+export void optimize(std::vector<statement>& program,
+                     std::span<const pass> passes = all_passes) {
+  optimizer o(program);
+  constexpr int max_rounds = 10;
+  for (int round = 0; round < max_rounds; round++) {
+    bool changed = false;
+    for (pass p : passes) changed |= o.run(p);
+    if (!changed) break;
+  }
+}
+
+}  // namespace as
@@ -13,14 +13,16 @@ import <string_view>;
 import <variant>;
 import <vector>;
 import as.ast;
+import util.io;
 
 namespace as {
 
 struct parser {
   std::string_view file, source;
-  int line = 1, column = 1;
+  line_index lines{source};
 
   [[noreturn]] void die(std::string_view message) const {
+    const auto [line, column] = lines.find(source.data());
     std::cerr << file << ":" << line << ":" << column << ": error: "
               << message << "\n";
     std::exit(1);
@@ -38,14 +40,6 @@ struct parser {
 
   void advance(std::size_t amount) {
     assert(amount <= source.size());
-    for (char c : source.substr(0, amount)) {
-      if (c == '\n') {
-        line++;
-        column = 1;
-      } else {
-        column++;
-      }
-    }
     source.remove_prefix(amount);
   }
 
@@ -77,10 +71,11 @@ struct parser {
     auto i = std::find_if(
         source.data(), source.data() + source.size(),
         [](char c) { return !(std::isalnum(c) || c == '_'); });
-    name output{std::string{source.substr(0, i - source.data())}};
-    if (output.value.empty()) die("Expected name.");
-    if (std::isdigit(output.value[0])) die("Names cannot start with numbers.");
-    advance(output.value.size());
+    const auto value = source.substr(0, i - source.data());
+    if (value.empty()) die("Expected name.");
+    if (std::isdigit(value[0])) die("Names cannot start with numbers.");
+    name output{value};
+    advance(value.size());
     return output;
   }
 
@@ -188,6 +183,33 @@ struct parser {
     return c;
   }
 
+  std::string parse_string() {
+    eat("\"");
+    std::string value;
+    while (peek() != '"') {
+      if (peek() == '\\') {
+        advance(1);
+        switch (peek()) {
+          case '\\':
+          case '"':
+            value.push_back(get());
+            break;
+          case 'n':
+            value.push_back('\n');
+            advance(1);
+            break;
+          default:
+            die("Invalid escape sequence.");
+        }
+      } else {
+        value.push_back(get());
+      }
+    }
+    assert(source[0] == '"');
+    advance(1);
+    return value;
+  }
+
   directive parse_directive() {
     eat(".");
     auto [id] = parse_name();
@@ -199,30 +221,20 @@ struct parser {
       auto value = parse_immediate();
       return integer{value};
     } else if (id == "ascii") {
-      eat("\"");
-      std::string value;
-      while (peek() != '"') {
-        if (peek() == '\\') {
-          advance(1);
-          switch (peek()) {
-            case '\\':
-            case '"':
-              value.push_back(get());
-              break;
-            case 'n':
-              value.push_back('\n');
-              advance(1);
-              break;
-            default:
-              die("Invalid escape sequence.");
-          }
-        } else {
-          value.push_back(get());
-        }
-      }
-      assert(source[0] == '"');
-      advance(1);
-      return ascii{std::move(value)};
+      return ascii{parse_string()};
+    } else if (id == "zero") {
+      auto [size] = parse_literal();
+      if (size < 0) die("Invalid size.");
+      return zero{size};
+    } else if (id == "loc") {
+      auto file = parse_string();
+      auto [line] = parse_literal();
+      auto [function] = parse_name();
+      return location{std::move(file), (int)line, std::move(function)};
+    } else if (id == "call") {
+      return call_site{};
+    } else if (id == "return") {
+      return return_site{};
     } else {
       die("Invalid directive.");
     }
@@ -240,7 +252,7 @@ struct parser {
         eat(":");
         return label{id};
       } else {
-        return parse_instruction(id);
+        return parse_instruction(id.str());
       }
     } else {
       die("Expected label or instruction.");
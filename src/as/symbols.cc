@@ -0,0 +1,97 @@
+export module as.symbols;
+
+import <algorithm>;
+import <cstdint>;
+import <iomanip>;
+import <iostream>;
+import <optional>;
+import <sstream>;
+import <string>;
+import <string_view>;
+import <vector>;
+import as.ast;
+
+namespace as {
+
+// Describes where things are in an encoded program, so that tools can relate
+// addresses back to the assembly or to the source code that it came from.
+export struct symbol_map {
+  struct location {
+    std::int64_t address;
+    std::string file;
+    int line;
+    std::string function;
+  };
+
+  // The address of each label, indexed by symbol id.
+  std::vector<std::optional<std::int64_t>> labels;
+  // Where the code at each address came from, in order of address. Each
+  // location covers the code up to the next one.
+  std::vector<location> locations;
+  // The addresses of the jumps which call functions and return from them.
+  std::vector<std::int64_t> calls, returns;
+
+  void set_label(const symbol& name, std::int64_t address) {
+    if ((int)labels.size() <= name.id()) labels.resize(symbol::count());
+    labels[name.id()] = address;
+  }
+
+  // Returns the location covering the given address, if there is one.
+  const location* find(std::int64_t address) const {
+    auto i = std::upper_bound(
+        locations.begin(), locations.end(), address,
+        [](std::int64_t a, const location& l) { return a < l.address; });
+    return i == locations.begin() ? nullptr : &*(i - 1);
+  }
+};
+
+// Writes the symbol map in a line-based text format which can be read back
+// with parse_symbols.
+export std::ostream& operator<<(std::ostream& output, const symbol_map& s) {
+  for (int id = 0, n = s.labels.size(); id < n; id++) {
+    if (!s.labels[id]) continue;
+    output << "label " << symbol::from_id(id) << " " << *s.labels[id] << "\n";
+  }
+  for (const auto& l : s.locations) {
+    output << "loc " << l.address << " " << std::quoted(l.file) << " "
+           << l.line << " " << l.function << "\n";
+  }
+  for (auto address : s.calls) output << "call " << address << "\n";
+  for (auto address : s.returns) output << "return " << address << "\n";
+  return output;
+}
+
+export symbol_map parse_symbols(std::string_view file,
+                                std::string_view source) {
+  symbol_map output;
+  std::istringstream input{std::string(source)};
+  std::string line;
+  for (int line_number = 1; std::getline(input, line); line_number++) {
+    std::istringstream fields(line);
+    std::string kind;
+    fields >> kind;
+    if (kind == "label") {
+      std::string name;
+      std::int64_t address;
+      fields >> name >> address;
+      output.set_label(name, address);
+    } else if (kind == "loc") {
+      symbol_map::location l;
+      fields >> l.address >> std::quoted(l.file) >> l.line >> l.function;
+      output.locations.push_back(std::move(l));
+    } else if (kind == "call") {
+      fields >> output.calls.emplace_back();
+    } else if (kind == "return") {
+      fields >> output.returns.emplace_back();
+    } else if (!kind.empty()) {
+      fields.setstate(std::ios::failbit);
+    }
+    if (fields.fail()) {
+      std::cerr << file << ":" << line_number << ": error: Invalid symbol.\n";
+      std::exit(1);
+    }
+  }
+  return output;
+}
+
+}  // namespace as
@@ -0,0 +1,351 @@
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+
+import "util/check.h";
+import <chrono>;
+import <fstream>;
+import <iomanip>;
+import <iostream>;
+import <optional>;
+import <string>;
+import <map>;
+import <span>;
+import <variant>;
+import <vector>;
+import compiler.ast;
+import compiler.codegen;
+import compiler.parser;
+import as.parser;
+import as.encode;
+import as.image;
+import intcode;
+import network;
+import util.io;
+import util.value_ptr;
+
+template <typename... Ts> struct overload : Ts... { using Ts::operator()...; };
+template <typename... Ts> overload(Ts...) -> overload<Ts...>;
+
+struct flag {
+  using load_bool = void();
+  using load_value = void(const char*);
+
+  std::string_view name;
+  std::optional<const char*> value;
+  std::string_view description;
+  std::variant<load_bool*, load_value*> load;
+};
+
+struct {
+  const char* input;
+  int iterations;
+  int batch;
+  int network;
+  std::span<char*> positional;
+} args;
+
+void show_usage_and_exit();
+
+constexpr flag flags[] = {
+  {"help", {}, "Displays the usage information.", show_usage_and_exit},
+  {"input", "", "File to provide as input to each program.",
+   +[](const char* x) { args.input = x; }},
+  {"iterations", "10", "Number of times to run each program.",
+   +[](const char* x) {
+     args.iterations = std::atoi(x);
+     if (args.iterations <= 0) {
+       std::cerr << "Invalid number of iterations.\n";
+       std::exit(1);
+     }
+   }},
+  {"batch", "0", "Also run this many copies of each program in lockstep.",
+   +[](const char* x) {
+     args.batch = std::atoi(x);
+     if (args.batch < 0) {
+       std::cerr << "Invalid batch size.\n";
+       std::exit(1);
+     }
+   }},
+  {"network", "0",
+   "Also run this many copies of each program at once on a network of "
+   "threads.",
+   +[](const char* x) {
+     args.network = std::atoi(x);
+     if (args.network < 0) {
+       std::cerr << "Invalid network size.\n";
+       std::exit(1);
+     }
+   }},
+};
+
+void show_usage_and_exit() {
+  std::cout << "Built on " __DATE__ " at " __TIME__ "\n\nFlags:\n";
+  for (const flag& f : flags) {
+    std::cout << "  --" << f.name << "\t" << f.description;
+    if (f.value) std::cout << " Default value: " << std::quoted(*f.value);
+    std::cout << "\n";
+  }
+  std::exit(0);
+}
+
+void read_options(int& argc, char**& argv) {
+  for (const flag& f : flags) {
+    if (auto* load = std::get_if<flag::load_value*>(&f.load)) {
+      (*load)(f.value.value());
+    }
+  }
+  bool options_done = false;
+  int j = 1;
+  for (int i = 1; i < argc; i++) {
+    std::string_view argument = argv[i];
+    if (options_done || !argument.starts_with("--")) {
+      argv[j++] = argv[i];
+    } else if (argument == "--") {
+      options_done = true;
+    } else {
+      // Values may be given either as --name=value or as --name value.
+      std::string_view name = argument.substr(2);
+      const char* value = nullptr;
+      if (auto equals = name.find('='); equals != name.npos) {
+        value = argv[i] + 2 + equals + 1;
+        name = name.substr(0, equals);
+      }
+      for (const flag& f : flags) {
+        if (name == f.name) {
+          std::visit(overload{
+            [&](flag::load_bool* load) {
+              if (value) {
+                std::cerr << "Unexpected argument for --" << f.name << ".\n";
+                std::exit(1);
+              }
+              load();
+            },
+            [&](flag::load_value* load) {
+              if (value) {
+                load(value);
+              } else if (++i < argc &&
+                         !std::string_view(argv[i]).starts_with("--")) {
+                load(argv[i]);
+              } else {
+                std::cerr << "Missing argument for --" << f.name << ".\n";
+                std::exit(1);
+              }
+            },
+          }, f.load);
+        }
+      }
+    }
+  }
+  argc = j;
+  args.positional = std::span<char*>(argv, argc);
+}
+
+std::vector<program::value_type> load(const char* filename) {
+  auto extension = std::filesystem::path(filename).extension();
+  if (extension == ".icb") {
+    const auto image = as::parse_image(filename, contents(filename));
+    return {image.code.begin(), image.code.end()};
+  } else if (extension == ".ic") {
+    return program::load(contents(filename));
+  } else if (extension == ".asm") {
+    return as::encode(as::parse(filename, contents(filename)));
+  } else if (extension == ".is") {
+    auto code = compiler::load(filename);
+    return as::encode(compiler::generate(code));
+  } else {
+    std::cerr << "Unknown extension " << std::quoted(extension.c_str())
+              << ", must be \".icb\", \".ic\", \".asm\", or \".is\".\n";
+    std::exit(1);
+  }
+}
+
+struct result {
+  std::chrono::nanoseconds time;
+  std::string output;
+};
+
+// Runs the program to completion with the given input, in the same way as the
+// run tool does: reading past the end of the input produces -1.
+result run(program::const_span code, program::engine engine,
+           std::string_view input) {
+  const auto start = std::chrono::steady_clock::now();
+  program program(code, engine);
+  std::string output;
+  while (!program.done()) {
+    switch (program.resume()) {
+      case program::ready:
+        std::cerr << "Program paused for no reason.\n";
+        std::abort();
+      case program::waiting_for_input:
+        if (input.empty()) {
+          program.provide_input(-1);
+        } else {
+          program.provide_input(input.front());
+          input.remove_prefix(1);
+        }
+        break;
+      case program::output:
+        output.push_back(program.get_output());
+        break;
+      case program::halt:
+        break;
+    }
+  }
+  const auto end = std::chrono::steady_clock::now();
+  return {end - start, std::move(output)};
+}
+
+// Runs many copies of the program in lockstep with the same input, and
+// returns the time taken per copy along with the output of the last copy.
+result run_batch(program::const_span code, int size, std::string_view input) {
+  const auto start = std::chrono::steady_clock::now();
+  batch batch(code, size);
+  for (int i = 0; i < size; i++) {
+    for (char c : input) batch.provide_input(i, c);
+  }
+  while (true) {
+    batch.run();
+    bool done = true;
+    for (int i = 0; i < size; i++) {
+      if (batch.get_state(i) == program::halt) continue;
+      batch.provide_input(i, -1);
+      done = false;
+    }
+    if (done) break;
+  }
+  const auto end = std::chrono::steady_clock::now();
+  std::string output;
+  for (int i = 0; i < size; i++) {
+    const auto lane = batch.output(i);
+    output.assign(lane.begin(), lane.end());
+    if (i == 0) continue;
+    if (!std::equal(lane.begin(), lane.end(), batch.output(0).begin(),
+                    batch.output(0).end())) {
+      std::cerr << "Copies in a batch produced different outputs.\n";
+      std::exit(1);
+    }
+  }
+  return {(end - start) / size, std::move(output)};
+}
+
+// Runs many forks of the program at once on a network, each with its own input
+// and output channels, and returns the time taken per copy along with the
+// output of the last copy.
+result run_network(program::const_span code, int size,
+                   std::string_view input) {
+  const auto start = std::chrono::steady_clock::now();
+  network network;
+  program original(std::in_place, code);
+  std::vector<channel*> outputs;
+  for (int i = 0; i < size; i++) {
+    const int id = network.add(original.fork());
+    channel& channel = network.input(id, input.size() + 1);
+    for (char c : input) channel.push(c);
+    network.set_default_input(id, -1);
+    outputs.push_back(&network.output(id));
+  }
+  // Output channels are only read between runs, so the network stops
+  // whenever one of them fills up.
+  std::vector<std::string> output(size);
+  while (true) {
+    network.run();
+    bool done = true;
+    for (int i = 0; i < size; i++) {
+      while (auto x = outputs[i]->pop()) output[i].push_back(*x);
+      if (!network.get(i).done()) done = false;
+    }
+    if (done) break;
+  }
+  const auto end = std::chrono::steady_clock::now();
+  for (int i = 1; i < size; i++) {
+    if (output[i] != output[0]) {
+      std::cerr << "Copies in a network produced different outputs.\n";
+      std::exit(1);
+    }
+  }
+  return {(end - start) / size, std::move(output.back())};
+}
+
+// Reads the whole of the file given by --input. Regular files are mapped into
+// memory, while anything else, such as a pipe, is read into storage.
+std::string_view read_input(std::string& storage) {
+  if (!*args.input) return {};
+  const int fd = open(args.input, O_RDONLY);
+  if (fd < 0) {
+    std::cerr << "Cannot open input file " << std::quoted(args.input) << ".\n";
+    std::exit(1);
+  }
+  if (auto data = map_file(fd)) {
+    close(fd);
+    return *data;
+  }
+  char buffer[1 << 16];
+  while (true) {
+    const ssize_t n = read(fd, buffer, sizeof(buffer));
+    if (n < 0 && errno == EINTR) continue;
+    if (n < 0) {
+      std::cerr << "Failed to read input.\n";
+      std::exit(1);
+    }
+    if (n == 0) break;
+    storage.append(buffer, n);
+  }
+  close(fd);
+  return storage;
+}
+
+int main(int argc, char* argv[]) {
+  read_options(argc, argv);
+  if (args.positional.size() < 2) {
+    std::cerr << "Usage: benchmark [--input <file>] [--batch <size>] "
+                 "[--network <size>] <filename>...\n";
+    return 1;
+  }
+  std::string input_storage;
+  const std::string_view input = read_input(input_storage);
+  constexpr std::pair<const char*, program::engine> engines[] = {
+    {"simple", program::engine::simple},
+    {"predecoded", program::engine::predecoded},
+    {"threaded", program::engine::threaded},
+    {"jit", program::engine::jit},
+  };
+  std::cout << std::left << std::setw(32) << "program" << std::setw(12)
+            << "engine" << std::right << std::setw(12) << "time (us)"
+            << std::setw(10) << "speedup" << '\n';
+  for (const char* filename : args.positional.subspan(1)) {
+    const auto code = load(filename);
+    std::optional<std::string> expected_output;
+    double baseline = 0;
+    std::vector<std::pair<const char*, std::optional<program::engine>>> modes(
+        std::begin(engines), std::end(engines));
+    if (args.batch) modes.emplace_back("batch", std::nullopt);
+    if (args.network) modes.emplace_back("network", std::nullopt);
+    const auto run_mode = [&](std::string_view name,
+                              std::optional<program::engine> engine) {
+      if (engine) return run(code, *engine, input);
+      if (name == "batch") return run_batch(code, args.batch, input);
+      return run_network(code, args.network, input);
+    };
+    for (const auto& [name, engine] : modes) {
+      auto best = std::chrono::nanoseconds::max();
+      for (int i = 0; i < args.iterations; i++) {
+        auto [time, output] = run_mode(name, engine);
+        if (!expected_output) expected_output = output;
+        if (output != *expected_output) {
+          std::cerr << "Output from the " << name << " engine does not match "
+                    << "the output from the " << engines[0].first
+                    << " engine for " << std::quoted(filename) << ".\n";
+          return 1;
+        }
+        best = std::min(best, time);
+      }
+      const double micros = best.count() / 1000.0;
+      if (baseline == 0) baseline = micros;
+      std::cout << std::left << std::setw(32) << filename << std::setw(12)
+                << name << std::right << std::fixed << std::setprecision(1)
+                << std::setw(12) << micros << std::setw(9)
+                << std::setprecision(2) << baseline / micros << "x\n";
+    }
+  }
+}
@@ -7,8 +7,12 @@ import <iomanip>;
 import <iostream>;
 import <map>;
 import <span>;
+import <sstream>;
 import as.ast;
 import as.encode;
+import as.image;
+import as.optimize;
+import as.symbols;
 import compiler.ast;
 import compiler.codegen;
 import compiler.parser;
@@ -29,7 +33,10 @@ struct flag {
 struct {
   const char* input;
   const char* output;
-  enum { assembly, intcode } output_type;
+  const char* symbols;
+  enum { assembly, intcode, binary } output_type;
+  bool optimize;
+  std::vector<as::pass> passes;
   std::span<char*> positional;
 } args;
 
@@ -39,17 +46,35 @@ constexpr flag flags[] = {
   {"help", {}, "Displays the usage information.", show_usage_and_exit},
   {"input", "-", "File to read from.", +[](const char* x) { args.input = x; }},
   {"output", "-", "File to write to.", +[](const char* x) { args.output = x; }},
-  {"output_type", "intcode", "Output format (assembly or intcode).",
+  {"symbols", "", "File to write a symbol map to, for use by run.",
+   +[](const char* x) { args.symbols = x; }},
+  {"output_type", "intcode",
+   "Output format (assembly, intcode, or binary). Binary images include the "
+   "symbol map and can be run without being parsed.",
    +[](const char* x) {
      if (x == std::string_view("assembly")) {
        args.output_type = args.assembly;
      } else if (x == std::string_view("intcode")) {
        args.output_type = args.intcode;
+     } else if (x == std::string_view("binary")) {
+       args.output_type = args.binary;
      } else {
        std::cerr << "Invalid output type.\n";
        std::exit(1);
      }
    }},
+  {"optimize", {}, "Optimize the compiled program. Can also be given as -O.",
+   +[]() { args.optimize = true; }},
+  {"passes", "peephole,copy_propagation,jump_threading,unreachable_code,"
+   "dead_stores", "Comma-separated list of optimization passes to run.",
+   +[](const char* x) {
+     if (auto passes = as::parse_passes(x)) {
+       args.passes = std::move(*passes);
+     } else {
+       std::cerr << "Invalid list of passes.\n";
+       std::exit(1);
+     }
+   }},
 };
 
 void show_usage_and_exit() {
@@ -72,17 +97,35 @@ void read_options(int& argc, char**& argv) {
   int j = 1;
   for (int i = 1; i < argc; i++) {
     std::string_view argument = argv[i];
-    if (options_done || !argument.starts_with("--")) {
+    if (!options_done && argument == "-O") {
+      args.optimize = true;
+    } else if (options_done || !argument.starts_with("--")) {
       argv[j++] = argv[i];
     } else if (argument == "--") {
       options_done = true;
     } else {
+      // Values may be given either as --name=value or as --name value.
+      std::string_view name = argument.substr(2);
+      const char* value = nullptr;
+      if (auto equals = name.find('='); equals != name.npos) {
+        value = argv[i] + 2 + equals + 1;
+        name = name.substr(0, equals);
+      }
       for (const flag& f : flags) {
-        if (argument.substr(2) == f.name) {
+        if (name == f.name) {
           std::visit(overload{
-            [&](flag::load_bool* load) { load(); },
+            [&](flag::load_bool* load) {
+              if (value) {
+                std::cerr << "Unexpected argument for --" << f.name << ".\n";
+                std::exit(1);
+              }
+              load();
+            },
             [&](flag::load_value* load) {
-              if (++i < argc && !std::string_view(argv[i]).starts_with("--")) {
+              if (value) {
+                load(value);
+              } else if (++i < argc &&
+                         !std::string_view(argv[i]).starts_with("--")) {
                 load(argv[i]);
               } else {
                 std::cerr << "Missing argument for --" << f.name << ".\n";
@@ -98,16 +141,30 @@ void read_options(int& argc, char**& argv) {
   args.positional = std::span<char*>(argv, argc);
 }
 
+// Writes the symbol map for the program to the file given by --symbols.
+void write_symbols(std::span<const as::statement> program) {
+  as::symbol_map symbols;
+  as::encode(program, symbols);
+  std::ofstream file(args.symbols);
+  if (!file.good()) {
+    std::cerr << "Could not open " << std::quoted(args.symbols)
+              << " for writing.\n";
+    std::exit(1);
+  }
+  file << symbols;
+}
+
 int main(int argc, char* argv[]) {
   read_options(argc, argv);
   auto code = compiler::load(args.input);
   auto compiled = compiler::generate(code);
+  if (args.optimize) as::optimize(compiled, args.passes);
   std::ofstream file;
   std::ostream* output;
   if (args.output == std::string_view("-")) {
     output = &std::cout;
   } else {
-    file.open(args.output);
+    file.open(args.output, std::ios::binary);
     if (!file.good()) {
       std::cerr << "Could not open " << std::quoted(args.output)
                 << " for writing.\n";
@@ -117,6 +174,13 @@ int main(int argc, char* argv[]) {
   }
   if (args.output_type == args.assembly) {
     for (auto& x : compiled) *output << x << '\n';
+  } else if (args.output_type == args.binary) {
+    as::symbol_map symbols;
+    std::int64_t bss_size;
+    const auto encoded = as::encode(compiled, symbols, bss_size);
+    std::ostringstream symbol_text;
+    symbol_text << symbols;
+    as::write_image(*output, {encoded, bss_size, symbol_text.str()});
   } else {
     auto encoded = encode(compiled);
     bool first = true;
@@ -130,4 +194,5 @@ int main(int argc, char* argv[]) {
     }
     *output << '\n';
   }
+  if (*args.symbols) write_symbols(compiled);
 }
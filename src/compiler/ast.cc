@@ -24,6 +24,8 @@ export struct call;
 export struct add;
 export struct sub;
 export struct mul;
+export struct div;
+export struct mod;
 export struct less_than;
 export struct equals;
 export struct input;
@@ -31,8 +33,9 @@ export struct read;
 export struct logical_and;
 export struct logical_or;
 export struct expression {
-  using type = std::variant<literal, name, call, add, sub, mul, less_than,
-                            equals, input, read, logical_and, logical_or>;
+  using type = std::variant<literal, name, call, add, sub, mul, div, mod,
+                            less_than, equals, input, read, logical_and,
+                            logical_or>;
   value_ptr<type> value;
 
   template <typename T> static expression wrap(T&& value) {
@@ -47,6 +50,8 @@ export struct calculation { expression left, right; };
 export struct add : calculation {};
 export struct sub : calculation {};
 export struct mul : calculation {};
+export struct div : calculation {};
+export struct mod : calculation {};
 export struct less_than : calculation {};
 export struct equals : calculation {};
 export struct logical_and : calculation {};
@@ -108,6 +113,8 @@ export struct statement {
                             output_statement, return_statement, break_statement,
                             continue_statement, halt_statement>;
   value_ptr<type> value;
+  // The line that the statement starts on, or 0 if it is not known.
+  int line = 0;
 
   template <typename T>
   static statement wrap(T&& value) {
@@ -138,6 +145,10 @@ export struct function_definition {
   std::string name;
   std::vector<std::string> parameters;
   std::vector<statement> body;
+  int line = 0;
+  // Set by the inline keyword, which asks for the function to be inlined at its
+  // call sites regardless of its size.
+  bool is_inline = false;
 };
 export struct declaration {
   using type = std::variant<constant, declare_scalar, declare_array,
@@ -208,6 +219,14 @@ export std::ostream& operator<<(std::ostream& output, const mul& m) {
   return output << "(" << m.left << " * " << m.right << ")";
 }
 
+export std::ostream& operator<<(std::ostream& output, const div& d) {
+  return output << "(" << d.left << " / " << d.right << ")";
+}
+
+export std::ostream& operator<<(std::ostream& output, const mod& m) {
+  return output << "(" << m.left << " % " << m.right << ")";
+}
+
 export std::ostream& operator<<(std::ostream& output, const less_than& l) {
   return output << "(" << l.left << " < " << l.right << ")";
 }
@@ -387,6 +406,7 @@ export std::ostream& operator<<(
 
 export std::ostream& print(
     std::ostream& output, const function_definition& f, int indent) {
+  if (f.is_inline) output << "inline ";
   output << "function " << f.name << "(";
   bool first = true;
   for (const auto& parameter : f.parameters) {
@@ -4,11 +4,15 @@ module;
 
 export module compiler.codegen;
 
+import <algorithm>;
+import <cstdint>;
 import <filesystem>;
 import <map>;
 import <string>;
+import <string_view>;
 import <iostream>;
 import <iomanip>;
+import <list>;
 import <sstream>;
 import <span>;
 import <set>;
@@ -31,11 +35,328 @@ overload(Ts...) -> overload<Ts...>;
   std::abort();  // std::exit(1);
 }
 
+// Number of cells reserved for the call stack, which lies between the data and
+// the heap. Every function checks on entry that its frame fits in what is
+// left, and the program prints an error and halts if it doesn't.
+constexpr int stack_size = 1 << 16;
+
+// The most cells that a division pushes onto the stack beyond the frame.
+constexpr int division_stack_size = 66;
+
+// Functions whose bodies have at most this many expressions are inlined at
+// their call sites.
+constexpr int inline_threshold = 32;
+
+bool contains_call(const expression& e) {
+  return std::visit(overload{
+    [](const literal&) { return false; },
+    [](const name&) { return false; },
+    [](const call&) { return true; },
+    [](const calculation& c) {
+      return contains_call(c.left) || contains_call(c.right);
+    },
+    [](const input&) { return false; },
+    [](const read& r) { return contains_call(r.address); },
+  }, *e.value);
+}
+
+// Calls f for the expression and each of its subexpressions.
+template <typename F>
+void for_each_expression(const expression& e, const F& f) {
+  f(e);
+  std::visit(overload{
+    [](const literal&) {},
+    [](const name&) {},
+    [&](const call& c) {
+      for_each_expression(c.function, f);
+      for (const auto& argument : c.arguments) for_each_expression(argument, f);
+    },
+    [&](const calculation& c) {
+      for_each_expression(c.left, f);
+      for_each_expression(c.right, f);
+    },
+    [](const input&) {},
+    [&](const read& r) { for_each_expression(r.address, f); },
+  }, *e.value);
+}
+
+// Calls f for each expression in the statements and their subexpressions.
+template <typename F>
+void for_each_expression(std::span<const statement> statements, const F& f) {
+  for (const auto& s : statements) {
+    std::visit(overload{
+      [&](const constant& c) { for_each_expression(c.value, f); },
+      [&](const call& c) {
+        for_each_expression(c.function, f);
+        for (const auto& argument : c.arguments) {
+          for_each_expression(argument, f);
+        }
+      },
+      [](const declare_scalar&) {},
+      [&](const declare_array& d) { for_each_expression(d.size, f); },
+      [&](const assign& a) {
+        for_each_expression(a.left, f);
+        for_each_expression(a.right, f);
+      },
+      [&](const add_assign& a) {
+        for_each_expression(a.left, f);
+        for_each_expression(a.right, f);
+      },
+      [&](const if_statement& i) {
+        for_each_expression(i.condition, f);
+        for_each_expression(i.then_branch, f);
+        for_each_expression(i.else_branch, f);
+      },
+      [&](const while_statement& w) {
+        for_each_expression(w.condition, f);
+        for_each_expression(w.body, f);
+      },
+      [&](const output_statement& o) { for_each_expression(o.value, f); },
+      [&](const return_statement& r) { for_each_expression(r.value, f); },
+      [](const break_statement&) {},
+      [](const continue_statement&) {},
+      [](const halt_statement&) {},
+    }, *s.value);
+  }
+}
+
+// Checks whether a function refers to itself, in which case it may be
+// recursive.
+bool refers_to_itself(const function_definition& d) {
+  bool result = false;
+  for_each_expression(d.body, [&](const expression& e) {
+    auto* n = std::get_if<name>(e.value.get());
+    if (n && n->value == d.name) result = true;
+  });
+  return result;
+}
+
+// Checks whether a function is worth inlining at its call sites. A function
+// which refers to itself is never inlined, since it may be recursive.
+bool should_inline(const function_definition& d) {
+  int size = 0;
+  for_each_expression(d.body, [&](const expression&) { size++; });
+  return !refers_to_itself(d) && (d.is_inline || size <= inline_threshold);
+}
+
+// Checks whether evaluating the expression does nothing besides producing its
+// value, so that it can be discarded.
+bool is_pure(const expression& e) {
+  return std::visit(overload{
+    [](const literal&) { return true; },
+    [](const name&) { return true; },
+    [](const call&) { return false; },
+    [](const calculation& c) { return is_pure(c.left) && is_pure(c.right); },
+    [](const input&) { return false; },
+    [](const read& r) { return is_pure(r.address); },
+  }, *e.value);
+}
+
+// Checks whether the value of the expression is always 0 or 1.
+bool is_boolean(const expression& e) {
+  return std::visit(overload{
+    [](const literal& l) {
+      auto* x = std::get_if<std::int64_t>(&l);
+      return x && (*x == 0 || *x == 1);
+    },
+    [](const less_than&) { return true; },
+    [](const equals&) { return true; },
+    [](const logical_and&) { return true; },
+    [](const logical_or&) { return true; },
+    [](const auto&) { return false; },
+  }, *e.value);
+}
+
+std::optional<std::int64_t> integer_value(const expression& e) {
+  auto* l = std::get_if<literal>(e.value.get());
+  if (!l) return std::nullopt;
+  auto* x = std::get_if<std::int64_t>(l);
+  if (!x) return std::nullopt;
+  return *x;
+}
+
+std::optional<std::int64_t> integer_value(const as::immediate& x) {
+  auto* l = std::get_if<as::literal>(&x);
+  if (!l) return std::nullopt;
+  return l->value;
+}
+
+expression integer(std::int64_t x) { return expression::wrap(literal{x}); }
+
+// Arithmetic on constants wraps around, as it does in the machine.
+std::int64_t wrapping_add(std::int64_t l, std::int64_t r) {
+  return (std::uint64_t)l + (std::uint64_t)r;
+}
+
+std::int64_t wrapping_mul(std::int64_t l, std::int64_t r) {
+  return (std::uint64_t)l * (std::uint64_t)r;
+}
+
+expression simplify_mul(expression l, expression r) {
+  auto x = integer_value(l), y = integer_value(r);
+  if (x && y) return integer(wrapping_mul(*x, *y));
+  // Keep any constant on the right.
+  if (x) {
+    std::swap(l, r);
+    std::swap(x, y);
+  }
+  if (y == 1) return l;
+  if (y == 0 && is_pure(l)) return integer(0);
+  // (a * x) * y => a * (x * y)
+  if (auto* m = std::get_if<mul>(l.value.get()); m && y) {
+    if (auto z = integer_value(m->right)) {
+      return simplify_mul(std::move(m->left), integer(wrapping_mul(*z, *y)));
+    }
+  }
+  return expression::wrap(mul{{std::move(l), std::move(r)}});
+}
+
+expression simplify_negate(expression x) {
+  return simplify_mul(std::move(x), integer(-1));
+}
+
+expression simplify_add(expression l, expression r) {
+  auto x = integer_value(l), y = integer_value(r);
+  if (x && y) return integer(wrapping_add(*x, *y));
+  // Keep any constant on the right.
+  if (x) {
+    std::swap(l, r);
+    std::swap(x, y);
+  }
+  if (y == 0) return l;
+  // (a + x) + y => a + (x + y)
+  if (auto* a = std::get_if<add>(l.value.get()); a && y) {
+    if (auto z = integer_value(a->right)) {
+      return simplify_add(std::move(a->left), integer(wrapping_add(*z, *y)));
+    }
+  }
+  return expression::wrap(add{{std::move(l), std::move(r)}});
+}
+
+// Simplifies x == 0.
+expression simplify_not(expression x) {
+  if (auto value = integer_value(x)) return integer(*value == 0);
+  // !!a => a, if a is 0 or 1.
+  if (auto* e = std::get_if<equals>(x.value.get())) {
+    if (integer_value(e->right) == 0 && is_boolean(e->left)) {
+      return std::move(e->left);
+    }
+  }
+  if (auto* l = std::get_if<less_than>(x.value.get())) {
+    // !(a < y) => y - 1 < a
+    if (auto y = integer_value(l->right); y && *y != INT64_MIN) {
+      return expression::wrap(
+          less_than{{integer(*y - 1), std::move(l->left)}});
+    }
+    // !(y < a) => a < y + 1
+    if (auto y = integer_value(l->left); y && *y != INT64_MAX) {
+      return expression::wrap(
+          less_than{{std::move(l->right), integer(*y + 1)}});
+    }
+  }
+  return expression::wrap(equals{{std::move(x), integer(0)}});
+}
+
+// Rewrites an expression into an equivalent one which is cheaper to compute,
+// by folding constants and applying algebraic identities. Names are replaced
+// by the integer values given by constant, when it returns one.
+template <typename Lookup>
+expression simplify(const expression& e, const Lookup& constant) {
+  const auto recurse = [&](const expression& x) {
+    return simplify(x, constant);
+  };
+  return std::visit(overload{
+    [&](const literal&) { return e; },
+    [&](const name& n) {
+      if (std::optional<std::int64_t> value = constant(n.value)) {
+        return integer(*value);
+      }
+      return e;
+    },
+    [&](const call& c) {
+      call result{recurse(c.function), {}};
+      for (const auto& argument : c.arguments) {
+        result.arguments.push_back(recurse(argument));
+      }
+      return expression::wrap(std::move(result));
+    },
+    [&](const add& a) {
+      return simplify_add(recurse(a.left), recurse(a.right));
+    },
+    [&](const sub& s) {
+      return simplify_add(recurse(s.left), simplify_negate(recurse(s.right)));
+    },
+    [&](const mul& m) {
+      return simplify_mul(recurse(m.left), recurse(m.right));
+    },
+    [&](const div& d) {
+      auto a = recurse(d.left), b = recurse(d.right);
+      auto x = integer_value(a), y = integer_value(b);
+      if (y == 1) return a;
+      if (y == -1) return simplify_negate(std::move(a));
+      if (x && y && *y != 0) return integer(*x / *y);
+      return expression::wrap(div{{std::move(a), std::move(b)}});
+    },
+    [&](const mod& m) {
+      auto a = recurse(m.left), b = recurse(m.right);
+      auto x = integer_value(a), y = integer_value(b);
+      if ((y == 1 || y == -1) && is_pure(a)) return integer(0);
+      if (x && y && *y != 0 && *y != -1) return integer(*x % *y);
+      return expression::wrap(mod{{std::move(a), std::move(b)}});
+    },
+    [&](const less_than& l) {
+      auto a = recurse(l.left), b = recurse(l.right);
+      auto x = integer_value(a), y = integer_value(b);
+      if (x && y) return integer(*x < *y);
+      return expression::wrap(less_than{{std::move(a), std::move(b)}});
+    },
+    [&](const equals& q) {
+      auto a = recurse(q.left), b = recurse(q.right);
+      auto x = integer_value(a), y = integer_value(b);
+      if (x && y) return integer(*x == *y);
+      if (x == 0) return simplify_not(std::move(b));
+      if (y == 0) return simplify_not(std::move(a));
+      return expression::wrap(equals{{std::move(a), std::move(b)}});
+    },
+    [&](const input&) { return e; },
+    [&](const read& r) { return expression::wrap(read{recurse(r.address)}); },
+    [&](const logical_and& a) {
+      auto l = recurse(a.left), r = recurse(a.right);
+      auto x = integer_value(l), y = integer_value(r);
+      if (x == 0) return integer(0);
+      if (x && y) return integer(*y != 0);
+      if (x && is_boolean(r)) return r;
+      if (y && *y != 0 && is_boolean(l)) return l;
+      if (y == 0 && is_pure(l)) return integer(0);
+      return expression::wrap(logical_and{{std::move(l), std::move(r)}});
+    },
+    [&](const logical_or& o) {
+      auto l = recurse(o.left), r = recurse(o.right);
+      auto x = integer_value(l), y = integer_value(r);
+      if (x && *x != 0) return integer(1);
+      if (x && y) return integer(*y != 0);
+      if (x && is_boolean(r)) return r;
+      if (y == 0 && is_boolean(l)) return l;
+      if (y && *y != 0 && is_pure(l)) return integer(1);
+      return expression::wrap(logical_or{{std::move(l), std::move(r)}});
+    },
+  }, *e.value);
+}
+
 struct module_exports {
   std::set<std::string> variables;
   std::map<std::string, as::immediate> constants;
 };
 
+struct module_context;
+
+// A function which can be inlined, along with the module that it was defined
+// in, which its body refers to.
+struct inline_function {
+  module_context* module;
+  const function_definition* definition;
+};
+
 struct context {
   std::map<std::string, int> labels;
   std::string label(std::string name) {
@@ -44,8 +365,20 @@ struct context {
   }
 
   std::map<std::string, module_exports> modules;
+  // Modules are kept after they are generated, for inlining their functions.
+  std::list<module_context> module_contexts;
+  // Functions which are inlined at each call, by the label of their code.
+  std::map<std::string, inline_function> inline_functions;
   std::vector<as::statement> text;
   std::vector<as::statement> rodata, data;
+  // Arrays, which are zero-initialized and so only take up space in the
+  // encoded program if something follows them.
+  std::vector<as::statement> bss;
+  // Number of scratch cells needed by the function which needs the most.
+  int num_temporaries = 0;
+  // The positions in text of instructions whose result is read only by the
+  // instruction which consumes it.
+  std::vector<std::size_t> results;
 
   context();
 
@@ -57,12 +390,14 @@ struct context {
   }
 
   void gen_module(const module& m);
+  void forward_results();
 
   std::vector<as::statement> finish();
 };
 
 struct module_context {
   context* context = nullptr;
+  std::string file;
 
   std::set<std::string> imported_variables;
   std::map<std::string, as::immediate> imported_constants = {
@@ -81,6 +416,7 @@ struct module_context {
 
   module_context(struct context* context, const module& m);
 
+  expression simplify(const expression& e) const;
   as::immediate eval_expr(const expression& e);
 
   void gen_decl(const constant& c);
@@ -95,16 +431,42 @@ struct module_context {
 struct function_context {
   module_context* module = nullptr;
 
+  // Each call has a stack frame addressed through the relative base. The
+  // first cell holds the return address, followed by the arguments and then
+  // the local variables. The return value is passed back in the cell after the
+  // return address. Anything beyond the local variables is free for storing
+  // temporaries and for building the frames of calls.
   struct environment {
+    // Number of local variables in the stack frame.
     int size = 0;
+    // Number of cells used for local arrays, which are allocated statically.
+    int static_size = 0;
     std::map<std::string, int> variables;
     std::map<std::string, as::immediate> constants;
     std::optional<std::string> break_label, continue_label;
   };
   std::string function_name;
-  std::set<std::string> arguments = {};
+  // The position of each argument in the stack frame.
+  std::map<std::string, int> arguments = {};
   std::vector<environment> scope = {environment{}};
-  int max_size = 0;
+  int max_static_size = 0;
+  // The offsets at which local arrays start in the static storage.
+  std::set<int> array_offsets;
+  // Number of cells beyond the local variables which are in use.
+  int reserved = 0;
+  // Number of scratch cells which are in use.
+  int temporaries = 0;
+  // The number of cells from the start of the stack frame which the function
+  // may use, not counting the frames of functions that it calls.
+  mutable int stack_extent = 0;
+  // The line of the statement currently being generated.
+  int line = 0;
+  // Where the stack frame starts, relative to the relative base. This is only
+  // nonzero for the body of a function which is being inlined into a caller,
+  // in which case the frame is where the call would have built it and
+  // returning jumps to the return label instead.
+  int offset = 0;
+  std::optional<std::string> return_label;
 
   enum variable_kind {
     not_found,
@@ -135,15 +497,14 @@ struct function_context {
 
   as::output_param get_local_variable(std::string name) const {
     assert(lookup(name) == local_variable || lookup(name) == argument);
-    if (arguments.contains(name)) {
-      return {{}, as::address{as::name{"arg_" + function_name + "_" + name}}};
+    if (auto i = arguments.find(name); i != arguments.end()) {
+      return {{}, as::relative{as::literal{offset + i->second}}};
     }
     for (int i = scope.size() - 1; i >= 0; i--) {
       if (auto j = scope[i].variables.find(name);
           j != scope[i].variables.end()) {
-        const auto label =
-            "lv_" + function_name + "_" + std::to_string(j->second);
-        return {{}, as::address{as::name{label}}};
+        const int slot = offset + 1 + arguments.size() + j->second;
+        return {{}, as::relative{as::literal{slot}}};
       }
     }
     std::ostringstream message;
@@ -170,17 +531,19 @@ struct function_context {
     auto& current = scope.back();
     current.variables.emplace(variable, current.size);
     current.size++;
-    if (current.size > max_size) max_size = current.size;
   }
 
   void define_array(std::string variable, int size) {
     assert(!has_local(variable));
     auto& current = scope.back();
     const auto label =
-        "lv_" + function_name + "_" + std::to_string(current.size);
+        "lv_" + function_name + "_" + std::to_string(current.static_size);
     current.constants.emplace(variable, as::immediate{as::name{label}});
-    current.size += size;
-    if (current.size > max_size) max_size = current.size;
+    array_offsets.insert(current.static_size);
+    current.static_size += size;
+    if (current.static_size > max_static_size) {
+      max_static_size = current.static_size;
+    }
   }
 
   void define_constant(std::string name, as::immediate value) {
@@ -190,20 +553,101 @@ struct function_context {
 
   void push_scope() {
     const auto& current = scope.back();
-    scope.push_back(
-        {current.size, {}, {}, current.break_label, current.continue_label});
+    scope.push_back({current.size, current.static_size, {}, {},
+                     current.break_label, current.continue_label});
   }
   void pop_scope() { scope.pop_back(); }
 
+  // Returns the number of cells at the start of the stack frame which are in
+  // use. A call made at this point has its frame placed immediately after.
+  int frame_size() const {
+    const int size = offset + 1 + arguments.size() + scope.back().size +
+                     reserved;
+    // A call leaves its result in the cell after the frame it builds here.
+    stack_extent = std::max(stack_extent, size + 2);
+    return size;
+  }
+
+  // Allocates a scratch cell for an intermediate result. Scratch cells are
+  // used in a stack discipline: once the result has been consumed, the
+  // consumer resets temporaries to release it along with any cells above it.
+  // Since a value is never kept in a scratch cell across a call, all functions
+  // share the same cells.
+  as::output_param allocate_temporary() {
+    const int id = temporaries++;
+    auto& count = module->context->num_temporaries;
+    if (temporaries > count) count = temporaries;
+    return {{}, as::address{as::name{"temp" + std::to_string(id)}}};
+  }
+
+  // Emits an instruction which computes a result into a scratch cell, where
+  // only the instruction which consumes the returned operand reads it.
+  template <typename Calculation>
+  as::input_param gen_result(as::input_param a, as::input_param b) {
+    auto result = allocate_temporary();
+    module->context->text.push_back(
+        as::instruction{Calculation{{std::move(a), std::move(b), result}}});
+    module->context->results.push_back(module->context->text.size() - 1);
+    return result;
+  }
+
+  // Copies a value into a new cell in the stack frame, so that it survives
+  // calls made while computing the values that follow it. The cell must be
+  // released by decrementing reserved.
+  as::input_param spill(const as::input_param& value) {
+    const auto slot = as::relative{as::literal{frame_size()}};
+    reserved++;
+    const auto zero = as::input_param{{}, as::literal{0}};
+    module->context->text.push_back(
+        as::instruction{as::add{{zero, value, {{}, slot}}}});
+    return {{}, slot};
+  }
+
+  // Computes the operands of a binary operation. A called function may re-enter
+  // the code for this one, so the left operand is kept in the stack frame if
+  // the right one contains a call. The scratch cells used by the operands are
+  // released, so that the result can reuse them.
+  std::pair<as::input_param, as::input_param> gen_operands(
+      const calculation& c) {
+    const int before = temporaries;
+    auto l = gen_expr(c.left);
+    if (!contains_call(c.right)) {
+      auto r = gen_expr(c.right);
+      temporaries = before;
+      return {std::move(l), std::move(r)};
+    }
+    l = spill(l);
+    temporaries = before;
+    auto r = gen_expr(c.right);
+    reserved--;
+    temporaries = before;
+    return {std::move(l), std::move(r)};
+  }
+
+  // Attributes the code which follows to the given line of this function.
+  void gen_location(int line) {
+    module->context->text.push_back(as::directive{
+        as::location{module->file, line, function_name}});
+  }
+
   as::output_param gen_addr(const name& n);
   as::output_param gen_addr(const read& r);
   as::output_param gen_addr(const expression& e);
   as::input_param gen_expr(const literal& l);
   as::input_param gen_expr(const name& n);
   as::input_param gen_expr(const call& c);
+  const inline_function* inline_target(const call& c) const;
+  void gen_inline(const inline_function& f, int frame);
   as::input_param gen_expr(const add& a);
   as::input_param gen_expr(const mul& m);
   as::input_param gen_expr(const sub& s);
+  as::input_param gen_expr(const div& d);
+  as::input_param gen_expr(const mod& m);
+  as::input_param gen_division(const calculation& c, bool remainder);
+  void gen_division(const as::output_param& r, const as::output_param& q,
+                    const as::output_param& x, std::int64_t divisor,
+                    bool remainder, const std::string& grow,
+                    const std::string& done);
   as::input_param gen_expr(const less_than& l);
   as::input_param gen_expr(const equals& e);
   as::input_param gen_expr(const input&);
@@ -211,6 +655,7 @@ struct function_context {
   as::input_param gen_expr(const logical_and& a);
   as::input_param gen_expr(const logical_or& o);
   as::input_param gen_expr(const expression& e);
+  expression simplify(const expression& e) const;
   as::immediate eval_expr(const expression& e);
 
   void gen_stmt(const constant& c);
@@ -231,33 +676,434 @@ struct function_context {
   void gen_stmts(std::span<const statement> statements);
 };
 
+// Rewrites a while loop so that it does less work on each iteration. Values
+// which don't change during the loop are computed beforehand, including the
+// parts of sums which don't change, so that an array access such as
+// a[5 * y + x - 1] inside a loop over x only needs a single addition. Products
+// of an induction variable, which the loop only ever adds constants to, and a
+// constant are kept in variables which are updated alongside it instead.
+class loop_optimizer {
+ public:
+  loop_optimizer(function_context& f, const while_statement& w) : f_(f) {
+    analyze(w.body);
+    for_each_expression(w.condition, [&](const expression& e) {
+      if (std::holds_alternative<call>(*e.value)) calls_ = true;
+    });
+    for_each_expression(w.body, [&](const expression& e) {
+      if (std::holds_alternative<call>(*e.value)) calls_ = true;
+    });
+    loop_.condition = rewrite(simplify(w.condition));
+    loop_.body = rewrite(w.body);
+    update_multiples(loop_.body);
+  }
+
+  // Statements which initialize the new variables, to be run before the loop.
+  std::span<const statement> prelude() const { return prelude_; }
+  const while_statement& loop() const { return loop_; }
+
+ private:
+  // Finds the names that the loop declares or assigns to.
+  void analyze(std::span<const statement> statements) {
+    const auto declare = [&](const std::string& name) {
+      modified_.insert(name);
+      not_induction_.insert(name);
+    };
+    for (const auto& s : statements) {
+      std::visit(overload{
+        [&](const constant& c) { declare(c.name); },
+        [&](const declare_scalar& d) { declare(d.name); },
+        [&](const declare_array& d) { declare(d.name); },
+        [&](const assign& a) {
+          if (auto* n = std::get_if<name>(a.left.value.get())) {
+            declare(n->value);
+          }
+        },
+        [&](const add_assign& a) {
+          auto* n = std::get_if<name>(a.left.value.get());
+          if (!n) return;
+          modified_.insert(n->value);
+          if (!integer_value(simplify(a.right))) {
+            not_induction_.insert(n->value);
+          }
+        },
+        [&](const if_statement& i) {
+          analyze(i.then_branch);
+          analyze(i.else_branch);
+        },
+        [&](const while_statement& w) { analyze(w.body); },
+        [](const auto&) {},
+      }, *s.value);
+    }
+  }
+
+  // Checks whether a variable outside the loop can change during the loop.
+  bool is_variable(const std::string& name) const {
+    if (modified_.contains(name)) return true;
+    switch (f_.lookup(name)) {
+      case function_context::not_found:
+        return true;
+      case function_context::global_constant:
+      case function_context::local_constant:
+        return false;
+      case function_context::global_variable:
+        return calls_;
+      case function_context::argument:
+      case function_context::local_variable:
+        return false;
+    }
+    return true;
+  }
+
+  // Like function_context::simplify, but without replacing the names which
+  // the loop declares, since they may shadow constants outside it.
+  expression simplify(const expression& e) const {
+    return compiler::simplify(e, [&](const std::string& name) {
+      if (modified_.contains(name)) return std::optional<std::int64_t>();
+      const auto kind = f_.lookup(name);
+      return kind == function_context::local_constant ||
+                     kind == function_context::global_constant
+                 ? integer_value(f_.get_constant(name))
+                 : std::nullopt;
+    });
+  }
+
+  // Checks whether an expression has the same value on every iteration.
+  // Reads are never treated as invariant, since the loop may only perform
+  // them when the address is valid.
+  bool is_invariant(const expression& e) const {
+    return std::visit(overload{
+      [](const literal&) { return true; },
+      [&](const name& n) { return !is_variable(n.value); },
+      [](const call&) { return false; },
+      [&](const calculation& c) {
+        return is_invariant(c.left) && is_invariant(c.right);
+      },
+      [](const input&) { return false; },
+      [](const read&) { return false; },
+    }, *e.value);
+  }
+
+  bool is_induction(const std::string& name) const {
+    return modified_.contains(name) && !not_induction_.contains(name) &&
+           (f_.lookup(name) != function_context::global_variable || !calls_);
+  }
+
+  // Adds a new variable which is initialized to the value before the loop.
+  expression define(std::string kind, expression value) {
+    auto variable = "." + f_.module->context->label(std::move(kind));
+    f_.define_scalar(variable);
+    prelude_.push_back(statement::wrap(
+        assign{expression::wrap(name{variable}), std::move(value)}));
+    return expression::wrap(name{std::move(variable)});
+  }
+
+  // Returns a variable holding the value of an invariant expression.
+  expression hoist(const expression& e) {
+    std::ostringstream key;
+    key << e;
+    auto [i, is_new] = invariants_.emplace(key.str(), "");
+    if (!is_new) return expression::wrap(name{i->second});
+    auto variable = define("invariant", e);
+    i->second = std::get<name>(*variable.value).value;
+    return variable;
+  }
+
+  // Returns a variable holding the product of an induction variable and k.
+  expression reduce(const std::string& induction, std::int64_t k) {
+    auto& multiples = multiples_[induction];
+    for (const auto& [variable, multiple] : multiples) {
+      if (multiple == k) return expression::wrap(name{variable});
+    }
+    auto variable = define("induction", expression::wrap(mul{
+        {expression::wrap(name{induction}), integer(k)}}));
+    multiples.emplace_back(std::get<name>(*variable.value).value, k);
+    return variable;
+  }
+
+  static void terms(const expression& e, std::vector<expression>& output) {
+    if (auto* a = std::get_if<add>(e.value.get())) {
+      terms(a->left, output);
+      terms(a->right, output);
+    } else {
+      output.push_back(e);
+    }
+  }
+
+  expression rewrite(const expression& e) {
+    const bool leaf = std::holds_alternative<literal>(*e.value) ||
+                      std::holds_alternative<name>(*e.value);
+    if (leaf) return e;
+    if (is_invariant(e)) return hoist(e);
+    if (std::holds_alternative<add>(*e.value)) {
+      // Gather the invariant terms of a sum, so that they can be added up
+      // before the loop.
+      std::vector<expression> all, invariant, variant;
+      terms(e, all);
+      for (auto& term : all) {
+        (is_invariant(term) ? invariant : variant).push_back(std::move(term));
+      }
+      if (invariant.size() >= 2) {
+        expression sum = std::move(invariant[0]);
+        for (std::size_t i = 1; i < invariant.size(); i++) {
+          sum = simplify_add(std::move(sum), std::move(invariant[i]));
+        }
+        expression result = rewrite(variant[0]);
+        for (std::size_t i = 1; i < variant.size(); i++) {
+          result =
+              expression::wrap(add{{std::move(result), rewrite(variant[i])}});
+        }
+        return expression::wrap(add{{std::move(result), hoist(sum)}});
+      }
+    }
+    if (auto* m = std::get_if<mul>(e.value.get())) {
+      auto* n = std::get_if<name>(m->left.value.get());
+      auto k = integer_value(m->right);
+      if (n && k && is_induction(n->value)) return reduce(n->value, *k);
+    }
+    return std::visit(overload{
+      [&](const call& c) {
+        call result{rewrite(c.function), {}};
+        for (const auto& argument : c.arguments) {
+          result.arguments.push_back(rewrite(argument));
+        }
+        return expression::wrap(std::move(result));
+      },
+      [&](const read& r) { return expression::wrap(read{rewrite(r.address)}); },
+      [&](const auto& x) {
+        using type = std::decay_t<decltype(x)>;
+        if constexpr (std::is_base_of_v<calculation, type>) {
+          return expression::wrap(type{{rewrite(x.left), rewrite(x.right)}});
+        } else {
+          return e;
+        }
+      },
+    }, *e.value);
+  }
+
+  std::vector<statement> rewrite(std::span<const statement> statements) {
+    std::vector<statement> output;
+    const auto expr = [&](const expression& e) { return rewrite(simplify(e)); };
+    for (const auto& s : statements) {
+      output.push_back(std::visit(overload{
+        [&](const call& c) {
+          auto result = expr(expression::wrap(c));
+          return statement::wrap(std::move(std::get<call>(*result.value)));
+        },
+        [&](const assign& a) {
+          return statement::wrap(assign{expr(a.left), expr(a.right)});
+        },
+        [&](const add_assign& a) {
+          return statement::wrap(add_assign{expr(a.left), expr(a.right)});
+        },
+        [&](const if_statement& i) {
+          return statement::wrap(if_statement{
+              expr(i.condition), rewrite(i.then_branch),
+              rewrite(i.else_branch)});
+        },
+        [&](const while_statement& w) {
+          return statement::wrap(
+              while_statement{expr(w.condition), rewrite(w.body)});
+        },
+        [&](const output_statement& o) {
+          return statement::wrap(output_statement{expr(o.value)});
+        },
+        [&](const return_statement& r) {
+          return statement::wrap(return_statement{expr(r.value)});
+        },
+        [&](const auto&) { return s; },
+      }, *s.value));
+      output.back().line = s.line;
+    }
+    return output;
+  }
+
+  // Follows each addition to an induction variable with the corresponding
+  // additions to the variables which hold multiples of it.
+  void update_multiples(std::vector<statement>& statements) {
+    for (std::size_t i = 0; i < statements.size(); i++) {
+      std::visit(overload{
+        [&](add_assign& a) {
+          auto* n = std::get_if<name>(a.left.value.get());
+          if (!n) return;
+          auto j = multiples_.find(n->value);
+          if (j == multiples_.end()) return;
+          const std::int64_t amount = *integer_value(a.right);
+          for (const auto& [variable, k] : j->second) {
+            statements.insert(
+                statements.begin() + ++i,
+                statement::wrap(add_assign{expression::wrap(name{variable}),
+                                           integer(wrapping_mul(amount, k))}));
+          }
+        },
+        [&](if_statement& s) {
+          update_multiples(s.then_branch);
+          update_multiples(s.else_branch);
+        },
+        [&](while_statement& w) { update_multiples(w.body); },
+        [](auto&) {},
+      }, *statements[i].value);
+    }
+  }
+
+  function_context& f_;
+  std::set<std::string> modified_, not_induction_;
+  bool calls_ = false;
+  std::vector<statement> prelude_;
+  while_statement loop_;
+  // The variables holding invariant expressions, by their printed form.
+  std::map<std::string, std::string> invariants_;
+  // The variables holding multiples of each induction variable.
+  std::map<std::string, std::vector<std::pair<std::string, std::int64_t>>>
+      multiples_;
+};
+
 context::context() {
   module_context root{this, {}};
   function_context f{&root, "_start"};
+  f.gen_location(0);
+  text.push_back(as::instruction{
+      as::adjust_relative_base{{{}, as::immediate{as::name{"stack"}}}}});
   f.scope.back().constants.emplace(
       "main", as::immediate{as::name{"func_main"}});
   f.gen_stmt(call{expression::wrap(name{"main"}), {}});
   text.push_back(as::instruction{as::halt{}});
+  // Functions jump here when their frame doesn't fit on the stack.
+  text.push_back(as::label{"stack_overflow"});
+  for (char c : std::string_view("stack overflow\n")) {
+    text.push_back(as::instruction{
+        as::output{{{}, as::immediate{as::literal{c}}}}});
+  }
+  text.push_back(as::instruction{as::halt{}});
+}
+
+// Returns the cell that an instruction writes to, if it writes to one.
+as::output_param* destination(as::instruction& i) {
+  return std::visit(overload{
+    [](as::literal&) -> as::output_param* { return nullptr; },
+    [](as::calculation& c) { return &c.out; },
+    [](as::input& i) { return &i.out; },
+    [](as::output&) -> as::output_param* { return nullptr; },
+    [](as::jump&) -> as::output_param* { return nullptr; },
+    [](as::adjust_relative_base&) -> as::output_param* { return nullptr; },
+    [](as::halt&) -> as::output_param* { return nullptr; },
+  }, i);
+}
+
+// Returns the operands that an instruction reads.
+std::vector<as::input_param*> operands(as::instruction& i) {
+  return std::visit(overload{
+    [](as::literal&) -> std::vector<as::input_param*> { return {}; },
+    [](as::calculation& c) -> std::vector<as::input_param*> {
+      return {&c.a, &c.b};
+    },
+    [](as::input&) -> std::vector<as::input_param*> { return {}; },
+    [](as::output& o) -> std::vector<as::input_param*> { return {&o.x}; },
+    [](as::jump& j) -> std::vector<as::input_param*> {
+      return {&j.condition, &j.target};
+    },
+    [](as::adjust_relative_base& a) -> std::vector<as::input_param*> {
+      return {&a.amount};
+    },
+    [](as::halt&) -> std::vector<as::input_param*> { return {}; },
+  }, i);
+}
+
+// Checks whether an operand reads a cell directly by name.
+bool reads(const as::input_param& p, const as::symbol& cell) {
+  if (p.label) return false;
+  const auto* a = std::get_if<as::address>(&p.input);
+  if (!a) return false;
+  const auto* n = std::get_if<as::name>(&a->value);
+  return n && n->value == cell;
+}
+
+bool is_zero(const as::input_param& p) {
+  if (p.label) return false;
+  const auto* i = std::get_if<as::immediate>(&p.input);
+  if (!i) return false;
+  const auto* l = std::get_if<as::literal>(i);
+  return l && l->value == 0;
+}
+
+// Hands each result which is read only once straight to the instruction that
+// reads it, if that instruction immediately follows the one which computes it,
+// so that nothing else can run in between. If the reader just copies the
+// result somewhere, the result is stored there instead and the copy is
+// dropped. Otherwise the result is stored in the reader's operand, which saves
+// a load each time it runs, rather than in a scratch cell.
+void context::forward_results() {
+  std::vector<bool> removed(text.size());
+  for (std::size_t p : results) {
+    if (removed[p]) continue;
+    auto& producer = std::get<as::instruction>(text[p]);
+    auto& out = *destination(producer);
+    const auto cell =
+        std::get<as::name>(std::get<as::address>(out.output).value);
+    std::size_t q = p + 1;
+    while (q < text.size() && std::holds_alternative<as::directive>(text[q]) &&
+           std::holds_alternative<as::location>(
+               std::get<as::directive>(text[q]))) {
+      q++;
+    }
+    if (q == text.size()) continue;
+    auto* consumer = std::get_if<as::instruction>(&text[q]);
+    if (!consumer) continue;
+    const auto inputs = operands(*consumer);
+    const auto is_read = [&](as::input_param* x) {
+      return reads(*x, cell.value);
+    };
+    if (std::count_if(inputs.begin(), inputs.end(), is_read) != 1) continue;
+    if (auto* copy = std::get_if<as::add>(consumer);
+        copy && (is_zero(copy->a) || is_zero(copy->b))) {
+      out = copy->out;
+      removed[q] = true;
+      continue;
+    }
+    auto forwarded = label("result");
+    out = {{}, as::address{as::name{forwarded}}};
+    for (auto* input : inputs) {
+      if (is_read(input)) *input = {forwarded, as::immediate{as::literal{0}}};
+    }
+  }
+  std::size_t j = 0;
+  for (std::size_t i = 0; i < text.size(); i++) {
+    if (removed[i]) continue;
+    if (i != j) text[j] = std::move(text[i]);
+    j++;
+  }
+  text.resize(j);
 }
 
 std::vector<as::statement> context::finish() {
+  forward_results();
   auto output = std::move(text);
-  output.reserve(output.size() + data.size() + 1);
+  output.reserve(output.size() + rodata.size() + data.size() +
+                 2 * num_temporaries + bss.size() + 5);
   std::move(rodata.begin(), rodata.end(), std::back_inserter(output));
   std::move(data.begin(), data.end(), std::back_inserter(output));
+  for (int i = 0; i < num_temporaries; i++) {
+    output.push_back(as::label{"temp" + std::to_string(i)});
+    output.push_back(as::directive{as::integer{as::literal{0}}});
+  }
+  // The offset of the current stack frame from the start of the stack.
+  output.push_back(as::label{"stack_top"});
+  output.push_back(as::directive{as::integer{as::literal{0}}});
+  std::move(bss.begin(), bss.end(), std::back_inserter(output));
+  output.push_back(as::label{"stack"});
+  output.push_back(as::directive{as::zero{stack_size}});
   output.push_back(as::label{"heapstart"});
   return output;
 }
 
 void context::gen_module(const module& m) {
-  module_context module{this, m};
+  auto& module = module_contexts.emplace_back(this, m);
   module.gen_decls(m.body);
-  modules.emplace(m.name, module_exports{std::move(module.variables),
-                                         std::move(module.constants)});
+  modules.emplace(m.name,
+                  module_exports{module.variables, module.constants});
 }
 
 module_context::module_context(struct context* context, const module& m)
-    : context(context) {
+    : context(context), file(m.name) {
   const auto path_context = std::filesystem::path(m.name).parent_path();
   for (const auto& import : m.imports) {
     const auto& dependency = context->modules.at(import.resolve(path_context));
@@ -301,9 +1147,9 @@ void module_context::gen_decl(const declare_array& d) {
   if (!std::holds_alternative<as::literal>(size)) {
     die("Array size is not a constant expression.");
   }
-  context->data.push_back(as::label{"gv_" + d.name});
-  for (int i = 0, n = std::get<as::literal>(size).value; i < n; i++) {
-    context->data.push_back(as::integer{as::literal{0}});
+  context->bss.push_back(as::label{"gv_" + d.name});
+  if (const auto n = std::get<as::literal>(size).value; n > 0) {
+    context->bss.push_back(as::directive{as::zero{n}});
   }
   constants.emplace(d.name, as::immediate{as::name{"gv_" + d.name}});
 }
@@ -311,22 +1157,63 @@ void module_context::gen_decl(const declare_array& d) {
 void module_context::gen_decl(const function_definition& d) {
   function_context f{this, d.name};
   for (const auto& parameter : d.parameters) {
-    context->text.push_back(as::label{"arg_" + d.name + "_" + parameter});
-    context->text.push_back(as::directive{as::integer{as::literal{0}}});
-    f.arguments.emplace(parameter);
-  }
-  context->text.push_back(as::label{"func_" + d.name + "_output"});
-  context->text.push_back(as::directive{as::integer{as::literal{0}}});
-  context->text.push_back(as::label{"func_" + d.name + "_return"});
-  context->text.push_back(as::directive{as::integer{as::literal{0}}});
+    if (!f.arguments.emplace(parameter, 1 + f.arguments.size()).second) {
+      std::ostringstream message;
+      message << "Multiple parameters called " << std::quoted(parameter)
+              << " in function " << std::quoted(d.name) << ".";
+      die(message.str());
+    }
+  }
+  f.gen_location(d.line);
   context->text.push_back(as::label{"func_" + d.name});
+  // Check that the frame fits on the stack. How big it is is only known once
+  // the body has been generated, so the comparison is filled in afterwards.
+  const auto fits = f.allocate_temporary();
+  f.temporaries = 0;
+  const std::size_t check = context->text.size();
+  context->text.push_back(as::instruction{as::halt{}});
+  context->text.push_back(as::instruction{as::jump_if_false{
+      {fits, {{}, as::immediate{as::name{"stack_overflow"}}}}}});
+  // Define the function before its body so that it can call itself.
+  constants.emplace(d.name, as::name{"func_" + d.name});
   f.gen_stmts(d.body);
+  f.gen_location(d.line);
   f.gen_stmt(return_statement{expression::wrap(literal{0})});
-  constants.emplace(d.name, as::name{"func_" + d.name});
-  for (int i = 0; i < f.max_size; i++) {
-    context->data.push_back(
-        as::label{"lv_" + f.function_name + "_" + std::to_string(i)});
-    context->data.push_back(as::directive{as::integer{as::literal{0}}});
+  const int limit = stack_size - f.stack_extent;
+  if (limit <= 0) {
+    std::ostringstream message;
+    message << "The stack frame of function " << std::quoted(d.name)
+            << " is too big for the stack.";
+    die(message.str());
+  }
+  context->text[check] = as::instruction{as::less_than{
+      {{{}, as::address{as::name{"stack_top"}}}, {{}, as::literal{limit}},
+       fits}}};
+  context->results.push_back(check);
+  if (f.max_static_size > 0 && refers_to_itself(d)) {
+    std::ostringstream message;
+    message << "Function " << std::quoted(d.name) << " may be recursive, so it"
+            << " cannot have local arrays: they are allocated statically and"
+            << " would be shared by every call.";
+    die(message.str());
+  }
+  int offset = 0;
+  for (int start : f.array_offsets) {
+    if (start > offset) {
+      context->bss.push_back(as::directive{as::zero{start - offset}});
+    }
+    context->bss.push_back(
+        as::label{"lv_" + f.function_name + "_" + std::to_string(start)});
+    offset = start;
+  }
+  if (f.max_static_size > offset) {
+    context->bss.push_back(as::directive{as::zero{f.max_static_size - offset}});
+  }
+  // The function is still generated as usual, since it may be called
+  // indirectly. Inlined copies share its local arrays.
+  if (should_inline(d)) {
+    context->inline_functions.emplace("func_" + d.name,
+                                      inline_function{this, &d});
   }
 }
 
@@ -338,7 +1225,15 @@ void module_context::gen_decls(std::span<const declaration> declarations) {
   for (const auto& declaration : declarations) gen_decl(declaration);
 }
 
+expression module_context::simplify(const expression& e) const {
+  return compiler::simplify(e, [&](const std::string& name) {
+    auto i = constants.find(name);
+    return i == constants.end() ? std::nullopt : integer_value(i->second);
+  });
+}
+
 as::immediate module_context::eval_expr(const expression& e) {
+  const auto value = simplify(e);
   return std::visit(overload{
     [&](const literal& l) -> as::immediate {
       return std::visit(overload{
@@ -347,54 +1242,12 @@ as::immediate module_context::eval_expr(const expression& e) {
       }, l);
     },
     [&](const name& n) -> as::immediate { return constants.at(n.value); },
-    [&](const add& a) -> as::immediate {
-      auto l = eval_expr(a.left);
-      auto r = eval_expr(a.right);
-      auto* x = std::get_if<as::literal>(&l);
-      auto* y = std::get_if<as::literal>(&r);
-      if (x && y) {
-        return as::literal{x->value + y->value};
-      } else {
-        std::ostringstream message;
-        message << "Cannot add " << a.left << " and " << a.right
-                << " in a constant expression.";
-        die(message.str());
-      }
-    },
-    [&](const sub& s) -> as::immediate {
-      auto l = eval_expr(s.left);
-      auto r = eval_expr(s.right);
-      auto* x = std::get_if<as::literal>(&l);
-      auto* y = std::get_if<as::literal>(&r);
-      if (x && y) {
-        return as::literal{x->value - y->value};
-      } else {
-        std::ostringstream message;
-        message << "Cannot subtract " << s.left << " from " << s.right
-                << " in a constant expression.";
-        die(message.str());
-      }
-    },
-    [&](const mul& m) -> as::immediate {
-      auto l = eval_expr(m.left);
-      auto r = eval_expr(m.right);
-      auto* x = std::get_if<as::literal>(&l);
-      auto* y = std::get_if<as::literal>(&r);
-      if (x && y) {
-        return as::literal{x->value * y->value};
-      } else {
-        std::ostringstream message;
-        message << "Cannot multiply " << m.left << " and " << m.right
-                << " in a constant expression.";
-        die(message.str());
-      }
-    },
-    [&](const auto& x) -> as::immediate {
+    [&](const auto&) -> as::immediate {
       std::ostringstream message;
-      message << "Expression " << x << " is not a constant expression.";
+      message << "Expression " << e << " is not a constant expression.";
       die(message.str());
     },
-  }, *e.value);
+  }, *value.value);
 }
 
 as::output_param function_context::gen_addr(const name& n) {
@@ -417,15 +1270,15 @@ as::output_param function_context::gen_addr(const name& n) {
     case global_variable:
       return {{}, as::address{as::name{"gv_" + n.value}}};
     case argument:
-      return {{},
-              as::address{as::name{"arg_" + function_name + "_" + n.value}}};
     case local_variable:
       return get_local_variable(n.value);
   }
 }
 
 as::output_param function_context::gen_addr(const read& r) {
+  const int before = temporaries;
   auto value = gen_expr(r.address);
+  temporaries = before;
   auto label = module->context->label("read");
   // add 0, <value>, *label
   const auto zero = as::input_param{{}, as::literal{0}};
@@ -473,8 +1326,6 @@ as::input_param function_context::gen_expr(const name& n) {
     case global_variable:
       return {{}, as::address{as::name{"gv_" + n.value}}};
     case argument:
-      return {{},
-              as::address{as::name{"arg_" + function_name + "_" + n.value}}};
     case local_variable:
       return get_local_variable(n.value);
   }
@@ -483,90 +1334,66 @@ as::input_param function_context::gen_expr(const name& n) {
 as::input_param function_context::gen_expr(const call& c) {
   const auto zero = as::input_param{{}, as::literal{0}};
   const int n = c.arguments.size();
-  // Compute the function address.
-  auto callee = gen_expr(c.function);
-  if (!callee.label) {
-    auto out = module->context->label("callee");
-    module->context->text.push_back(as::instruction{
-        as::add{{zero, callee, {{}, as::address{as::name{out}}}}}});
-    callee = {out, as::immediate{as::literal{0}}};
-  }
-  auto get_callee = as::input_param{{}, as::address{as::name{*callee.label}}};
-  // Adjust the relative base to point at the start of the arguments.
-  //auto args = module->context->label("args");
-  //module->context->text.push_back(as::instruction{
-  //    as::add{{get_callee, {{}, as::immediate{as::literal{-(n + 2)}}},
-  //             {{}, as::address{as::name{args}}}}}});
-  //module->context->text.push_back(as::instruction{
-  //    as::adjust_relative_base{{args, as::immediate{as::literal{0}}}}});
-  // Compute the arguments.
+  // Build the frame for the callee after everything which is in use in this
+  // one, and keep it reserved while computing the arguments and the callee.
+  const int frame = frame_size();
+  const int before = temporaries;
+  reserved += 1 + n;
   for (int i = 0; i < n; i++) {
-    auto param = gen_expr(c.arguments[i]);
-    auto label = module->context->label("param");
-    module->context->text.push_back(as::instruction{
-        as::add{{get_callee, {{}, as::immediate{as::literal{i - n - 2}}},
-                 {{}, as::address{as::name{label}}}}}});
-    auto out = as::output_param{label, as::address{as::literal{0}}};
-    module->context->text.push_back(
-        as::instruction{as::add{{zero, param, out}}});
-  }
-  // Store the output address.
-  auto output_label = module->context->label("return");
-  {
-    const auto output_address =
-        as::input_param{{}, as::immediate{as::name{output_label}}};
-    auto label = module->context->label("output");
-    module->context->text.push_back(as::instruction{
-        as::add{{get_callee, {{}, as::immediate{as::literal{-2}}},
-                 {{}, as::address{as::name{label}}}}}});
-    auto out = as::output_param{label, as::address{as::literal{0}}};
+    auto value = gen_expr(c.arguments[i]);
+    const auto out =
+        as::output_param{{}, as::relative{as::literal{frame + 1 + i}}};
     module->context->text.push_back(
-        as::instruction{as::add{{zero, output_address, out}}});
+        as::instruction{as::add{{zero, value, out}}});
+    temporaries = before;
+  }
+  if (auto* f = inline_target(c)) {
+    gen_inline(*f, frame);
+    reserved -= 1 + n;
+    temporaries = before;
+    return as::input_param{{}, as::relative{as::literal{frame + 1}}};
+  }
+  auto callee = gen_expr(c.function);
+  reserved -= 1 + n;
+  // The callee is read after the relative base moves to the new frame.
+  if (auto* r = std::get_if<as::relative>(&callee.input)) {
+    r->value = as::literal{std::get<as::literal>(r->value).value - frame};
   }
   // Store the return address.
   auto return_label = module->context->label("call");
-  {
-    const auto return_address =
-        as::input_param{{}, as::immediate{as::name{return_label}}};
-    auto label = module->context->label("return");
-    module->context->text.push_back(as::instruction{
-        as::add{{get_callee, {{}, as::immediate{as::literal{-1}}},
-                 {{}, as::address{as::name{label}}}}}});
-    auto out = as::output_param{label, as::address{as::literal{0}}};
-    module->context->text.push_back(
-        as::instruction{as::add{{zero, return_address, out}}});
-  }
-  // Revert the relative base.
-  //auto args2 = module->context->label("revertargs");
-  //module->context->text.push_back(as::instruction{
-  //    as::mul{{{{}, as::address{as::name{args}}},
-  //             {{}, as::immediate{as::literal{-1}}},
-  //             {{}, as::address{as::name{args2}}}}}});
-  //module->context->text.push_back(as::instruction{
-  //    as::adjust_relative_base{{args2, as::immediate{as::literal{0}}}}});
-  // Jump into the function.
+  const auto return_address =
+      as::input_param{{}, as::immediate{as::name{return_label}}};
+  module->context->text.push_back(as::instruction{as::add{
+      {zero, return_address, {{}, as::relative{as::literal{frame}}}}}});
+  // Jump into the function, and restore the relative base afterwards. The
+  // stack top follows the relative base, so that the callee can check that
+  // its frame fits.
+  const auto stack_top =
+      as::output_param{{}, as::address{as::name{"stack_top"}}};
+  module->context->text.push_back(as::instruction{
+      as::add{{stack_top, {{}, as::literal{frame}}, stack_top}}});
+  module->context->text.push_back(as::instruction{
+      as::adjust_relative_base{{{}, as::immediate{as::literal{frame}}}}});
+  module->context->text.push_back(as::directive{as::call_site{}});
   module->context->text.push_back(
       as::instruction{as::jump_if_false{{zero, callee}}});
   module->context->text.push_back(as::label{return_label});
-  return as::input_param{output_label, as::immediate{as::literal{0}}};
+  module->context->text.push_back(as::instruction{
+      as::adjust_relative_base{{{}, as::immediate{as::literal{-frame}}}}});
+  module->context->text.push_back(as::instruction{
+      as::add{{stack_top, {{}, as::literal{-frame}}, stack_top}}});
+  temporaries = before;
+  return as::input_param{{}, as::relative{as::literal{frame + 1}}};
 }
 
 as::input_param function_context::gen_expr(const add& a) {
-  auto l = gen_expr(a.left);
-  auto r = gen_expr(a.right);
-  auto result = module->context->label("add");
-  module->context->text.push_back(
-      as::instruction{as::add{{l, r, {{}, as::address{as::name{result}}}}}});
-  return as::input_param{result, as::immediate{as::literal{0}}};
+  auto [l, r] = gen_operands(a);
+  return gen_result<as::add>(std::move(l), std::move(r));
 }
 
 as::input_param function_context::gen_expr(const mul& m) {
-  auto l = gen_expr(m.left);
-  auto r = gen_expr(m.right);
-  auto result = module->context->label("mul");
-  module->context->text.push_back(
-      as::instruction{as::mul{{l, r, {{}, as::address{as::name{result}}}}}});
-  return as::input_param{result, as::immediate{as::literal{0}}};
+  auto [l, r] = gen_operands(m);
+  return gen_result<as::mul>(std::move(l), std::move(r));
 }
 
 as::input_param function_context::gen_expr(const sub& s) {
@@ -575,29 +1402,232 @@ as::input_param function_context::gen_expr(const sub& s) {
   return gen_expr(add{{s.left, negated_b}});
 }
 
+as::input_param function_context::gen_expr(const div& d) {
+  return gen_division(d, false);
+}
+
+as::input_param function_context::gen_expr(const mod& m) {
+  return gen_division(m, true);
+}
+
+// Division is done inline, by shifting and subtracting. Like C, the quotient is
+// rounded towards zero and the remainder has the sign of the dividend. Dividing
+// by zero gives a quotient of zero and leaves the dividend as the remainder.
+as::input_param function_context::gen_division(const calculation& c,
+                                               bool remainder) {
+  auto& text = module->context->text;
+  const auto constant = [](std::int64_t value) {
+    return as::input_param{{}, as::literal{value}};
+  };
+  const auto zero = constant(0), one = constant(1), minus_one = constant(-1);
+  const auto jump_if_true = [&](as::input_param x, const std::string& target) {
+    text.push_back(as::instruction{
+        as::jump_if_true{{x, {{}, as::immediate{as::name{target}}}}}});
+  };
+  const auto jump_if_false = [&](as::input_param x, const std::string& target) {
+    text.push_back(as::instruction{
+        as::jump_if_false{{x, {{}, as::immediate{as::name{target}}}}}});
+  };
+  const auto negate = [&](const as::output_param& x) {
+    text.push_back(as::instruction{as::mul{{x, minus_one, x}}});
+  };
+  auto [a, b] = gen_operands(c);
+  // A constant divisor has its magnitude and sign worked out here. The most
+  // negative integer has no magnitude, so it is treated like any other value.
+  std::optional<std::int64_t> divisor = integer_value(c.right);
+  if (divisor == 0 || divisor == INT64_MIN) divisor.reset();
+  // The operands occupy at most the first two of the released scratch cells,
+  // and the divisor can only be in the first if the dividend isn't, so copying
+  // the divisor first leaves the dividend intact.
+  const auto r = allocate_temporary(), t = allocate_temporary();
+  text.push_back(as::instruction{as::add{
+      {zero, divisor ? constant(*divisor < 0 ? -*divisor : *divisor) : b,
+       t}}});
+  text.push_back(as::instruction{as::add{{zero, a, r}}});
+  const auto q = allocate_temporary(), n = allocate_temporary(),
+             x = allocate_temporary(), sign_a = allocate_temporary();
+  as::input_param sign_b = constant(divisor < 0);
+  auto end = module->context->label("divend");
+  // Divide the magnitudes and fix up the signs afterwards. The most negative
+  // integer is its own negation, so it is the one value which is still
+  // negative afterwards. As a divisor, it goes zero times into anything but
+  // itself, so the result is known straight away.
+  auto positive = module->context->label("divpositive");
+  if (!divisor) {
+    const auto sign = allocate_temporary();
+    text.push_back(as::instruction{as::less_than{{t, zero, sign}}});
+    jump_if_false(sign, positive);
+    negate(t);
+    text.push_back(as::instruction{as::less_than{{t, zero, x}}});
+    jump_if_false(x, positive);
+    text.push_back(as::instruction{as::equals{{r, t, q}}});
+    jump_if_false(q, end);
+    text.push_back(as::instruction{as::add{{zero, zero, r}}});
+    jump_if_false(zero, end);
+    text.push_back(as::label{positive});
+    positive = module->context->label("divpositive");
+    sign_b = sign;
+  }
+  // As a dividend, it is reduced by the divisor first, which makes its
+  // magnitude representable, and the quotient gets the one back at the end.
+  std::optional<as::output_param> carry;
+  if (!remainder) {
+    carry = allocate_temporary();
+    text.push_back(as::instruction{as::add{{zero, zero, *carry}}});
+  }
+  text.push_back(as::instruction{as::less_than{{r, zero, sign_a}}});
+  jump_if_false(sign_a, positive);
+  negate(r);
+  text.push_back(as::instruction{as::less_than{{r, zero, x}}});
+  jump_if_false(x, positive);
+  // Dividing it by zero must still leave it as the remainder.
+  if (carry) {
+    text.push_back(as::instruction{as::less_than{{zero, t, *carry}}});
+  }
+  text.push_back(as::instruction{as::add{{r, t, r}}});
+  negate(r);
+  text.push_back(as::label{positive});
+  text.push_back(as::instruction{as::add{{zero, zero, q}}});
+  text.push_back(as::instruction{as::add{{zero, zero, n}}});
+  auto grow = module->context->label("divgrow");
+  auto shrink = module->context->label("divshrink");
+  auto done = module->context->label("divdone");
+  if (divisor) {
+    gen_division(r, q, x, *divisor < 0 ? -*divisor : *divisor, remainder, grow,
+                 done);
+  } else {
+    jump_if_false(t, done);
+  }
+  // Push the doubled divisors onto the stack beyond the frame until the next
+  // one would exceed the dividend. No call happens before they are popped
+  // again, but an operand of an enclosing expression may be waiting in the
+  // first two cells beyond the frame, where a call or a logical operator leaves
+  // its result, so the stack starts after them.
+  const auto top =
+      as::output_param{{}, as::relative{as::literal{frame_size() + 2}}};
+  stack_extent =
+      std::max(stack_extent, frame_size() + division_stack_size);
+  text.push_back(as::label{grow});
+  text.push_back(as::instruction{as::less_than{{r, t, x}}});
+  jump_if_true(x, shrink);
+  text.push_back(as::instruction{as::add{{zero, t, top}}});
+  text.push_back(as::instruction{as::adjust_relative_base{one}});
+  text.push_back(as::instruction{as::add{{n, one, n}}});
+  text.push_back(as::instruction{as::mul{{t, minus_one, x}}});
+  text.push_back(as::instruction{as::add{{r, x, x}}});
+  text.push_back(as::instruction{as::less_than{{x, t, x}}});
+  jump_if_true(x, shrink);
+  text.push_back(as::instruction{as::add{{t, t, t}}});
+  jump_if_false(zero, grow);
+  // Pop them again, subtracting each one from the dividend where possible to
+  // produce the bits of the quotient from the top down.
+  text.push_back(as::label{shrink});
+  jump_if_false(n, done);
+  text.push_back(as::instruction{as::adjust_relative_base{minus_one}});
+  text.push_back(as::instruction{as::add{{n, minus_one, n}}});
+  text.push_back(as::instruction{as::add{{q, q, q}}});
+  text.push_back(as::instruction{as::less_than{{r, top, x}}});
+  jump_if_true(x, shrink);
+  text.push_back(as::instruction{as::mul{{top, minus_one, x}}});
+  text.push_back(as::instruction{as::add{{r, x, r}}});
+  text.push_back(as::instruction{as::add{{q, one, q}}});
+  jump_if_false(zero, shrink);
+  text.push_back(as::label{done});
+  // The quotient is negative when exactly one of the operands is, and the
+  // remainder is negative when the dividend is.
+  if (remainder) {
+    jump_if_false(sign_a, end);
+    negate(r);
+  } else {
+    text.push_back(as::instruction{as::add{{q, *carry, q}}});
+    text.push_back(as::instruction{as::equals{{sign_a, sign_b, x}}});
+    jump_if_true(x, end);
+    negate(q);
+  }
+  text.push_back(as::label{end});
+  // The result is left in a cell above the ones the operands were in, so the
+  // scratch cells stay allocated until the consumer releases them.
+  return remainder ? r : q;
+}
+
+// Divides r by a positive constant, for dividends which are small enough that
+// it is quicker to compare them against each multiple of the divisor by a power
+// of two in turn, since those multiples are known. Larger dividends jump to the
+// general loop at grow, which carries on from r and q as they are.
+void function_context::gen_division(
+    const as::output_param& r, const as::output_param& q,
+    const as::output_param& x, std::int64_t divisor, bool remainder,
+    const std::string& grow, const std::string& done) {
+  auto& text = module->context->text;
+  const auto constant = [](std::int64_t value) {
+    return as::input_param{{}, as::literal{value}};
+  };
+  const auto jump_if_true = [&](as::input_param x, const std::string& target) {
+    text.push_back(as::instruction{
+        as::jump_if_true{{x, {{}, as::immediate{as::name{target}}}}}});
+  };
+  // Each level is unrolled at every division by a constant, so only the lower
+  // ones are worth the space. Dividends of 256 times the divisor or more take
+  // the loop instead.
+  constexpr int num_levels = 8, group_size = 4;
+  std::vector<std::int64_t> multiples = {divisor};
+  while ((int)multiples.size() <= num_levels &&
+         multiples.back() <= INT64_MAX / 2) {
+    multiples.push_back(multiples.back() * 2);
+  }
+  if ((int)multiples.size() > num_levels) {
+    text.push_back(as::instruction{
+        as::less_than{{r, constant(multiples.back()), x}}});
+    text.push_back(as::instruction{
+        as::jump_if_false{{x, {{}, as::immediate{as::name{grow}}}}}});
+    multiples.pop_back();
+  }
+  // Skip the higher groups of levels when the dividend is below them.
+  const int num_groups = (multiples.size() + group_size - 1) / group_size;
+  std::vector<std::string> groups;
+  for (int i = 0; i < num_groups; i++) {
+    groups.push_back(module->context->label("divgroup"));
+  }
+  for (int i = 0; i + 1 < num_groups; i++) {
+    text.push_back(as::instruction{
+        as::less_than{{r, constant(multiples[(i + 1) * group_size]), x}}});
+    jump_if_true(x, groups[i]);
+  }
+  for (int k = multiples.size() - 1; k >= 0; k--) {
+    if (k % group_size == group_size - 1 || k == (int)multiples.size() - 1) {
+      text.push_back(as::label{groups[k / group_size]});
+    }
+    auto next = module->context->label("divnext");
+    text.push_back(
+        as::instruction{as::less_than{{r, constant(multiples[k]), x}}});
+    jump_if_true(x, next);
+    text.push_back(
+        as::instruction{as::add{{r, constant(-multiples[k]), r}}});
+    if (!remainder) {
+      text.push_back(
+          as::instruction{as::add{{q, constant(std::int64_t{1} << k), q}}});
+    }
+    text.push_back(as::label{next});
+  }
+  text.push_back(as::instruction{
+      as::jump_if_false{{constant(0), {{}, as::immediate{as::name{done}}}}}});
+}
+
 as::input_param function_context::gen_expr(const less_than& l) {
-  auto a = gen_expr(l.left);
-  auto b = gen_expr(l.right);
-  auto result = module->context->label("lt");
-  module->context->text.push_back(as::instruction{
-      as::less_than{{a, b, {{}, as::address{as::name{result}}}}}});
-  return as::input_param{result, as::immediate{as::literal{0}}};
+  auto [a, b] = gen_operands(l);
+  return gen_result<as::less_than>(std::move(a), std::move(b));
 }
 
 as::input_param function_context::gen_expr(const equals& e) {
-  auto a = gen_expr(e.left);
-  auto b = gen_expr(e.right);
-  auto result = module->context->label("eq");
-  module->context->text.push_back(as::instruction{
-      as::equals{{a, b, {{}, as::address{as::name{result}}}}}});
-  return as::input_param{result, as::immediate{as::literal{0}}};
+  auto [a, b] = gen_operands(e);
+  return gen_result<as::equals>(std::move(a), std::move(b));
 }
 
 as::input_param function_context::gen_expr(const input&) {
-  auto result = module->context->label("input");
-  module->context->text.push_back(
-      as::instruction{as::input{{{}, as::address{as::name{result}}}}});
-  return as::input_param{result, as::immediate{as::literal{0}}};
+  auto result = allocate_temporary();
+  module->context->text.push_back(as::instruction{as::input{result}});
+  module->context->results.push_back(module->context->text.size() - 1);
+  return result;
 }
 
 as::input_param function_context::gen_expr(const read& r) {
@@ -605,54 +1635,129 @@ as::input_param function_context::gen_expr(const read& r) {
 }
 
 as::input_param function_context::gen_expr(const logical_and& a) {
-  auto result = module->context->label("and");
   auto short_circuit = module->context->label("andfalse");
   auto end = module->context->label("andend");
+  // The result is normally stored in a scratch cell, but those can't be used
+  // across a call, so then it is kept in the frame instead.
+  const bool calls = contains_call(a.left) || contains_call(a.right);
+  as::output_param out;
+  if (calls) {
+    out = {{}, as::relative{as::literal{frame_size()}}};
+    reserved++;
+  } else {
+    out = allocate_temporary();
+  }
+  const int live = temporaries;
   // Initialize the output to true.
   const auto zero = as::input_param{{}, as::literal{0}};
   const auto one = as::input_param{{}, as::literal{1}};
-  module->context->text.push_back(
-      as::add{{zero, one, {{}, as::address{as::name{result}}}}});
+  module->context->text.push_back(as::add{{zero, one, out}});
   auto l = gen_expr(a.left);
+  temporaries = live;
   module->context->text.push_back(as::instruction{
       as::jump_if_false{{l, {{}, as::immediate{as::name{short_circuit}}}}}});
   auto r = gen_expr(a.right);
+  temporaries = live;
   module->context->text.push_back(as::instruction{
       as::jump_if_true{{r, {{}, as::immediate{as::name{end}}}}}});
   module->context->text.push_back(as::label{short_circuit});
-  module->context->text.push_back(
-      as::add{{zero, zero, {{}, as::address{as::name{result}}}}});
+  module->context->text.push_back(as::add{{zero, zero, out}});
   module->context->text.push_back(as::label{end});
-  return {{result}, as::immediate{as::literal{0}}};
+  if (calls) reserved--;
+  return out;
 }
 
 as::input_param function_context::gen_expr(const logical_or& o) {
-  auto result = module->context->label("or");
   auto short_circuit = module->context->label("ortrue");
   auto end = module->context->label("orend");
+  // The result is normally stored in a scratch cell, but those can't be used
+  // across a call, so then it is kept in the frame instead.
+  const bool calls = contains_call(o.left) || contains_call(o.right);
+  as::output_param out;
+  if (calls) {
+    out = {{}, as::relative{as::literal{frame_size()}}};
+    reserved++;
+  } else {
+    out = allocate_temporary();
+  }
+  const int live = temporaries;
   // Initialize the output to false.
   const auto zero = as::input_param{{}, as::literal{0}};
   const auto one = as::input_param{{}, as::literal{1}};
-  module->context->text.push_back(
-      as::add{{zero, zero, {{}, as::address{as::name{result}}}}});
+  module->context->text.push_back(as::add{{zero, zero, out}});
   auto l = gen_expr(o.left);
+  temporaries = live;
   module->context->text.push_back(as::instruction{
       as::jump_if_true{{l, {{}, as::immediate{as::name{short_circuit}}}}}});
   auto r = gen_expr(o.right);
+  temporaries = live;
   module->context->text.push_back(as::instruction{
       as::jump_if_false{{r, {{}, as::immediate{as::name{end}}}}}});
   module->context->text.push_back(as::label{short_circuit});
-  module->context->text.push_back(
-      as::add{{zero, one, {{}, as::address{as::name{result}}}}});
+  module->context->text.push_back(as::add{{zero, one, out}});
   module->context->text.push_back(as::label{end});
-  return {{result}, as::immediate{as::literal{0}}};
+  if (calls) reserved--;
+  return out;
 }
 
 as::input_param function_context::gen_expr(const expression& e) {
   return std::visit([&](auto& x) { return gen_expr(x); }, *e.value);
 }
 
+expression function_context::simplify(const expression& e) const {
+  return compiler::simplify(e, [&](const std::string& name) {
+    const auto kind = lookup(name);
+    return kind == local_constant || kind == global_constant
+               ? integer_value(get_constant(name))
+               : std::nullopt;
+  });
+}
+
+// Returns the function to inline for the call, if there is one. Only direct
+// calls with the right number of arguments are inlined.
+const inline_function* function_context::inline_target(const call& c) const {
+  auto* n = std::get_if<name>(c.function.value.get());
+  if (!n) return nullptr;
+  const auto kind = lookup(n->value);
+  if (kind != global_constant && kind != local_constant) return nullptr;
+  const as::immediate value = get_constant(n->value);
+  auto* label = std::get_if<as::name>(&value);
+  if (!label) return nullptr;
+  const auto& functions = module->context->inline_functions;
+  auto i = functions.find(label->value);
+  if (i == functions.end()) return nullptr;
+  const auto& definition = *i->second.definition;
+  if (definition.parameters.size() != c.arguments.size()) return nullptr;
+  return &i->second;
+}
+
+// Generates the body of a function in place of a call to it, once the
+// arguments have been stored in the frame at the given position.
+void function_context::gen_inline(const inline_function& f, int frame) {
+  const auto& definition = *f.definition;
+  function_context inner{f.module, definition.name};
+  for (const auto& parameter : definition.parameters) {
+    inner.arguments.emplace(parameter, 1 + inner.arguments.size());
+  }
+  inner.offset = frame;
+  inner.return_label = module->context->label("inlineend");
+  inner.gen_location(definition.line);
+  inner.gen_stmts(definition.body);
+  stack_extent = std::max(stack_extent, inner.stack_extent);
+  const auto& body = definition.body;
+  if (body.empty() ||
+      !std::holds_alternative<return_statement>(*body.back().value)) {
+    // Falling off the end of the function returns 0.
+    const auto zero = as::input_param{{}, as::immediate{as::literal{0}}};
+    module->context->text.push_back(as::instruction{
+        as::add{{zero, zero, {{}, as::relative{as::literal{frame + 1}}}}}});
+  }
+  module->context->text.push_back(as::label{*inner.return_label});
+  if (line) gen_location(line);
+}
+
 as::immediate function_context::eval_expr(const expression& e) {
+  const auto value = simplify(e);
   return std::visit(overload{
     [&](const literal& l) -> as::immediate {
       return std::visit(overload{
@@ -663,54 +1768,12 @@ as::immediate function_context::eval_expr(const expression& e) {
       }, l);
     },
     [&](const name& n) -> as::immediate { return get_constant(n.value); },
-    [&](const add& a) -> as::immediate {
-      auto l = eval_expr(a.left);
-      auto r = eval_expr(a.right);
-      auto* x = std::get_if<as::literal>(&l);
-      auto* y = std::get_if<as::literal>(&r);
-      if (x && y) {
-        return as::literal{x->value + y->value};
-      } else {
-        std::ostringstream message;
-        message << "Cannot add " << a.left << " and " << a.right
-                << " in a constant expression.";
-        die(message.str());
-      }
-    },
-    [&](const sub& s) -> as::immediate {
-      auto l = eval_expr(s.left);
-      auto r = eval_expr(s.right);
-      auto* x = std::get_if<as::literal>(&l);
-      auto* y = std::get_if<as::literal>(&r);
-      if (x && y) {
-        return as::literal{x->value - y->value};
-      } else {
-        std::ostringstream message;
-        message << "Cannot subtract " << s.left << " from " << s.right
-                << " in a constant expression.";
-        die(message.str());
-      }
-    },
-    [&](const mul& m) -> as::immediate {
-      auto l = eval_expr(m.left);
-      auto r = eval_expr(m.right);
-      auto* x = std::get_if<as::literal>(&l);
-      auto* y = std::get_if<as::literal>(&r);
-      if (x && y) {
-        return as::literal{x->value * y->value};
-      } else {
-        std::ostringstream message;
-        message << "Cannot multiply " << m.left << " and " << m.right
-                << " in a constant expression.";
-        die(message.str());
-      }
-    },
-    [&](const auto& x) -> as::immediate {
+    [&](const auto&) -> as::immediate {
       std::ostringstream message;
-      message << "Expression " << x << " is not a constant expression.";
+      message << "Expression " << e << " is not a constant expression.";
       die(message.str());
     },
-  }, *e.value);
+  }, *value.value);
 }
 
 void function_context::gen_stmt(const constant& c) {
@@ -724,11 +1787,7 @@ void function_context::gen_stmt(const constant& c) {
 }
 
 void function_context::gen_stmt(const call& c) {
-  auto value = gen_expr(c);
-  auto self = module->context->label("ignore");
-  const auto zero = as::input_param{{self}, as::immediate{as::literal{0}}};
-  const auto out = as::output_param{{}, as::address{as::name{self}}};
-  module->context->text.push_back(as::instruction{as::add{{value, zero, out}}});
+  gen_expr(simplify(expression::wrap(c)));
 }
 
 void function_context::gen_stmt(const declare_scalar& d) {
@@ -756,21 +1815,44 @@ void function_context::gen_stmt(const declare_array& d) {
 }
 
 void function_context::gen_stmt(const assign& a) {
-  auto value = gen_expr(a.right);
-  auto address = gen_addr(a.left);
+  auto value = gen_expr(simplify(a.right));
+  const bool spilled = contains_call(a.left);
+  if (spilled) {
+    value = spill(value);
+    temporaries = 0;
+  }
+  auto address = gen_addr(simplify(a.left));
+  if (spilled) reserved--;
   module->context->text.push_back(as::instruction{as::add{{
       {{}, as::immediate{as::literal{0}}}, value, address}}});
 }
 
 void function_context::gen_stmt(const add_assign& a) {
-  auto value = gen_expr(a.right);
-  auto address = gen_addr(a.left);
-  module->context->text.push_back(as::instruction{as::add{{
-      address, value, {{}, address.output}}}});
+  auto value = gen_expr(simplify(a.right));
+  const bool spilled = contains_call(a.left);
+  if (spilled) {
+    value = spill(value);
+    temporaries = 0;
+  }
+  auto address = gen_addr(simplify(a.left));
+  if (spilled) reserved--;
+  auto out = as::output_param{{}, address.output};
+  if (address.label) {
+    // The address was computed into the first operand, but it is needed for
+    // the output as well.
+    const auto zero = as::input_param{{}, as::immediate{as::literal{0}}};
+    const auto computed =
+        as::input_param{{}, as::address{as::name{*address.label}}};
+    out.label = module->context->label("write");
+    module->context->text.push_back(as::instruction{as::add{
+        {zero, computed, {{}, as::address{as::name{*out.label}}}}}});
+  }
+  module->context->text.push_back(
+      as::instruction{as::add{{address, value, out}}});
 }
 
 void function_context::gen_stmt(const if_statement& i) {
-  auto condition = gen_expr(i.condition);
+  auto condition = gen_expr(simplify(i.condition));
   auto end_if = module->context->label("endif");
   auto else_branch =
       i.else_branch.empty() ? end_if : module->context->label("else");
@@ -789,7 +1871,11 @@ void function_context::gen_stmt(const if_statement& i) {
   module->context->text.push_back(as::label{end_if});
 }
 
-void function_context::gen_stmt(const while_statement& w) {
+void function_context::gen_stmt(const while_statement& original) {
+  const int while_line = line;
+  const loop_optimizer optimizer(*this, original);
+  for (const auto& s : optimizer.prelude()) gen_stmt(s);
+  const auto& w = optimizer.loop();
   push_scope();
   auto while_start = module->context->label("whilestart");
   auto while_cond = module->context->label("whilecond");
@@ -802,7 +1888,8 @@ void function_context::gen_stmt(const while_statement& w) {
   module->context->text.push_back(as::label{while_start});
   gen_stmts(w.body);
   module->context->text.push_back(as::label{while_cond});
-  auto condition = gen_expr(w.condition);
+  if (while_line) gen_location(while_line);
+  auto condition = gen_expr(simplify(w.condition));
   const auto start = as::input_param{{}, as::immediate{as::name{while_start}}};
   module->context->text.push_back(
       as::instruction{as::jump_if_true{{condition, start}}});
@@ -811,27 +1898,27 @@ void function_context::gen_stmt(const while_statement& w) {
 }
 
 void function_context::gen_stmt(const output_statement& o) {
-  auto value = gen_expr(o.value);
+  auto value = gen_expr(simplify(o.value));
   module->context->text.push_back(as::instruction{as::output{value}});
 }
 
 void function_context::gen_stmt(const return_statement& r) {
-  // Store the return value at the output address.
-  auto output_label = module->context->label("output");
+  // Pass back the return value in the cell after the return address.
   const auto zero = as::input_param{{}, as::immediate{as::literal{0}}};
-  const auto output_address = as::input_param{
-      {}, as::address{as::name{"func_" + function_name + "_output"}}};
-  const auto temp = as::output_param{{}, as::address{as::name{output_label}}};
-  module->context->text.push_back(
-      as::instruction{as::add{{zero, output_address, temp}}});
-  const auto output =
-      as::output_param{output_label, as::address{as::literal{0}}};
-  auto value = gen_expr(r.value);
-  module->context->text.push_back(
-      as::instruction{as::add{{zero, value, output}}});
+  auto value = gen_expr(simplify(r.value));
+  module->context->text.push_back(as::instruction{
+      as::add{{zero, value, {{}, as::relative{as::literal{offset + 1}}}}}});
+  if (return_label) {
+    const auto end =
+        as::input_param{{}, as::immediate{as::name{*return_label}}};
+    module->context->text.push_back(
+        as::instruction{as::jump_if_false{{zero, end}}});
+    return;
+  }
   // Return to the caller.
-  const auto return_address = as::input_param{
-      {}, as::address{as::name{"func_" + function_name + "_return"}}};
+  const auto return_address =
+      as::input_param{{}, as::relative{as::literal{0}}};
+  module->context->text.push_back(as::directive{as::return_site{}});
   module->context->text.push_back(
       as::instruction{as::jump_if_false{{zero, return_address}}});
 }
@@ -869,7 +1956,12 @@ void function_context::gen_stmt(const halt_statement&) {
 }
 
 void function_context::gen_stmt(const statement& s) {
+  if (s.line) {
+    line = s.line;
+    gen_location(line);
+  }
   std::visit([&](const auto& x) { gen_stmt(x); }, *s.value);
+  temporaries = 0;
 }
 
 void function_context::gen_stmts(std::span<const statement> statements) {
@@ -23,14 +23,17 @@ namespace compiler {
 
 struct parser {
   std::string_view file, source;
-  int line = 1, column = 1;
+  line_index lines{source};
 
   [[noreturn]] void die(std::string_view message) const {
+    const auto [line, column] = lines.find(source.data());
     std::cerr << file << ":" << line << ":" << column << ": error: "
               << message << "\n";
     std::abort();
   }
 
+  int line() const { return lines.find(source.data()).line; }
+
   void eat(std::string_view value) {
     skip_whitespace();
     if (!source.starts_with(value)) {
@@ -97,14 +100,6 @@ struct parser {
 
   void advance(std::size_t amount) {
     assert(amount <= source.size());
-    for (char c : source.substr(0, amount)) {
-      if (c == '\n') {
-        line++;
-        column = 1;
-      } else {
-        column++;
-      }
-    }
     source.remove_prefix(amount);
   }
 
@@ -268,13 +263,9 @@ struct parser {
       if (consume_symbol("*")) {
         result = expression::wrap(mul{{std::move(result), parse_prefix()}});
       } else if (consume_symbol("/")) {
-        result = expression::wrap(call{
-            expression::wrap(name{"div"}),
-            {std::move(result), parse_prefix()}});
+        result = expression::wrap(div{{std::move(result), parse_prefix()}});
       } else if (consume_symbol("%")) {
-        result = expression::wrap(call{
-            expression::wrap(name{"mod"}),
-            {std::move(result), parse_prefix()}});
+        result = expression::wrap(mod{{std::move(result), parse_prefix()}});
       } else {
         break;
       }
@@ -401,7 +392,9 @@ struct parser {
     std::vector<statement> else_branch;
     if (consume_name("else")) {
       if (peek_name() == "if") {
+        const int else_line = line();
         else_branch = {parse_if_statement()};
+        else_branch[0].line = else_line;
       } else {
         eat("{");
         parse_newline();
@@ -560,7 +553,10 @@ struct parser {
       }
     };
     while (!source.empty() && source[0] != '}') {
+      const int start = line();
+      const std::size_t first = output.size();
       parse_line();
+      for (auto i = first; i < output.size(); i++) output[i].line = start;
       eat("\n");
       skip_whitespace();
     }
@@ -568,6 +564,7 @@ struct parser {
   }
 
   function_definition parse_function_definition() {
+    const int start = line();
     eat_name("function");
     auto [name] = parse_name();
     eat("(");
@@ -586,7 +583,7 @@ struct parser {
     parse_newline();
     auto body = parse_statements();
     eat("}");
-    return {std::move(name), std::move(arguments), std::move(body)};
+    return {std::move(name), std::move(arguments), std::move(body), start};
   }
 
   import_statement parse_import() {
@@ -623,6 +620,11 @@ struct parser {
         std::move(x.begin(), x.end(), std::back_inserter(output.body));
       } else if (name == "function") {
         output.body.push_back(declaration::wrap(parse_function_definition()));
+      } else if (name == "inline") {
+        eat_name("inline");
+        auto function = parse_function_definition();
+        function.is_inline = true;
+        output.body.push_back(declaration::wrap(std::move(function)));
       } else {
         die("Expected declaration.");
       }
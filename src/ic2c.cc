@@ -0,0 +1,768 @@
+import "util/check.h";
+import <fstream>;
+import <iomanip>;
+import <iostream>;
+import <optional>;
+import <set>;
+import <span>;
+import <sstream>;
+import <string>;
+import <string_view>;
+import <variant>;
+import <vector>;
+import compiler.ast;
+import compiler.codegen;
+import compiler.parser;
+import as.parser;
+import as.encode;
+import as.image;
+import intcode;
+import util.io;
+import util.value_ptr;
+
+template <typename... Ts> struct overload : Ts... { using Ts::operator()...; };
+template <typename... Ts> overload(Ts...) -> overload<Ts...>;
+
+struct flag {
+  using load_bool = void();
+  using load_value = void(const char*);
+
+  std::string_view name;
+  std::optional<const char*> value;
+  std::string_view description;
+  std::variant<load_bool*, load_value*> load;
+};
+
+struct {
+  const char* output;
+  std::span<char*> positional;
+} args;
+
+void show_usage_and_exit();
+
+constexpr flag flags[] = {
+  {"help", {}, "Displays the usage information.", show_usage_and_exit},
+  {"output", "-", "File to write to.", +[](const char* x) { args.output = x; }},
+};
+
+void show_usage_and_exit() {
+  std::cout << "Built on " __DATE__ " at " __TIME__ "\n\nFlags:\n";
+  for (const flag& f : flags) {
+    std::cout << "  --" << f.name << "\t" << f.description;
+    if (f.value) std::cout << " Default value: " << std::quoted(*f.value);
+    std::cout << "\n";
+  }
+  std::exit(0);
+}
+
+void read_options(int& argc, char**& argv) {
+  for (const flag& f : flags) {
+    if (auto* load = std::get_if<flag::load_value*>(&f.load)) {
+      (*load)(f.value.value());
+    }
+  }
+  bool options_done = false;
+  int j = 1;
+  for (int i = 1; i < argc; i++) {
+    std::string_view argument = argv[i];
+    if (options_done || !argument.starts_with("--")) {
+      argv[j++] = argv[i];
+    } else if (argument == "--") {
+      options_done = true;
+    } else {
+      // Values may be given either as --name=value or as --name value.
+      std::string_view name = argument.substr(2);
+      const char* value = nullptr;
+      if (auto equals = name.find('='); equals != name.npos) {
+        value = argv[i] + 2 + equals + 1;
+        name = name.substr(0, equals);
+      }
+      for (const flag& f : flags) {
+        if (name == f.name) {
+          std::visit(overload{
+            [&](flag::load_bool* load) {
+              if (value) {
+                std::cerr << "Unexpected argument for --" << f.name << ".\n";
+                std::exit(1);
+              }
+              load();
+            },
+            [&](flag::load_value* load) {
+              if (value) {
+                load(value);
+              } else if (++i < argc &&
+                         !std::string_view(argv[i]).starts_with("--")) {
+                load(argv[i]);
+              } else {
+                std::cerr << "Missing argument for --" << f.name << ".\n";
+                std::exit(1);
+              }
+            },
+          }, f.load);
+        }
+      }
+    }
+  }
+  argc = j;
+  args.positional = std::span<char*>(argv, argc);
+}
+
+using value_type = program::value_type;
+
+std::vector<value_type> load(const char* filename) {
+  auto extension = std::filesystem::path(filename).extension();
+  if (extension == ".icb") {
+    const auto image = as::parse_image(filename, contents(filename));
+    return {image.code.begin(), image.code.end()};
+  } else if (extension == ".ic") {
+    return program::load(contents(filename));
+  } else if (extension == ".asm") {
+    return as::encode(as::parse(filename, contents(filename)));
+  } else if (extension == ".is") {
+    auto code = compiler::load(filename);
+    return as::encode(compiler::generate(code));
+  } else {
+    std::cerr << "Unknown extension " << std::quoted(extension.c_str())
+              << ", must be \".icb\", \".ic\", \".asm\", or \".is\".\n";
+    std::exit(1);
+  }
+}
+
+enum class opcode {
+  add = 1,
+  mul = 2,
+  input = 3,
+  output = 4,
+  jump_if_true = 5,
+  jump_if_false = 6,
+  less_than = 7,
+  equals = 8,
+  adjust_relative_base = 9,
+  halt = 99,
+};
+
+enum class mode { position = 0, immediate = 1, relative = 2 };
+
+struct instruction {
+  opcode code;
+  int size;
+  mode params[3];
+};
+
+// Decodes an instruction, or returns nullopt if the value is not a valid
+// instruction.
+std::optional<instruction> decode(value_type x) {
+  if (x < 0) return std::nullopt;
+  instruction result;
+  result.code = opcode(x % 100);
+  switch (result.code) {
+    case opcode::add:
+    case opcode::mul:
+    case opcode::less_than:
+    case opcode::equals:
+      result.size = 4;
+      break;
+    case opcode::jump_if_true:
+    case opcode::jump_if_false:
+      result.size = 3;
+      break;
+    case opcode::input:
+    case opcode::output:
+    case opcode::adjust_relative_base:
+      result.size = 2;
+      break;
+    case opcode::halt:
+      result.size = 1;
+      break;
+    default:
+      return std::nullopt;
+  }
+  value_type modes = x / 100;
+  for (int i = 0; i < 3; i++, modes /= 10) {
+    const int m = modes % 10;
+    if (i >= result.size - 1) {
+      if (m != 0) return std::nullopt;
+      result.params[i] = mode::position;
+    } else if (m > 2) {
+      return std::nullopt;
+    } else {
+      result.params[i] = mode(m);
+    }
+  }
+  if (modes) return std::nullopt;
+  // Outputs can't be immediate.
+  const int output = result.code == opcode::input ? 0
+                     : result.size == 4           ? 2
+                                                  : -1;
+  if (output != -1 && result.params[output] == mode::immediate) {
+    return std::nullopt;
+  }
+  return result;
+}
+
+// Runtime support for the generated code. The image, its size, and the tables
+// of translated instructions are defined before this.
+constexpr std::string_view runtime = R"(
+static value* m;
+static uint64_t size;
+
+static void fail(const char* message, value x) {
+  fflush(stdout);
+  fprintf(stderr, "%s %lld\n", message, (long long)x);
+  abort();
+}
+
+static void grow(value address) {
+  if (address < 0 || address >= 50000000) fail("bad address", address);
+  uint64_t new_size = 2 * address + 1;
+  m = (value*)realloc(m, new_size * sizeof(value));
+  if (!m) fail("out of memory at address", address);
+  memset(m + size, 0, (new_size - size) * sizeof(value));
+  size = new_size;
+}
+
+static inline value load(value address) {
+  if ((uint64_t)address >= size) grow(address);
+  return m[address];
+}
+
+// Marks the translated instructions which depend on a cell as stale if the
+// store changes it, after which they are left to the interpreter.
+static inline void store(value address, value x) {
+  if ((uint64_t)address >= size) grow(address);
+  if ((uint64_t)address < image_size && baked[address] && m[address] != x) {
+    for (int i = 0; i < 4; i++) {
+      if (baked[address] >> i & 1) stale[address - i] = 1;
+    }
+  }
+  m[address] = x;
+}
+
+static inline value add(value a, value b) { return (uint64_t)a + (uint64_t)b; }
+static inline value mul(value a, value b) { return (uint64_t)a * (uint64_t)b; }
+
+static value input(void) {
+  fflush(stdout);
+  int c = getchar();
+  return c == EOF ? -1 : c;
+}
+
+static void output(value x) { putchar((unsigned char)x); }
+
+static value address(value pc, value relative_base, int i) {
+  static const value scale[] = {100, 1000, 10000};
+  value x = load(pc + 1 + i);
+  switch (load(pc) / scale[i] % 10) {
+    case 0: return x;
+    case 2: return relative_base + x;
+  }
+  fail("illegal instruction at", pc);
+  return 0;
+}
+
+static value get(value pc, value relative_base, int i) {
+  static const value scale[] = {100, 1000, 10000};
+  if (load(pc) / scale[i] % 10 == 1) return load(pc + 1 + i);
+  return load(address(pc, relative_base, i));
+}
+
+int main(void) {
+  value pc = 0, relative_base = 0, a, b;
+  (void)a;
+  (void)b;
+  size = initial_size;
+  m = (value*)calloc(size, sizeof(value));
+  if (!m) fail("out of memory at address", size);
+  memcpy(m, image, sizeof(image));
+  goto dispatch;
+
+  // Executes at least one instruction, and then continues until it reaches a
+  // translated instruction.
+interpret:
+#define GET(i) get(pc, relative_base, i)
+#define ADDRESS(i) address(pc, relative_base, i)
+  do {
+    if (pc < 0) fail("illegal instruction at", pc);
+    switch (load(pc) % 100) {
+      case 1:
+        store(ADDRESS(2), add(GET(0), GET(1)));
+        pc += 4;
+        break;
+      case 2:
+        store(ADDRESS(2), mul(GET(0), GET(1)));
+        pc += 4;
+        break;
+      case 3:
+        store(ADDRESS(0), input());
+        pc += 2;
+        break;
+      case 4:
+        output(GET(0));
+        pc += 2;
+        break;
+      case 5:
+        pc = GET(0) ? GET(1) : pc + 3;
+        break;
+      case 6:
+        pc = GET(0) ? pc + 3 : GET(1);
+        break;
+      case 7:
+        store(ADDRESS(2), GET(0) < GET(1));
+        pc += 4;
+        break;
+      case 8:
+        store(ADDRESS(2), GET(0) == GET(1));
+        pc += 4;
+        break;
+      case 9:
+        relative_base += GET(0);
+        pc += 2;
+        break;
+      case 99:
+        goto halt;
+      default:
+        fail("illegal instruction at", pc);
+    }
+  } while ((uint64_t)pc >= image_size || !entry[pc] || stale[pc]);
+#undef ADDRESS
+#undef GET
+
+dispatch:
+  switch (pc) {
+)";
+
+// Translates a program into C. Instructions which are statically reachable
+// from the start of the program become straight-line code, with constant jumps
+// turned into gotos. Computed jumps go through a switch, and anything which
+// can't be translated is handled by an interpreter.
+//
+// Operand cells which the program is likely to patch, as the compiler does for
+// passing values between instructions, are read at run time, and instructions
+// whose opcode is likely to be patched check it before running. Any other
+// change to a translated instruction marks just that instruction as stale, and
+// the interpreter runs it from then on, returning to the translated code at the
+// next instruction which is not stale.
+class translator {
+ public:
+  explicit translator(std::span<const value_type> code)
+      : code_(code), patched_(code.size()), entry_(code.size()),
+        baked_(code.size()) {
+    // Find the cells written by the reachable code, then find the reachable
+    // code again without depending on those cells. This can uncover more code,
+    // such as the body of a loop whose condition is patched, so it is repeated
+    // until no more cells are found.
+    while (true) {
+      explore();
+      bool changed = false;
+      for (value_type target : written_cells()) {
+        if (!patched_[target]) changed = patched_[target] = true;
+      }
+      if (!changed) break;
+    }
+    for (value_type pc = 0, n = code_.size(); pc < n; pc++) {
+      if (!entry_[pc]) continue;
+      const int size = decode(code_[pc])->size;
+      for (int i = 0; i < size; i++) {
+        if (!patched_[pc + i]) baked_[pc + i] |= 1 << i;
+      }
+    }
+  }
+
+  void emit(std::ostream& output) {
+    const value_type n = code_.size();
+    output << "#include <stdint.h>\n"
+              "#include <stdio.h>\n"
+              "#include <stdlib.h>\n"
+              "#include <string.h>\n\n"
+              "typedef int64_t value;\n\n"
+              "static const value image[] = {";
+    for (value_type i = 0; i < n; i++) {
+      output << (i % 16 ? " " : "\n  ") << code_[i] << ',';
+    }
+    // Empty arrays are not allowed in C.
+    output << (n == 0 ? "0" : "") << "\n};\n"
+           << "static const uint64_t image_size = " << n << ";\n";
+    emit_table(output, "entry", entry_);
+    emit_table(output, "baked", baked_);
+    output << "static unsigned char stale[" << std::max<value_type>(n, 1)
+           << "];\n";
+
+    // Translate the instructions into a separate buffer first, since doing so
+    // determines how much memory needs to be allocated up front.
+    initial_size_ = std::max<value_type>(n, 1);
+    std::ostringstream body;
+    for (value_type pc = 0; pc < n; pc++) {
+      if (entry_[pc]) translate(body, pc);
+    }
+    output << "static const uint64_t initial_size = " << initial_size_
+           << ";\n"
+           << runtime;
+    for (value_type pc = 0; pc < n; pc++) {
+      if (entry_[pc]) output << "    case " << pc << ": goto i" << pc << ";\n";
+    }
+    output << "    default: goto interpret;\n"
+              "  }\n\n"
+           << body.str()
+           << "halt:\n"
+              "  fflush(stdout);\n"
+              "  return 0;\n"
+              "}\n";
+  }
+
+ private:
+  bool is_static(value_type address) const {
+    return 0 <= address && address < (value_type)code_.size() &&
+           !patched_[address];
+  }
+
+  // Returns the cells within the program which the reachable code is likely
+  // to write to. This includes the fixed addresses that it stores to, and any
+  // constants used in arithmetic which point at the program, since these are
+  // typically addresses which are passed around, such as the location to
+  // write the result of a function call.
+  std::vector<value_type> written_cells() const {
+    const value_type n = code_.size();
+    std::vector<value_type> result;
+    const auto add = [&](value_type address) {
+      if (0 <= address && address < n) result.push_back(address);
+    };
+    for (value_type pc = 0; pc < n; pc++) {
+      if (!entry_[pc]) continue;
+      const auto op = *decode(code_[pc]);
+      if (op.code == opcode::add || op.code == opcode::mul) {
+        for (int i = 0; i < 2; i++) {
+          if (op.params[i] == mode::immediate) add(code_[pc + 1 + i]);
+        }
+      }
+      const int output = op.code == opcode::input ? 0
+                         : op.size == 4           ? 2
+                                                  : -1;
+      if (output != -1 && op.params[output] == mode::position &&
+          is_static(pc + 1 + output)) {
+        add(code_[pc + 1 + output]);
+      }
+    }
+    return result;
+  }
+
+  // Checks whether the instruction at pc can be translated. Instructions with
+  // a patched opcode are translated as they were originally, but check the
+  // opcode before running.
+  bool translatable(value_type pc) const {
+    if (pc < 0 || (value_type)code_.size() <= pc) return false;
+    const auto op = decode(code_[pc]);
+    return op && pc + op->size <= (value_type)code_.size();
+  }
+
+  // Marks every translatable instruction reachable from the start of the
+  // program via constant control flow. Code addresses which are passed around
+  // as values, such as return addresses, are also reachable via computed
+  // jumps, so constants which may flow into the target of one are treated as
+  // entry points too.
+  void explore() {
+    std::fill(entry_.begin(), entry_.end(), false);
+    std::vector<value_type> roots = {0};
+    while (!roots.empty()) {
+      mark(roots);
+      roots.clear();
+      for (value_type x : code_addresses()) {
+        if (translatable(x) && !entry_[x]) roots.push_back(x);
+      }
+    }
+  }
+
+  // Marks the instructions reachable from the given ones via constant control
+  // flow.
+  void mark(std::vector<value_type> stack) {
+    while (!stack.empty()) {
+      const value_type pc = stack.back();
+      stack.pop_back();
+      if (!translatable(pc) || entry_[pc]) continue;
+      entry_[pc] = true;
+      const auto op = *decode(code_[pc]);
+      switch (op.code) {
+        case opcode::halt:
+          break;
+        case opcode::jump_if_true:
+        case opcode::jump_if_false: {
+          const bool jump_if = op.code == opcode::jump_if_true;
+          const bool constant_condition =
+              op.params[0] == mode::immediate && is_static(pc + 1);
+          const bool taken = (code_[pc + 1] != 0) == jump_if;
+          if (!constant_condition || !taken) stack.push_back(pc + 3);
+          if (op.params[1] == mode::immediate && is_static(pc + 2) &&
+              (!constant_condition || taken)) {
+            stack.push_back(code_[pc + 2]);
+          }
+          break;
+        }
+        default:
+          stack.push_back(pc + op.size);
+          break;
+      }
+    }
+  }
+
+  // Cells which operands can refer to, other than fixed addresses. Cells
+  // relative to the base are not told apart, since the base changes.
+  static constexpr value_type relative_cell = -1, unknown_cell = -2;
+
+  // Returns the cell that operand i of the instruction at pc reads or writes,
+  // or nullopt if it is a constant.
+  std::optional<value_type> location(value_type pc, const instruction& op,
+                                     int i) const {
+    const value_type address = pc + 1 + i;
+    switch (op.params[i]) {
+      case mode::position:
+        if (!is_static(address) || code_[address] < 0) return unknown_cell;
+        return code_[address];
+      case mode::immediate:
+        if (is_static(address)) return std::nullopt;
+        return address;
+      case mode::relative:
+        return relative_cell;
+    }
+    std::abort();
+  }
+
+  // Returns the constants used in arithmetic by the reachable code which may
+  // end up as the target of a computed jump. Values are followed backwards
+  // from the cells that computed jumps read their targets from, through the
+  // arithmetic which writes to those cells.
+  std::vector<value_type> code_addresses() const {
+    const value_type n = code_.size();
+    std::vector<value_type> arithmetic;
+    std::set<value_type> carriers;
+    for (value_type pc = 0; pc < n; pc++) {
+      if (!entry_[pc]) continue;
+      const auto op = *decode(code_[pc]);
+      if (op.code == opcode::add || op.code == opcode::mul) {
+        arithmetic.push_back(pc);
+      } else if (op.code == opcode::jump_if_true ||
+                 op.code == opcode::jump_if_false) {
+        if (auto target = location(pc, op, 1)) carriers.insert(*target);
+      }
+    }
+    // Writes to an unknown cell may reach any of them.
+    const auto carries = [&](value_type cell) {
+      return carriers.contains(unknown_cell) || carriers.contains(cell) ||
+             (cell == unknown_cell && !carriers.empty());
+    };
+    bool changed = true;
+    while (changed) {
+      changed = false;
+      for (value_type pc : arithmetic) {
+        const auto op = *decode(code_[pc]);
+        if (!carries(*location(pc, op, 2))) continue;
+        for (int i = 0; i < 2; i++) {
+          if (auto cell = location(pc, op, i)) {
+            changed |= carriers.insert(*cell).second;
+          }
+        }
+      }
+    }
+    std::vector<value_type> result;
+    for (value_type pc : arithmetic) {
+      const auto op = *decode(code_[pc]);
+      if (!carries(*location(pc, op, 2))) continue;
+      for (int i = 0; i < 2; i++) {
+        if (!location(pc, op, i)) result.push_back(code_[pc + 1 + i]);
+      }
+    }
+    return result;
+  }
+
+  template <typename T>
+  static void emit_table(std::ostream& output, std::string_view name,
+                         const std::vector<T>& values) {
+    output << "static const unsigned char " << name << "[] = {";
+    for (std::size_t i = 0; i < values.size(); i++) {
+      output << (i % 32 ? "" : "\n  ") << (int)values[i] << ',';
+    }
+    output << (values.empty() ? "0" : "") << "\n};\n";
+  }
+
+  // Checks whether a constant address can be accessed directly. Other
+  // addresses are accessed through load() and store(), which fail at run time
+  // if the access is out of bounds, since it may never be reached.
+  static bool is_direct(value_type address) {
+    return 0 <= address && address < 50'000'000;
+  }
+
+  // Makes sure that the address is allocated up front, so that the generated
+  // code can access it directly.
+  std::string cell(value_type address) {
+    check(is_direct(address));
+    initial_size_ = std::max(initial_size_, address + 1);
+    return "m[" + std::to_string(address) + "]";
+  }
+
+  // Returns an expression for operand i of the instruction at pc.
+  std::string get(value_type pc, const instruction& op, int i) {
+    const value_type address = pc + 1 + i;
+    const bool constant = is_static(address);
+    const std::string x =
+        constant ? std::to_string(code_[address]) : cell(address);
+    switch (op.params[i]) {
+      case mode::position:
+        if (constant && is_direct(code_[address])) return cell(code_[address]);
+        return "load(" + x + ")";
+      case mode::immediate:
+        return x;
+      case mode::relative:
+        return "load(relative_base + " + x + ")";
+    }
+    std::abort();
+  }
+
+  // Emits a statement which stores a value in operand i of the instruction at
+  // pc.
+  void put(std::ostream& output, value_type pc, const instruction& op, int i,
+           std::string_view value) {
+    const value_type address = pc + 1 + i;
+    const bool constant = is_static(address);
+    const std::string x =
+        constant ? std::to_string(code_[address]) : cell(address);
+    if (op.params[i] == mode::position && constant &&
+        is_direct(code_[address]) && !is_static(code_[address])) {
+      // Fixed addresses are never translated, so no checks are needed.
+      output << "  " << cell(code_[address]) << " = " << value << ";\n";
+      return;
+    }
+    const std::string target =
+        op.params[i] == mode::relative ? "relative_base + " + x : x;
+    output << "  store(" << target << ", " << value << ");\n";
+  }
+
+  // Emits a jump to the given address.
+  void jump(std::ostream& output, value_type target,
+            std::string_view indent = "  ") {
+    if (0 <= target && target < (value_type)code_.size() && entry_[target]) {
+      output << indent << "goto i" << target << ";\n";
+    } else {
+      output << indent << "pc = " << target << ";\n"
+             << indent << "goto interpret;\n";
+    }
+  }
+
+  void translate(std::ostream& output, value_type pc) {
+    const auto op = *decode(code_[pc]);
+    output << "i" << pc << ":\n";
+    bool baked = false;
+    for (int i = 0; i < op.size; i++) baked |= baked_[pc + i] >> i & 1;
+    if (baked) {
+      output << "  if (stale[" << pc << "]) {\n"
+             << "    pc = " << pc << ";\n"
+             << "    goto interpret;\n"
+             << "  }\n";
+    }
+    if (patched_[pc]) {
+      output << "  if (" << cell(pc) << " != " << code_[pc] << ") {\n"
+             << "    pc = " << pc << ";\n"
+             << "    goto interpret;\n"
+             << "  }\n";
+    }
+    switch (op.code) {
+      case opcode::add:
+        output << "  a = " << get(pc, op, 0) << ";\n"
+               << "  b = " << get(pc, op, 1) << ";\n";
+        put(output, pc, op, 2, "add(a, b)");
+        break;
+      case opcode::mul:
+        output << "  a = " << get(pc, op, 0) << ";\n"
+               << "  b = " << get(pc, op, 1) << ";\n";
+        put(output, pc, op, 2, "mul(a, b)");
+        break;
+      case opcode::less_than:
+        output << "  a = " << get(pc, op, 0) << ";\n"
+               << "  b = " << get(pc, op, 1) << ";\n";
+        put(output, pc, op, 2, "a < b");
+        break;
+      case opcode::equals:
+        output << "  a = " << get(pc, op, 0) << ";\n"
+               << "  b = " << get(pc, op, 1) << ";\n";
+        put(output, pc, op, 2, "a == b");
+        break;
+      case opcode::input:
+        output << "  a = input();\n";
+        put(output, pc, op, 0, "a");
+        break;
+      case opcode::output:
+        output << "  output(" << get(pc, op, 0) << ");\n";
+        break;
+      case opcode::adjust_relative_base:
+        output << "  relative_base += " << get(pc, op, 0) << ";\n";
+        break;
+      case opcode::halt:
+        output << "  goto halt;\n";
+        return;
+      case opcode::jump_if_true:
+      case opcode::jump_if_false: {
+        const bool jump_if = op.code == opcode::jump_if_true;
+        const bool constant_target =
+            op.params[1] == mode::immediate && is_static(pc + 2);
+        if (op.params[0] == mode::immediate && is_static(pc + 1)) {
+          if ((code_[pc + 1] != 0) != jump_if) break;
+          if (constant_target) {
+            jump(output, code_[pc + 2]);
+          } else {
+            output << "  pc = " << get(pc, op, 1) << ";\n"
+                   << "  goto dispatch;\n";
+          }
+          return;
+        }
+        output << "  if (" << (jump_if ? "" : "!") << get(pc, op, 0)
+               << ") {\n";
+        if (constant_target) {
+          jump(output, code_[pc + 2], "    ");
+        } else {
+          output << "    pc = " << get(pc, op, 1) << ";\n"
+                 << "    goto dispatch;\n";
+        }
+        output << "  }\n";
+        break;
+      }
+    }
+    // Fall through to the next instruction if it is translated immediately
+    // afterwards.
+    const value_type next = pc + op.size;
+    const auto following =
+        std::find(entry_.begin() + pc + 1, entry_.end(), true);
+    if (following - entry_.begin() == next) return;
+    jump(output, next);
+  }
+
+  std::span<const value_type> code_;
+  // Cells written by the program at a fixed address.
+  std::vector<bool> patched_;
+  // Addresses of translated instructions.
+  std::vector<bool> entry_;
+  // Cells whose values the translated code depends on. Bit i is set if the
+  // cell belongs to the translated instruction which starts i cells earlier.
+  std::vector<unsigned char> baked_;
+  value_type initial_size_ = 0;
+};
+
+int main(int argc, char* argv[]) {
+  read_options(argc, argv);
+  if (args.positional.size() != 2) {
+    std::cerr << "Usage: ic2c [--output <file>] <filename>\n";
+    return 1;
+  }
+  const auto code = load(argv[1]);
+  std::ofstream file;
+  std::ostream* output;
+  if (args.output == std::string_view("-")) {
+    output = &std::cout;
+  } else {
+    file.open(args.output);
+    if (!file.good()) {
+      std::cerr << "Could not open " << std::quoted(args.output)
+                << " for writing.\n";
+      return 1;
+    }
+    output = &file;
+  }
+  translator translator(code);
+  translator.emit(*output);
+}
@@ -1,10 +1,16 @@
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+
 import "util/check.h";
 import <fstream>;
 import <iostream>;
+import <memory>;
 import <optional>;
 import <string>;
 import <map>;
 import <span>;
+import <utility>;
 import <variant>;
 import <vector>;
 import compiler.ast;
@@ -12,6 +18,9 @@ import compiler.codegen;
 import compiler.parser;
 import as.parser;
 import as.encode;
+import as.image;
+import as.optimize;
+import as.symbols;
 import intcode;
 import util.io;
 import util.value_ptr;
@@ -31,6 +40,15 @@ struct flag {
 
 struct {
   bool debug;
+  bool profile;
+  program::engine engine;
+  const char* input;
+  const char* trace;
+  const char* symbols;
+  const char* flame_graph;
+  std::uint64_t sample_interval;
+  bool optimize;
+  std::vector<as::pass> passes;
   std::span<char*> positional;
 } args;
 
@@ -39,6 +57,56 @@ void show_usage_and_exit();
 constexpr flag flags[] = {
   {"help", {}, "Displays the usage information.", show_usage_and_exit},
   {"debug", {}, "Show executed instructions", +[]() { args.debug = true; }},
+  {"profile", {}, "Count executed instructions and show a report at the end.",
+   +[]() { args.profile = true; }},
+  {"engine", "threaded",
+   "Execution engine (simple, predecoded, threaded, or jit).",
+   +[](const char* x) {
+     if (x == std::string_view("simple")) {
+       args.engine = program::engine::simple;
+     } else if (x == std::string_view("predecoded")) {
+       args.engine = program::engine::predecoded;
+     } else if (x == std::string_view("threaded")) {
+       args.engine = program::engine::threaded;
+     } else if (x == std::string_view("jit")) {
+       args.engine = program::engine::jit;
+     } else {
+       std::cerr << "Invalid engine.\n";
+       std::exit(1);
+     }
+   }},
+  {"input", "", "File to read input from instead of stdin. Regular files are "
+   "mapped into memory rather than being read.",
+   +[](const char* x) { args.input = x; }},
+  {"trace", "", "File to write a binary trace of executed instructions to.",
+   +[](const char* x) { args.trace = x; }},
+  {"symbols", "", "Symbol map for the program, as written by the compiler. "
+   "Maps for .asm and .is programs are generated automatically.",
+   +[](const char* x) { args.symbols = x; }},
+  {"flame_graph", "", "File to write call stack samples to, in the collapsed "
+   "format used by flamegraph.pl. Requires a symbol map.",
+   +[](const char* x) { args.flame_graph = x; }},
+  {"sample_interval", "1000",
+   "Number of instructions between call stack samples for --flame_graph.",
+   +[](const char* x) {
+     args.sample_interval = std::strtoull(x, nullptr, 10);
+     if (args.sample_interval == 0) {
+       std::cerr << "Invalid sample interval.\n";
+       std::exit(1);
+     }
+   }},
+  {"optimize", {}, "Optimize the compiled program. Can also be given as -O.",
+   +[]() { args.optimize = true; }},
+  {"passes", "peephole,copy_propagation,jump_threading,unreachable_code,"
+   "dead_stores", "Comma-separated list of optimization passes to run.",
+   +[](const char* x) {
+     if (auto passes = as::parse_passes(x)) {
+       args.passes = std::move(*passes);
+     } else {
+       std::cerr << "Invalid list of passes.\n";
+       std::exit(1);
+     }
+   }},
 };
 
 void show_usage_and_exit() {
@@ -61,17 +129,35 @@ void read_options(int& argc, char**& argv) {
   int j = 1;
   for (int i = 1; i < argc; i++) {
     std::string_view argument = argv[i];
-    if (options_done || !argument.starts_with("--")) {
+    if (!options_done && argument == "-O") {
+      args.optimize = true;
+    } else if (options_done || !argument.starts_with("--")) {
       argv[j++] = argv[i];
     } else if (argument == "--") {
       options_done = true;
     } else {
+      // Values may be given either as --name=value or as --name value.
+      std::string_view name = argument.substr(2);
+      const char* value = nullptr;
+      if (auto equals = name.find('='); equals != name.npos) {
+        value = argv[i] + 2 + equals + 1;
+        name = name.substr(0, equals);
+      }
       for (const flag& f : flags) {
-        if (argument.substr(2) == f.name) {
+        if (name == f.name) {
           std::visit(overload{
-            [&](flag::load_bool* load) { load(); },
+            [&](flag::load_bool* load) {
+              if (value) {
+                std::cerr << "Unexpected argument for --" << f.name << ".\n";
+                std::exit(1);
+              }
+              load();
+            },
             [&](flag::load_value* load) {
-              if (++i < argc && !std::string_view(argv[i]).starts_with("--")) {
+              if (value) {
+                load(value);
+              } else if (++i < argc &&
+                         !std::string_view(argv[i]).starts_with("--")) {
                 load(argv[i]);
               } else {
                 std::cerr << "Missing argument for --" << f.name << ".\n";
@@ -87,45 +173,208 @@ void read_options(int& argc, char**& argv) {
   args.positional = std::span<char*>(argv, argc);
 }
 
-std::vector<program::value_type> load(const char* filename) {
+// Loads the program, returning cells which remain valid for the rest of the
+// run. Binary images are used directly from the mapped file, while other
+// formats are decoded into storage.
+program::const_span load(const char* filename,
+                         std::vector<program::value_type>& storage,
+                         as::symbol_map& symbols) {
   auto extension = std::filesystem::path(filename).extension();
-  if (extension == ".ic") {
-    std::vector<program::value_type> buffer(program::max_size);
-    auto data = program::load(contents(filename), buffer);
-    buffer.resize(data.size());
-    return buffer;
+  if (*args.symbols) {
+    symbols = as::parse_symbols(args.symbols, contents(args.symbols));
+  }
+  if (extension == ".icb") {
+    const auto image = as::parse_image(filename, contents(filename));
+    if (image.code.size() + image.bss_size > program::memory_size) {
+      std::cerr << "Program in " << std::quoted(filename)
+                << " does not fit in memory.\n";
+      std::exit(1);
+    }
+    if (!*args.symbols && image.symbols) {
+      symbols = as::parse_symbols(filename, *image.symbols);
+    }
+    return image.code;
+  } else if (extension == ".ic") {
+    storage = program::load(contents(filename));
   } else if (extension == ".asm") {
-    return as::encode(as::parse(filename, contents(filename)));
+    as::symbol_map generated;
+    storage = as::encode(as::parse(filename, contents(filename)), generated);
+    if (!*args.symbols) symbols = std::move(generated);
   } else if (extension == ".is") {
     auto code = compiler::load(filename);
-    return as::encode(compiler::generate(code));
+    as::symbol_map generated;
+    auto compiled = compiler::generate(code);
+    if (args.optimize) as::optimize(compiled, args.passes);
+    storage = as::encode(compiled, generated);
+    if (!*args.symbols) symbols = std::move(generated);
   } else {
     std::cerr << "Unknown extension " << std::quoted(extension.c_str())
-              << ", must be \".ic\", \".asm\", or \".is\".\n";
+              << ", must be \".icb\", \".ic\", \".asm\", or \".is\".\n";
     std::exit(1);
   }
+  return storage;
 }
 
-int main(int argc, char* argv[]) {
-  read_options(argc, argv);
-  if (args.positional.size() != 2) {
-    std::cerr << "Usage: run <filename>\n";
-    return 1;
+constexpr std::size_t io_buffer_size = 1 << 16;
+
+// Reads input in large blocks from a file descriptor, or directly from data
+// which is already in memory.
+class input_buffer {
+ public:
+  explicit input_buffer(int fd)
+      : fd_(fd), buffer_(std::make_unique<char[]>(io_buffer_size)) {}
+  explicit input_buffer(std::string_view data) : data_(data) {}
+
+  // True if get() can return without reading any more input.
+  bool ready() const { return !data_.empty(); }
+
+  // Returns the next byte of input, or -1 at the end of the input.
+  int get() {
+    if (data_.empty() && !fill()) return -1;
+    const unsigned char c = data_.front();
+    data_.remove_prefix(1);
+    return c;
+  }
+
+ private:
+  bool fill() {
+    if (fd_ == -1) return false;
+    while (true) {
+      const ssize_t n = read(fd_, buffer_.get(), io_buffer_size);
+      if (n < 0 && errno == EINTR) continue;
+      if (n < 0) {
+        std::cerr << "Failed to read input.\n";
+        std::exit(1);
+      }
+      data_ = std::string_view(buffer_.get(), n);
+      return n > 0;
+    }
+  }
+
+  int fd_ = -1;
+  std::unique_ptr<char[]> buffer_;
+  std::string_view data_;
+};
+
+// Collects output and writes it to a file descriptor in large blocks.
+class output_buffer {
+ public:
+  explicit output_buffer(int fd)
+      : fd_(fd), buffer_(std::make_unique<char[]>(io_buffer_size)) {}
+  ~output_buffer() { flush(); }
+
+  output_buffer(const output_buffer&) = delete;
+  output_buffer& operator=(const output_buffer&) = delete;
+
+  void put(char c) {
+    if (size_ == io_buffer_size) flush();
+    buffer_[size_++] = c;
   }
-  program program(load(argv[1]), args.debug);
+
+  void flush() {
+    std::size_t i = 0;
+    while (i < size_) {
+      const ssize_t n = write(fd_, buffer_.get() + i, size_ - i);
+      if (n < 0 && errno == EINTR) continue;
+      if (n < 0) {
+        std::cerr << "Failed to write output.\n";
+        std::exit(1);
+      }
+      i += n;
+    }
+    size_ = 0;
+  }
+
+ private:
+  int fd_;
+  std::unique_ptr<char[]> buffer_;
+  std::size_t size_ = 0;
+};
+
+// Opens the file given by --input, or stdin if there is none. Pipes and empty
+// files can't be mapped into memory, so they are read like stdin.
+input_buffer open_input() {
+  if (!*args.input) return input_buffer(0);
+  const int fd = open(args.input, O_RDONLY);
+  if (fd < 0) {
+    std::cerr << "Cannot open input file " << std::quoted(args.input) << ".\n";
+    std::exit(1);
+  }
+  if (auto data = map_file(fd)) {
+    close(fd);
+    return input_buffer(*data);
+  }
+  return input_buffer(fd);
+}
+
+// Runs the program to completion with stdin and stdout, or the file given by
+// --input, as its input and output.
+template <typename trace_policy>
+void run(basic_program<trace_policy>& program) {
+  input_buffer input = open_input();
+  output_buffer output(1);
   while (!program.done()) {
     switch (program.resume()) {
       case program::ready:
         std::cerr << "Program paused for no reason.\n";
         std::abort();
       case program::waiting_for_input:
-        program.provide_input(std::cin.get());
+        // Output is only flushed when the program has to wait for input, so
+        // that interactive programs still show their prompts.
+        if (!input.ready()) output.flush();
+        program.provide_input(input.get());
         break;
       case program::output:
-        std::cout.put(program.get_output());
+        output.put(program.get_output());
+        // Keep the output in order with the trace on stderr.
+        if (args.debug) output.flush();
         break;
       case program::halt:
-        return 0;
+        break;
     }
   }
+  output.flush();
+}
+
+int main(int argc, char* argv[]) {
+  read_options(argc, argv);
+  if (args.positional.size() != 2) {
+    std::cerr << "Usage: run <filename>\n";
+    return 1;
+  }
+  std::vector<program::value_type> storage;
+  as::symbol_map symbols;
+  const auto code = load(argv[1], storage, symbols);
+  if (args.debug) {
+    basic_program<text_trace> program(std::in_place, code, args.engine);
+    run(program);
+  } else if (*args.trace) {
+    basic_program<binary_trace> program(std::in_place, code, args.engine,
+                                        binary_trace(args.trace));
+    run(program);
+  } else if (*args.flame_graph) {
+    if (symbols.locations.empty()) {
+      std::cerr << "--flame_graph needs a symbol map for the program.\n";
+      return 1;
+    }
+    std::ofstream file(args.flame_graph);
+    if (!file.good()) {
+      std::cerr << "Could not open " << std::quoted(args.flame_graph)
+                << " for writing.\n";
+      return 1;
+    }
+    basic_program<flame_graph> program(
+        std::in_place, code, args.engine,
+        flame_graph(symbols, args.sample_interval));
+    run(program);
+    program.trace().report(file);
+  } else if (args.profile) {
+    basic_program<profile> program(std::in_place, code, args.engine,
+                                   profile(code.size(), std::move(symbols)));
+    run(program);
+    program.trace().report(std::cerr);
+  } else {
+    program program(std::in_place, code, args.engine);
+    run(program);
+  }
 }
@@ -1,18 +1,38 @@
 module;
 
 #include <cassert>
+#include <sys/mman.h>
+
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
 
 export module intcode;
 
 import "../util/check.h";
 import util.io;
+import <algorithm>;
 import <array>;
+import <bit>;
 import <charconv>;  // bug
+import <cstddef>;
+import <cstdint>;
+import <cstdio>;
+import <cstring>;
+import <functional>;
+import <iomanip>;
+import <map>;
+import <memory>;
 import <optional>;  // bug
 import <span>;
+import <string>;
+import <unordered_map>;
+import <utility>;
 import <vector>;
 import <variant>;
 import as.ast;
+import as.symbols;
+import x86;
 
 using value_type = std::int64_t;
 
@@ -109,15 +129,228 @@ op decode_op(value_type x) {
   return ops[x];
 }
 
+// The threaded engine has one handler for each combination of opcode and
+// parameter modes. Handlers for each opcode are numbered consecutively in this
+// order, with the first parameter mode varying fastest.
+constexpr opcode handler_order[] = {
+  opcode::add,
+  opcode::mul,
+  opcode::input,
+  opcode::output,
+  opcode::jump_if_true,
+  opcode::jump_if_false,
+  opcode::less_than,
+  opcode::equals,
+  opcode::adjust_relative_base,
+  opcode::halt,
+};
+
+constexpr int num_mode_combinations(opcode o) {
+  int n = 1;
+  for (int i = 1; i < op_size(o); i++) n *= 3;
+  return n;
+}
+
+constexpr int handler_id(op o) {
+  // Handler 0 is used for illegal instructions.
+  if (o.code == opcode::illegal) return 0;
+  int base = 1;
+  for (opcode code : handler_order) {
+    if (code == o.code) {
+      int offset = 0;
+      for (int i = op_size(code) - 2; i >= 0; i--) {
+        offset = 3 * offset + int(o.params[i]);
+      }
+      return base + offset;
+    }
+    base += num_mode_combinations(code);
+  }
+  return 0;
+}
+
+constexpr int num_handlers = [] {
+  int n = 1;
+  for (opcode code : handler_order) n += num_mode_combinations(code);
+  return n;
+}();
+
+constexpr auto handler_ids = [] {
+  std::array<unsigned char, ops.size()> ids = {};
+  for (int i = 0, n = ops.size(); i < n; i++) ids[i] = handler_id(ops[i]);
+  return ids;
+}();
+
+// The opcode and parameter modes handled by each handler.
+constexpr auto handler_ops = [] {
+  std::array<op, num_handlers> result = {};
+  for (int i = 0, n = ops.size(); i < n; i++) result[handler_ids[i]] = ops[i];
+  return result;
+}();
+
+// An array indexed by address whose storage is allocated a page at a time, the
+// first time that an entry in the page is accessed. Caches which are indexed
+// by the address of an instruction use this so that reaching a high address
+// doesn't allocate an entry for every address below it.
+template <typename T>
+class sparse_array {
+ public:
+  static constexpr int page_bits = 10;
+  static constexpr value_type page_size = 1 << page_bits;
+  static constexpr value_type page_mask = page_size - 1;
+
+  // Returns the entry at a non-negative address, allocating its page if
+  // necessary.
+  T& operator[](value_type address) {
+    const value_type i = address >> page_bits;
+    if (i >= (value_type)pages_.size()) pages_.resize(i + 1);
+    if (!pages_[i]) pages_[i] = std::make_unique<T[]>(page_size);
+    return pages_[i][address & page_mask];
+  }
+
+  // Returns the entry at an address, or nullptr if it has never been accessed.
+  T* find(value_type address) {
+    return const_cast<T*>(std::as_const(*this).find(address));
+  }
+
+  const T* find(value_type address) const {
+    const value_type i = address >> page_bits;
+    if (address < 0 || i >= (value_type)pages_.size() || !pages_[i]) {
+      return nullptr;
+    }
+    return &pages_[i][address & page_mask];
+  }
+
+  void clear() { pages_.clear(); }
+
+  // Returns the page with the given index, or nullptr if it has never been
+  // accessed. Indices run up to num_pages().
+  value_type num_pages() const { return pages_.size(); }
+  const T* page(value_type index) const { return pages_[index].get(); }
+
+ private:
+  std::vector<std::unique_ptr<T[]>> pages_;
+};
+
+// An instruction which has been decoded ahead of time. The operands are stored
+// alongside the opcode, so executing it does not require reading the
+// instruction from memory. An opcode of illegal means that the instruction has
+// not been decoded.
+struct decoded_op {
+  opcode code = opcode::illegal;
+  unsigned char size = 0;
+  unsigned char handler = 0;
+  mode params[3];
+  value_type args[3];
+};
+
+// Memory is split into fixed-size pages which are allocated on the first write.
+// Pages which have never been written refer to a shared page of zeroes, so
+// reads never allocate and programs only pay for the memory that they use.
+//
+// The pages are found through a two-level page table: a directory lists the
+// tables, and each table lists the pages for a contiguous range of addresses.
+// Tables which cover no written pages refer to a shared table for the zero
+// page, so an empty memory allocates only its directory. Most programs never
+// leave the range covered by the first table, so accesses to that range skip
+// the directory.
+//
+// Copies made by fork() share the directory, the tables, and the pages until
+// they are written. Each level lists the entries beneath it which may be
+// written in place, which are those that it owns exclusively. Writing to a
+// shared page copies the directory and the table above it if they are also
+// shared, so the first write after a fork copies a bounded number of entries
+// regardless of how much memory is in use.
 class memory {
  public:
-  value_type& operator[](value_type index) {
-    check(0 <= index);
-    check(index < 50'000'000);
-    if (index >= (value_type)buffer_.size()) buffer_.resize(2 * index + 1);
-    return buffer_[index];
+  static constexpr value_type max_size = 50'000'000;
+  static constexpr int page_bits = 12;
+  static constexpr value_type page_size = 1 << page_bits;
+  static constexpr value_type page_mask = page_size - 1;
+  static constexpr value_type num_pages = (max_size + page_mask) / page_size;
+  static constexpr int table_bits = 8;
+  static constexpr value_type table_size = 1 << table_bits;
+  static constexpr value_type table_mask = table_size - 1;
+  static constexpr value_type num_tables =
+      (num_pages + table_mask) / table_size;
+
+  struct table {
+    table() {
+      std::fill(std::begin(pages), std::end(pages), zero_page_);
+    }
+    table(const table& other) : owners(other.owners) {
+      std::copy(std::begin(other.pages), std::end(other.pages), pages);
+    }
+
+    value_type* pages[table_size];
+    // The pages which are owned by this table alone, or null.
+    value_type* writable[table_size] = {};
+    // Null for pages which refer to zero_page_ or to cells owned by someone
+    // else.
+    std::array<std::shared_ptr<value_type[]>, table_size> owners;
+  };
+
+  memory() : memory(std::make_shared<directory>()) {}
+
+  // Makes a memory whose initial contents are the given cells, which are used
+  // in place rather than copied and so must outlive this memory and every
+  // copy of it. Like the zero page, each whole page of cells is only copied
+  // the first time that it is written.
+  explicit memory(std::span<const value_type> cells) : memory() {
+    check(cells.size() <= (std::uint64_t)max_size);
+    const value_type n = cells.size(), whole = n >> page_bits;
+    for (value_type i = 0; i < whole; i++) {
+      table& table = writable_table(i >> table_bits);
+      table.pages[i & table_mask] =
+          const_cast<value_type*>(&cells[i << page_bits]);
+    }
+    // The cells after the last whole page may not be followed by a full page
+    // of readable memory, let alone by zeroes.
+    for (value_type i = whole << page_bits; i < n; i++) at(i) = cells[i];
+  }
+
+  memory(const memory&) = delete;
+  memory& operator=(const memory&) = delete;
+  memory(memory&&) = default;
+  memory& operator=(memory&&) = default;
+
+  // Returns a copy of this memory which shares all of its storage. This takes
+  // constant time. Afterwards, neither copy may write to any page in place
+  // until it has checked whether the page is still shared, so any pointers
+  // previously obtained from at() or writable_tables() are invalidated.
+  memory fork() const {
+    directory_->revoke();
+    low_writable_ = zero_table()->writable;
+    return memory(directory_);
+  }
+
+  value_type operator[](value_type index) const {
+    check((std::uint64_t)index < max_size);
+    const value_type i = index >> page_bits;
+    const value_type* page =
+        i < table_size ? low_pages_[i]
+                       : tables_[i >> table_bits]->pages[i & table_mask];
+    return page[index & page_mask];
+  }
+
+  // Returns a reference to the cell, allocating or copying its page if
+  // necessary.
+  value_type& at(value_type index) {
+    check((std::uint64_t)index < max_size);
+    const value_type i = index >> page_bits;
+    value_type* page = i < table_size ? low_writable_[i] : nullptr;
+    if (!page) page = writable_page(i);
+    return page[index & page_mask];
   }
 
+  // The page tables, for use by compiled code. Tables which may be written in
+  // place are also listed in the writable directory, in which all other
+  // entries are null. The pages of the first table are also available
+  // directly, with null entries for pages which can't be written in place.
+  const table* const* tables() const { return tables_; }
+  table* const* writable_tables() const { return writable_; }
+  value_type* const* low_pages() const { return low_pages_; }
+  value_type* const* low_writable_pages() const { return low_writable_; }
+
   static as::input_param decode_input(mode m, std::int64_t arg) {
     switch (m) {
       case mode::position: return {{}, as::address{as::literal{arg}}};
@@ -134,17 +367,18 @@ class memory {
     }
   }
 
-  as::calculation decode_calculation(std::int64_t pc, mode a, mode b, mode c) {
+  as::calculation decode_calculation(std::int64_t pc, mode a, mode b,
+                                     mode c) const {
     return {decode_input(a, (*this)[pc + 1]), decode_input(b, (*this)[pc + 2]),
             decode_output(c, (*this)[pc + 3])};
   }
 
-  as::jump decode_jump(std::int64_t pc, mode condition, mode target) {
+  as::jump decode_jump(std::int64_t pc, mode condition, mode target) const {
     return {decode_input(condition, (*this)[pc + 1]),
             decode_input(target, (*this)[pc + 2])};
   }
 
-  as::instruction decode(std::int64_t pc) {
+  as::instruction decode(std::int64_t pc) const {
     auto op = opcode((*this)[pc] % 100);
     auto a = mode((*this)[pc] / 100 % 10);
     auto b = mode((*this)[pc] / 1000 % 10);
@@ -168,163 +402,2111 @@ class memory {
   }
 
  private:
-  std::vector<value_type> buffer_;
-};
+  // Shared by every page which has not been written. This is never modified,
+  // since writes always go through at().
+  static inline value_type zero_page_[page_size] = {};
 
-export class program {
- public:
-  static constexpr int max_size = 5000;
-  using value_type = ::value_type;
-  using buffer = std::array<value_type, max_size>;
-  using span = std::span<value_type>;
-  using const_span = std::span<const value_type>;
+  // Shared by every table which covers no written pages. Since it is always
+  // shared, it is never written either.
+  static const std::shared_ptr<table>& zero_table() {
+    static const auto zero_table = std::make_shared<table>();
+    return zero_table;
+  }
 
-  static span load(std::string_view source, span buffer) {
-    check(!buffer.empty());
-    scanner scanner(source);
-    (scanner >> buffer[0]).check_ok();
-    unsigned n = 1;
-    while (!scanner.done()) {
-      check(n < buffer.size());
-      (scanner >> exact(",") >> buffer[n++]).check_ok();
+  struct directory {
+    directory() {
+      std::fill(std::begin(owners), std::end(owners), zero_table());
+      std::fill(std::begin(tables), std::end(tables), zero_table().get());
+    }
+    directory(const directory& other) : owners(other.owners) {
+      std::copy(std::begin(other.tables), std::end(other.tables), tables);
+    }
+
+    // Stops any tables from being written in place, because the directory is
+    // about to be shared.
+    void revoke() {
+      std::fill(std::begin(writable), std::end(writable), nullptr);
+    }
+
+    table* tables[num_tables];
+    // The tables which are owned by this directory alone, or null.
+    table* writable[num_tables] = {};
+    std::array<std::shared_ptr<table>, num_tables> owners;
+  };
+
+  explicit memory(std::shared_ptr<directory> directory)
+      : directory_(std::move(directory)),
+        tables_(directory_->tables),
+        writable_(directory_->writable) {
+    update_low();
+  }
+
+  void update_low() {
+    low_pages_ = tables_[0]->pages;
+    low_writable_ = writable_[0] ? writable_[0]->writable
+                                 : zero_table()->writable;
+  }
+
+  // Returns the table with the given index, first copying the directory and
+  // the table if they are shared.
+  table& writable_table(value_type index) {
+    if (directory_.use_count() > 1) {
+      directory_->revoke();
+      directory_ = std::make_shared<directory>(*directory_);
+      tables_ = directory_->tables;
+      writable_ = directory_->writable;
+    }
+    auto& owner = directory_->owners[index];
+    if (owner.use_count() > 1) {
+      // The original may be left with a single owner, which must not write
+      // in place to the pages that it now shares with the copy.
+      if (owner != zero_table()) {
+        std::fill(std::begin(owner->writable), std::end(owner->writable),
+                  nullptr);
+      }
+      owner = std::make_shared<table>(*owner);
+      directory_->tables[index] = owner.get();
     }
-    return buffer.first(n);
+    directory_->writable[index] = owner.get();
+    update_low();
+    return *owner;
   }
 
-  program() = default;
+  // Returns the page with the given index, which may be written in place.
+  value_type* writable_page(value_type index) {
+    if (index >= table_size) {
+      const table* table = writable_[index >> table_bits];
+      value_type* page = table ? table->writable[index & table_mask] : nullptr;
+      if (page) return page;
+    }
+    return make_writable(index);
+  }
 
-  explicit program(const_span source, bool debug = false)
-      : debug_(debug) {
-    for (value_type i = 0, n = source.size(); i < n; i++) {
-      memory_[i] = source[i];
+  value_type* make_writable(value_type index) {
+    table& table = writable_table(index >> table_bits);
+    auto& owner = table.owners[index & table_mask];
+    if (!owner || owner.use_count() > 1) {
+      std::shared_ptr<value_type[]> page(new value_type[page_size]);
+      const value_type* source = table.pages[index & table_mask];
+      std::copy(source, source + page_size, page.get());
+      owner = std::move(page);
+      table.pages[index & table_mask] = owner.get();
     }
+    return table.writable[index & table_mask] = owner.get();
   }
 
-  enum state {
-    ready,
-    waiting_for_input,
-    output,
-    halt,
+  std::shared_ptr<directory> directory_;
+  // The arrays within the directory, and the arrays within the first table,
+  // which are used on every access.
+  table* const* tables_;
+  table** writable_;
+  value_type* const* low_pages_;
+  mutable value_type* const* low_writable_;
+};
+
+// Compiles runs of instructions into x86-64 machine code. A block starts at
+// some address and follows the flow of control until it reaches an instruction
+// which can't be compiled, such as input or output, or a jump with a computed
+// target. Compiled code bakes in the values of the cells that it was compiled
+// from, and code_map_ counts the blocks which depend on each cell so that any
+// store which changes such a cell can check cheaply whether it needs to
+// invalidate anything. The blocks themselves are found through users_, which
+// lists the blocks that depend on each such cell.
+//
+// A cell which has been changed in this way is marked as volatile, and later
+// compilations read volatile operands from memory at run time instead. This
+// means that code which patches its own operands, such as the calling
+// convention used by the compiler, is only recompiled once.
+class jit {
+ public:
+  // State shared with compiled code. Compiled code addresses these fields
+  // through offsetof, so the layout can be changed freely.
+  struct frame {
+    value_type* const* low_pages;
+    value_type* const* low_writable_pages;
+    const memory::table* const* tables;
+    memory::table* const* writable_tables;
+    value_type relative_base;
+    std::uint32_t* code_map;
+    // If a block changes a cell that compiled code depends on, it stops
+    // immediately afterwards and stores the address of the cell here.
+    value_type modified;
+    // Set if the block stopped at an instruction which must be executed by the
+    // interpreter, such as one which accesses memory out of bounds.
+    value_type fallback;
   };
+  using entry = value_type(frame*);
 
-  bool done() const { return state_ == halt; }
+  jit() {
+    // The code map covers all of memory, but only the parts which are written
+    // to are ever backed by physical memory.
+    void* code_map = mmap(nullptr, code_map_bytes, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    check(code_map != MAP_FAILED);
+    code_map_ = (std::uint32_t*)code_map;
+  }
 
-  void provide_input(value_type x) {
-    check(state_ == waiting_for_input);
-    state_ = ready;
-    memory_[input_address_] = x;
-    pc_ += 2;
+  ~jit() { munmap(code_map_, code_map_bytes); }
+
+  jit(const jit&) = delete;
+  jit& operator=(const jit&) = delete;
+
+  struct block {
+    value_type start;
+    // nullptr if the instruction at the start of the block can't be compiled.
+    entry* code;
+    // The cells whose values were baked into the code.
+    std::vector<value_type> cells;
+  };
+
+  // Maximum number of instructions compiled into a single block.
+  static constexpr int max_block_size = 64;
+
+  // Number of times that an address must be reached before code starting
+  // there is compiled. Most code runs only a handful of times, and is cheaper
+  // to interpret than to compile.
+  static constexpr int compile_threshold = 64;
+
+  // Returns the block starting at pc, compiling it if necessary. Returns
+  // nullptr if the instruction at pc can't be compiled, or hasn't run enough
+  // times to be worth compiling yet.
+  const block* get(memory& memory, value_type pc) {
+    if (pc < 0 || memory::max_size <= pc) return nullptr;
+    auto& slot = blocks_[pc];
+    if (!slot.compiled) {
+      if (slot.hits < compile_threshold) {
+        slot.hits++;
+        return nullptr;
+      }
+      slot.compiled = compile(memory, pc);
+    }
+    return slot.compiled->code ? slot.compiled.get() : nullptr;
   }
 
-  value_type get_output() {
-    check(state_ == output);
-    state_ = ready;
-    pc_ += 2;
-    return output_;
+  // Runs a block and returns the address of the next instruction. If the next
+  // instruction must be executed by the interpreter, interpret is set.
+  value_type run(memory& memory, const block& block, value_type& relative_base,
+                 bool& interpret) {
+    frame frame{memory.low_pages(), memory.low_writable_pages(),
+                memory.tables(), memory.writable_tables(), relative_base,
+                code_map_, -1, 0};
+    const value_type pc = block.code(&frame);
+    relative_base = frame.relative_base;
+    interpret = frame.fallback;
+    if (frame.modified != -1) invalidate(frame.modified);
+    return pc;
   }
 
-  state resume() {
-    check(state_ == ready);
+  // Discards all compiled code. Must be called whenever pages which compiled
+  // code may refer to stop being writable in place, such as after a fork.
+  void flush() {
+    // Every block depends on at least one cell, so this finds all of them.
+    while (!users_.empty()) remove(users_.begin()->second.front());
+    code_.clear();
+  }
+
+  // Must be called whenever a store changes the value of a cell.
+  void invalidate(value_type address) {
+    if (!code_map_[address]) return;
+    mark_volatile(address);
+    // Removing the blocks updates the list.
+    while (code_map_[address]) remove(users_.at(address).back());
+  }
+
+ private:
+  bool is_volatile(value_type address) const {
+    const bool* entry = volatile_.find(address);
+    return entry && *entry;
+  }
+
+  void mark_volatile(value_type address) { volatile_[address] = true; }
+
+  // Checks whether the instruction at pc can be compiled. Compiled
+  // instructions may not have side effects other than modifying memory and
+  // the relative base, and must refer to constant addresses which are within
+  // the bounds of memory.
+  bool compilable(const memory& memory, value_type pc) const {
+    if (pc + 3 >= memory::max_size || is_volatile(pc)) return false;
+    const auto op = decode_op(memory[pc]);
+    switch (op.code) {
+      case opcode::add:
+      case opcode::mul:
+      case opcode::less_than:
+      case opcode::equals:
+      case opcode::jump_if_true:
+      case opcode::jump_if_false:
+      case opcode::adjust_relative_base:
+        break;
+      case opcode::illegal:
+      case opcode::input:
+      case opcode::output:
+      case opcode::halt:
+        return false;
+    }
+    for (int i = 0; i < op_size(op.code) - 1; i++) {
+      const value_type cell = pc + 1 + i;
+      if (is_volatile(cell)) continue;
+      const value_type x = memory[cell];
+      switch (op.params[i]) {
+        case mode::position:
+          if (x < 0 || memory::max_size <= x) return false;
+          break;
+        case mode::immediate:
+          break;
+        case mode::relative:
+          if (x < INT32_MIN || INT32_MAX < x) return false;
+          break;
+      }
+    }
+    return true;
+  }
+
+  std::unique_ptr<block> compile(memory& memory, value_type start) {
+    auto result = std::make_unique<block>();
+    result->start = start;
+    if (!compilable(memory, start)) {
+      // Remember the failure until the instruction changes. If the opcode
+      // itself can be compiled then it was an operand which couldn't be, so
+      // changes to the operands are worth another try as well.
+      result->code = nullptr;
+      result->cells = {start};
+      const auto op = decode_op(memory[start]);
+      if (op.code != opcode::input && op.code != opcode::output &&
+          op.code != opcode::halt && op.code != opcode::illegal) {
+        const value_type end =
+            std::min(start + op_size(op.code), memory::max_size);
+        for (value_type cell = start + 1; cell < end; cell++) {
+          result->cells.push_back(cell);
+        }
+      }
+      add_references(*result);
+      return result;
+    }
+    using namespace x86;
+    assembler a;
+    const auto field = [](std::size_t offset) {
+      return mem{rbx, {}, 1, (std::int32_t)offset};
+    };
+    // Loads the address of the page containing a fixed address into rdx. The
+    // page is made writable now, so that its address can be baked into the
+    // code. It stays valid until the memory is next forked, which must flush
+    // all compiled code.
+    const auto page = [&](value_type address) {
+      const value_type* page = &memory.at(address & ~memory::page_mask);
+      a.mov(rdx, (std::int64_t)page);
+    };
+    // The cell at a fixed address, once its page has been loaded into rdx.
+    const auto cell = [](value_type address) {
+      const auto offset = address & memory::page_mask;
+      return mem{rdx, {}, 1, (std::int32_t)(offset * sizeof(value_type))};
+    };
+    const auto code_map_cell = [](value_type address) {
+      return mem{r15, {}, 1, (std::int32_t)(address * sizeof(std::uint32_t))};
+    };
+    const auto code_map_cell_at = [](reg address) {
+      return mem{r15, address, sizeof(std::uint32_t)};
+    };
+    const label done = a.new_label();
+    // Out-of-line code is emitted after the body of the block.
+    std::vector<std::function<void()>> stubs;
+    const auto exit_to = [&](value_type pc) {
+      const label l = a.new_label();
+      stubs.push_back([&a, &field, done, l, pc] {
+        a.bind(l);
+        a.mov(field(offsetof(frame, fallback)), 1);
+        a.mov(rax, pc);
+        a.jmp(done);
+      });
+      return l;
+    };
+    // Splits the address in r into a page in rdx and an offset in r, looking
+    // the page up among the pages which may be written in place if requested.
+    // Addresses beyond the first table are looked up through the directory
+    // out of line. Exits to the interpreter if the address is out of bounds,
+    // or if its table may not be written in place. Clobbers rdi.
+    const auto split = [&](reg r, bool writable, value_type pc) {
+      a.cmp(r, (std::int32_t)memory::max_size);
+      a.j(above_or_equal, exit_to(pc));
+      a.mov(rdx, r);
+      a.shr(rdx, memory::page_bits);
+      const label high = a.new_label(), resume = a.new_label();
+      a.cmp(rdx, (std::int32_t)memory::table_size);
+      a.j(above_or_equal, high);
+      a.mov(rdx, mem{writable ? r13 : r12, rdx, sizeof(value_type*)});
+      a.bind(resume);
+      a.and_(r, (std::int32_t)memory::page_mask);
+      const label fail = exit_to(pc);
+      stubs.push_back([&a, high, resume, fail, writable] {
+        a.bind(high);
+        a.mov(rdi, rdx);
+        a.shr(rdx, memory::table_bits);
+        a.mov(rdx, mem{writable ? r9 : r8, rdx, sizeof(memory::table*)});
+        if (writable) {
+          a.test(rdx, rdx);
+          a.j(equal, fail);
+        }
+        const std::size_t pages = writable ? offsetof(memory::table, writable)
+                                           : offsetof(memory::table, pages);
+        a.and_(rdi, (std::int32_t)memory::table_mask);
+        a.mov(rdx, mem{rdx, rdi, sizeof(value_type*), (std::int32_t)pages});
+        a.jmp(resume);
+      });
+    };
+    const auto bake = [&](value_type address) {
+      result->cells.push_back(address);
+    };
+    // Fixed addresses which the block stores to.
+    std::vector<value_type> targets;
+    // Loads operand i of the instruction at pc into the given register.
+    const auto load = [&](reg r, value_type pc, const op& op, int i) {
+      const value_type address = pc + 1 + i;
+      const bool dynamic = is_volatile(address);
+      const value_type x = memory[address];
+      if (dynamic) {
+        page(address);
+        a.mov(r, cell(address));
+      } else {
+        bake(address);
+      }
+      switch (op.params[i]) {
+        case mode::position:
+          if (!dynamic) {
+            page(x);
+            a.mov(r, cell(x));
+            return;
+          }
+          break;
+        case mode::immediate:
+          if (!dynamic) a.mov(r, x);
+          return;
+        case mode::relative:
+          if (dynamic) {
+            a.add(r, r14);
+          } else {
+            a.lea(r, mem{r14, {}, 1, (std::int32_t)x});
+          }
+          break;
+      }
+      split(r, false, pc);
+      a.mov(r, mem{rdx, r, sizeof(value_type)});
+    };
+    // Stores rax to operand i of the instruction at pc. If this changes a cell
+    // that compiled code depends on, the block stops before the next
+    // instruction.
+    const auto store = [&](value_type pc, const op& op, int i) {
+      const value_type address = pc + 1 + i;
+      const value_type next = pc + op_size(op.code);
+      const bool dynamic = is_volatile(address);
+      const value_type x = memory[address];
+      if (!dynamic) bake(address);
+      const label changed = a.new_label(), resume = a.new_label();
+      if (!dynamic && op.params[i] == mode::position) {
+        targets.push_back(x);
+        page(x);
+        a.cmp32(code_map_cell(x), 0);
+        a.j(not_equal, changed);
+        a.mov(cell(x), rax);
+        a.bind(resume);
+        stubs.push_back([&, changed, resume, x, next] {
+          a.bind(changed);
+          a.cmp(cell(x), rax);
+          a.j(equal, resume);
+          a.mov(cell(x), rax);
+          a.mov(field(offsetof(frame, modified)), (std::int32_t)x);
+          a.mov(rax, next);
+          a.jmp(done);
+        });
+        return;
+      }
+      if (dynamic) {
+        page(address);
+        a.mov(rcx, cell(address));
+        if (op.params[i] == mode::relative) a.add(rcx, r14);
+      } else {
+        a.lea(rcx, mem{r14, {}, 1, (std::int32_t)x});
+      }
+      a.mov(rsi, rcx);
+      split(rsi, true, pc);
+      // Pages which are unallocated or shared are left for the interpreter.
+      a.test(rdx, rdx);
+      a.j(equal, exit_to(pc));
+      const mem target{rdx, rsi, sizeof(value_type)};
+      a.cmp32(code_map_cell_at(rcx), 0);
+      a.j(not_equal, changed);
+      a.mov(target, rax);
+      a.bind(resume);
+      stubs.push_back([&, changed, resume, next, target] {
+        a.bind(changed);
+        a.cmp(target, rax);
+        a.j(equal, resume);
+        a.mov(target, rax);
+        a.mov(field(offsetof(frame, modified)), rcx);
+        a.mov(rax, next);
+        a.jmp(done);
+      });
+    };
+
+    // Prologue.
+    for (reg r : {rbx, r12, r13, r14, r15}) a.push(r);
+    a.mov(rbx, rdi);
+    a.mov(r12, field(offsetof(frame, low_pages)));
+    a.mov(r13, field(offsetof(frame, low_writable_pages)));
+    a.mov(r8, field(offsetof(frame, tables)));
+    a.mov(r9, field(offsetof(frame, writable_tables)));
+    a.mov(r14, field(offsetof(frame, relative_base)));
+    a.mov(r15, field(offsetof(frame, code_map)));
+
+    // Instructions which have been compiled so far, and their labels.
+    std::vector<std::pair<value_type, label>> visited;
+    const auto find = [&](value_type pc) -> std::optional<label> {
+      for (const auto& [address, l] : visited) {
+        if (address == pc) return l;
+      }
+      return std::nullopt;
+    };
+    value_type pc = start;
     while (true) {
-      const auto op = decode_op(memory_[pc_]);
-      auto get = [&](int param_index) {
-        value_type x = memory_[pc_ + param_index + 1];
-        switch (op.params[param_index]) {
-          case mode::position: return memory_[x];
-          case mode::immediate: return x;
-          case mode::relative: return memory_[relative_base_ + x];
+      if (auto l = find(pc)) {
+        // The code loops back to an instruction within this block.
+        a.jmp(*l);
+        break;
+      }
+      if ((int)visited.size() == max_block_size || !compilable(memory, pc)) {
+        a.mov(rax, pc);
+        a.jmp(done);
+        break;
+      }
+      visited.push_back({pc, a.new_label()});
+      a.bind(visited.back().second);
+      bake(pc);
+      const auto op = decode_op(memory[pc]);
+      if (op.code == opcode::jump_if_true ||
+          op.code == opcode::jump_if_false) {
+        const bool jump_if = op.code == opcode::jump_if_true;
+        const value_type condition = memory[pc + 1];
+        const value_type target = memory[pc + 2];
+        const bool constant_target =
+            op.params[1] == mode::immediate && !is_volatile(pc + 2);
+        if (op.params[0] == mode::immediate && !is_volatile(pc + 1)) {
+          bake(pc + 1);
+          if ((condition != 0) != jump_if) {
+            // The jump is never taken.
+            pc += 3;
+            continue;
+          }
+          if (constant_target) {
+            // The jump is always taken to a known address, so the block can
+            // continue from there.
+            bake(pc + 2);
+            pc = target;
+            continue;
+          }
+          load(rax, pc, op, 1);
+          a.jmp(done);
+          break;
         }
-        assert(false);
-      };
-      auto put = [&](int param_index, value_type value) {
-        value_type x = memory_[pc_ + param_index + 1];
-        switch (op.params[param_index]) {
-          case mode::position: memory_[x] = value; return;
-          case mode::immediate: std::abort();
-          case mode::relative: memory_[relative_base_ + x] = value; return;
+        load(rax, pc, op, 0);
+        const x86::condition taken_if = jump_if ? not_equal : equal;
+        if (constant_target && find(target)) {
+          // A backwards jump within the block, typically to the top of a loop.
+          bake(pc + 2);
+          a.test(rax, rax);
+          a.j(taken_if, *find(target));
+          pc += 3;
+          continue;
         }
-      };
-      if (debug_) std::cerr << pc_ << ":\t" << memory_.decode(pc_) << '\n';
+        load(rcx, pc, op, 1);
+        const label taken = a.new_label();
+        a.test(rax, rax);
+        a.j(taken_if, taken);
+        stubs.push_back([&a, taken, done] {
+          a.bind(taken);
+          a.mov(rax, rcx);
+          a.jmp(done);
+        });
+        pc += 3;
+        continue;
+      }
       switch (op.code) {
-        case opcode::illegal:
-          std::cerr << "illegal instruction " << memory_[pc_]
-                    << " at pc_=" << pc_ << "\n";
-          std::abort();
         case opcode::add:
-          put(2, get(0) + get(1));
-          pc_ += 4;
+          load(rax, pc, op, 0);
+          load(rcx, pc, op, 1);
+          a.add(rax, rcx);
+          store(pc, op, 2);
           break;
         case opcode::mul:
-          put(2, get(0) * get(1));
-          pc_ += 4;
-          break;
-        case opcode::input:
-          switch (op.params[0]) {
-            case mode::position:
-              input_address_ = memory_[pc_ + 1];
-              break;
-            case mode::immediate:
-              std::abort();
-            case mode::relative:
-              input_address_ = relative_base_ + memory_[pc_ + 1];
-              break;
-          }
-          return state_ = waiting_for_input;
-        case opcode::output:
-          output_ = get(0);
-          return state_ = output;
-        case opcode::jump_if_true:
-          pc_ = get(0) ? get(1) : pc_ + 3;
-          break;
-        case opcode::jump_if_false:
-          pc_ = get(0) ? pc_ + 3 : get(1);
+          load(rax, pc, op, 0);
+          load(rcx, pc, op, 1);
+          a.imul(rax, rcx);
+          store(pc, op, 2);
           break;
         case opcode::less_than:
-          put(2, get(0) < get(1));
-          pc_ += 4;
+          load(rax, pc, op, 0);
+          load(rcx, pc, op, 1);
+          a.cmp(rax, rcx);
+          a.set(less, rax);
+          store(pc, op, 2);
           break;
         case opcode::equals:
-          put(2, get(0) == get(1));
-          pc_ += 4;
+          load(rax, pc, op, 0);
+          load(rcx, pc, op, 1);
+          a.cmp(rax, rcx);
+          a.set(equal, rax);
+          store(pc, op, 2);
           break;
         case opcode::adjust_relative_base:
-          relative_base_ += get(0);
-          pc_ += 2;
+          load(rax, pc, op, 0);
+          a.add(r14, rax);
           break;
-        case opcode::halt:
-          return state_ = halt;
         default:
-          std::cerr << "illegal instruction " << memory_[pc_]
-                    << " at pc_=" << pc_ << "\n";
-          std::abort();
+          assert(false);
       }
+      pc += op_size(op.code);
     }
-  }
 
-  span run(const_span input, span output) {
-    unsigned output_size = 0;
-    while (true) {
-      switch (resume()) {
-        case state::ready:
-          continue;
-        case state::waiting_for_input:
-          check(!input.empty());
-          provide_input(input.front());
-          input = input.subspan(1);
-          break;
-        case state::output:
-          check(output_size < output.size());
-          output[output_size++] = get_output();
-          break;
-        case state::halt:
-          return output.subspan(0, output_size);
+    // If the block patches its own code, as the compiler does when passing the
+    // result of one instruction to the next, then the block would invalidate
+    // itself as soon as it ran. Instead, compile it again without depending on
+    // the patched cells.
+    bool patched = false;
+    for (value_type target : targets) {
+      const auto& cells = result->cells;
+      if (std::find(cells.begin(), cells.end(), target) != cells.end()) {
+        mark_volatile(target);
+        patched = true;
       }
     }
+    if (patched) return compile(memory, start);
+
+    for (const auto& stub : stubs) stub();
+
+    // Epilogue.
+    a.bind(done);
+    a.mov(field(offsetof(frame, relative_base)), r14);
+    for (reg r : {r15, r14, r13, r12, rbx}) a.pop(r);
+    a.ret();
+
+    const void* code = code_.add(a.finish());
+    if (!code) {
+      // The code buffer is full. Discard all existing code and start again.
+      flush();
+      code = code_.add(a.code());
+      check(code);
+    }
+    result->code = (entry*)code;
+    add_references(*result);
+    return result;
+  }
+
+  void add_references(const block& block) {
+    for (value_type cell : block.cells) {
+      code_map_[cell]++;
+      users_[cell].push_back(block.start);
+    }
+  }
+
+  // Discards the block starting at an address.
+  void remove(value_type start) {
+    auto& block = blocks_[start].compiled;
+    for (value_type cell : block->cells) {
+      code_map_[cell]--;
+      auto& users = users_.at(cell);
+      users.erase(std::find(users.begin(), users.end(), start));
+      if (users.empty()) users_.erase(cell);
+    }
+    block.reset();
+  }
+
+  // The compiled code starting at an address, and the number of times that
+  // the address has been reached if there is none.
+  struct slot {
+    std::unique_ptr<block> compiled;
+    std::uint8_t hits = 0;
+  };
+
+  static constexpr std::size_t code_map_bytes =
+      memory::max_size * sizeof(std::uint32_t);
+
+  x86::code_buffer code_;
+  sparse_array<slot> blocks_;
+  // The counts are 32 bits wide because a wrapped count would hide blocks
+  // from invalidate(), and a popular cell can be baked into many blocks.
+  std::uint32_t* code_map_;
+  // The start addresses of the blocks which depend on each cell, for each
+  // cell with a non-zero count in code_map_.
+  std::unordered_map<value_type, std::vector<value_type>> users_;
+  sparse_array<bool> volatile_;
+};
+
+// Tracing policies for basic_program, which is specialized on its policy so
+// that programs which are not traced pay nothing for tracing. A policy is
+// called with each instruction before it is executed.
+export struct no_trace {
+  static constexpr bool enabled = false;
+  void operator()(const memory&, value_type) {}
+};
+
+// Prints each instruction to stderr.
+export struct text_trace {
+  static constexpr bool enabled = true;
+  void operator()(const memory& memory, value_type pc) {
+    std::cerr << pc << ":\t" << memory.decode(pc) << '\n';
+  }
+};
+
+// Writes a record for each instruction to a file. A record is the pc followed
+// by the cells of the instruction, each encoded as a signed LEB128 integer, so
+// that most records take only a few bytes. Copies of a binary_trace, such as
+// those made by forking a program, all append to the same file.
+export class binary_trace {
+ public:
+  static constexpr bool enabled = true;
+
+  explicit binary_trace(const char* filename)
+      : file_(std::make_shared<file>(filename)) {}
+
+  void operator()(const memory& memory, value_type pc) {
+    const auto op = decode_op(memory[pc]);
+    const int size = op.code == opcode::illegal ? 1 : op_size(op.code);
+    file_->put(pc);
+    for (int i = 0; i < size; i++) file_->put(memory[pc + i]);
   }
 
  private:
-  const bool debug_ = false;
-  state state_ = ready;
-  value_type pc_ = 0, input_address_ = 0, output_ = 0, relative_base_ = 0;
-  memory memory_;
+  class file {
+   public:
+    explicit file(const char* filename) : file_(std::fopen(filename, "wb")) {
+      if (!file_) {
+        std::cerr << "Cannot open trace file " << std::quoted(filename)
+                  << ".\n";
+        std::exit(1);
+      }
+    }
+
+    ~file() {
+      flush();
+      std::fclose(file_);
+    }
+
+    file(const file&) = delete;
+    file& operator=(const file&) = delete;
+
+    void put(value_type x) {
+      // A 64-bit value takes at most 10 bytes.
+      if (size_ + 10 > sizeof(buffer_)) flush();
+      while (true) {
+        unsigned char byte = x & 0x7F;
+        x >>= 7;
+        const bool last = x == (byte & 0x40 ? -1 : 0);
+        buffer_[size_++] = last ? byte : byte | 0x80;
+        if (last) return;
+      }
+    }
+
+    void flush() {
+      std::fwrite(buffer_, 1, size_, file_);
+      size_ = 0;
+    }
+
+   private:
+    std::FILE* file_;
+    unsigned char buffer_[1 << 16];
+    std::size_t size_ = 0;
+  };
+
+  std::shared_ptr<file> file_;
+};
+
+// Follows the calls and returns made by a compiled program, using the call and
+// return sites and the function locations recorded in its symbol map.
+export class call_stack {
+ public:
+  enum event { none, entered, left };
+  struct change {
+    event kind;
+    int function;
+  };
+
+  call_stack() = default;
+  explicit call_stack(const as::symbol_map& symbols) {
+    std::map<std::string, int> ids;
+    for (const auto& l : symbols.locations) {
+      auto [i, added] = ids.emplace(l.function, names_.size());
+      if (added) names_.push_back(l.function);
+      starts_.push_back(l.address);
+      functions_.push_back(i->second);
+    }
+    for (auto address : symbols.calls) mark(address, call_site);
+    for (auto address : symbols.returns) mark(address, return_site);
+  }
+
+  // Functions are numbered from 0 in the order that they appear.
+  int num_functions() const { return names_.size(); }
+  const std::string& name(int function) const { return names_[function]; }
+
+  // Returns the function containing the given address, or -1 if there is none.
+  int function_at(value_type address) const {
+    auto i = std::upper_bound(starts_.begin(), starts_.end(), address);
+    return i == starts_.begin() ? -1 : functions_[i - starts_.begin() - 1];
+  }
+
+  // The functions which are currently running, outermost first.
+  std::span<const int> frames() const { return frames_; }
+
+  // Updates the stack for the instruction at pc, which is about to be
+  // executed. The jump for a call or a return belongs to the function that it
+  // leaves, so the stack changes at the instruction after it. Returns the
+  // function which was entered or left, if any.
+  change step(value_type pc) {
+    change result = {none, -1};
+    if (frames_.empty()) {
+      frames_.push_back(function_at(pc));
+      result = {entered, frames_.back()};
+    } else if (pending_ == call_site) {
+      frames_.push_back(function_at(pc));
+      result = {entered, frames_.back()};
+    } else if (pending_ == return_site && frames_.size() > 1) {
+      result = {left, frames_.back()};
+      frames_.pop_back();
+    }
+    pending_ = pc < (value_type)sites_.size() ? sites_[pc] : no_site;
+    return result;
+  }
+
+ private:
+  enum site : unsigned char { no_site, call_site, return_site };
+
+  void mark(value_type address, site site) {
+    if (address >= (value_type)sites_.size()) sites_.resize(address + 1);
+    sites_[address] = site;
+  }
+
+  std::vector<std::string> names_;
+  // The function for each location, by starting address.
+  std::vector<value_type> starts_;
+  std::vector<int> functions_;
+  std::vector<site> sites_;
+  site pending_ = no_site;
+  std::vector<int> frames_;
+};
+
+// Counts how many times the instruction at each address is executed, and how
+// many times each combination of opcode and parameter modes is executed. The
+// counters for the program's image are a flat array, so profiling costs little
+// more than tracing with no_trace, apart from having to use an interpreter.
+// Code which runs beyond the image is counted sparsely. Given a symbol map, the
+// report also attributes the counts to source lines and functions, where the
+// inclusive cost of a function includes the functions that it calls.
+export class profile {
+ public:
+  static constexpr bool enabled = true;
+
+  profile() = default;
+  profile(value_type image_size, as::symbol_map symbols)
+      : image_(image_size),
+        symbols_(std::move(symbols)),
+        stack_(symbols_),
+        inclusive_(stack_.num_functions()),
+        entered_(stack_.num_functions()),
+        depth_(stack_.num_functions()) {}
+
+  void operator()(const memory& memory, value_type pc) {
+    if (stack_.num_functions()) track(pc);
+    total_++;
+    const value_type x = memory[pc];
+    const int handler =
+        0 <= x && x < (value_type)handler_ids.size() ? handler_ids[x] : 0;
+    mix_[handler]++;
+    counter& c = pc < (value_type)image_.size() ? image_[pc] : beyond_[pc];
+    c.count++;
+    c.handler = handler;
+  }
+
+  // Writes the total number of instructions executed, the hottest ranges of
+  // straight-line code, and the instruction mix.
+  void report(std::ostream& output) const {
+    const std::uint64_t total = total_;
+    output << "Executed " << total << " instructions.\n";
+    if (total == 0) return;
+    const auto percent = [&](std::uint64_t x) {
+      output << std::fixed << std::setprecision(2) << std::setw(8)
+             << 100.0 * x / total << "%";
+    };
+    if (stack_.num_functions()) report_source(output, percent);
+
+    // Runs of consecutive instructions which were executed the same number of
+    // times, which are usually basic blocks.
+    struct range {
+      value_type begin, end;
+      std::uint64_t count, instructions;
+    };
+    std::vector<range> ranges;
+    std::optional<range> current;
+    // The address of the instruction after the current range.
+    value_type next = 0;
+    for_each_counter([&](value_type pc, const counter& c) {
+      if (current && pc < next) return;
+      if (current && (pc != next || c.count != current->count)) {
+        ranges.push_back(*current);
+        current.reset();
+      }
+      if (c.count == 0) return;
+      if (!current) current = range{pc, pc, c.count, 0};
+      current->instructions += c.count;
+      current->end = pc;
+      next = pc + size(c.handler);
+    });
+    if (current) ranges.push_back(*current);
+    std::sort(ranges.begin(), ranges.end(), [](const auto& l, const auto& r) {
+      return l.instructions > r.instructions;
+    });
+    if (ranges.size() > max_ranges) ranges.resize(max_ranges);
+    output << "\nHottest address ranges:\n";
+    for (const auto& range : ranges) {
+      output << "  " << std::setw(6) << range.begin << " - " << std::left
+             << std::setw(6) << range.end << std::right << std::setw(14)
+             << range.count << " runs" << std::setw(16) << range.instructions
+             << " instructions";
+      percent(range.instructions);
+      output << "\n";
+    }
+
+    std::vector<int> handlers;
+    for (int i = 0; i < num_handlers; i++) {
+      if (mix_[i]) handlers.push_back(i);
+    }
+    std::sort(handlers.begin(), handlers.end(),
+              [&](int l, int r) { return mix_[l] > mix_[r]; });
+    output << "\nInstruction mix:\n";
+    for (int handler : handlers) {
+      output << "  " << std::left << std::setw(28) << name(handler)
+             << std::right << std::setw(16) << mix_[handler];
+      percent(mix_[handler]);
+      output << "\n";
+    }
+  }
+
+ private:
+  static constexpr std::size_t max_ranges = 20;
+  static constexpr std::size_t max_lines = 20;
+
+  struct counter {
+    std::uint64_t count = 0;
+    unsigned char handler = 0;
+  };
+
+  // Calls f with each counter which may be non-zero, in order of address.
+  template <typename F>
+  void for_each_counter(F f) const {
+    const value_type n = image_.size();
+    for (value_type pc = 0; pc < n; pc++) f(pc, image_[pc]);
+    for (value_type i = 0; i < beyond_.num_pages(); i++) {
+      const counter* page = beyond_.page(i);
+      if (!page) continue;
+      const value_type begin = i * beyond_.page_size;
+      for (value_type pc = std::max(begin, n);
+           pc < begin + beyond_.page_size; pc++) {
+        f(pc, page[pc - begin]);
+      }
+    }
+  }
+
+  void track(value_type pc) {
+    const auto [kind, function] = stack_.step(pc);
+    if (function == -1) return;
+    if (kind == call_stack::entered && depth_[function]++ == 0) {
+      entered_[function] = total_;
+    } else if (kind == call_stack::left && --depth_[function] == 0) {
+      inclusive_[function] += total_ - entered_[function];
+    }
+  }
+
+  // Writes the cost of each function and the hottest source lines.
+  template <typename Percent>
+  void report_source(std::ostream& output, Percent percent) const {
+    const int n = stack_.num_functions();
+    std::vector<std::uint64_t> exclusive(n), inclusive = inclusive_;
+    std::map<std::pair<std::string, int>, std::uint64_t> lines;
+    for_each_counter([&](value_type pc, const counter& c) {
+      if (c.count == 0) return;
+      const int function = stack_.function_at(pc);
+      if (function != -1) exclusive[function] += c.count;
+      const auto* location = symbols_.find(pc);
+      if (location && location->line) {
+        lines[{location->file, location->line}] += c.count;
+      }
+    });
+    // Functions which are still running when the program halts.
+    for (int i = 0; i < n; i++) {
+      if (depth_[i]) inclusive[i] += total_ - entered_[i];
+    }
+
+    std::vector<int> functions;
+    for (int i = 0; i < n; i++) {
+      if (inclusive[i] || exclusive[i]) functions.push_back(i);
+    }
+    std::sort(functions.begin(), functions.end(), [&](int l, int r) {
+      return inclusive[l] > inclusive[r];
+    });
+    output << "\nFunctions:\n  " << std::left << std::setw(28) << "name"
+           << std::right << std::setw(16) << "inclusive" << std::setw(9) << ""
+           << std::setw(16) << "exclusive" << "\n";
+    for (int function : functions) {
+      output << "  " << std::left << std::setw(28) << stack_.name(function)
+             << std::right << std::setw(16) << inclusive[function];
+      percent(inclusive[function]);
+      output << std::setw(16) << exclusive[function];
+      percent(exclusive[function]);
+      output << "\n";
+    }
+
+    std::vector<std::pair<std::uint64_t, std::string>> hottest;
+    for (const auto& [line, count] : lines) {
+      hottest.emplace_back(
+          count, line.first + ":" + std::to_string(line.second));
+    }
+    std::sort(hottest.begin(), hottest.end(), std::greater());
+    if (hottest.size() > max_lines) hottest.resize(max_lines);
+    output << "\nHottest lines:\n";
+    for (const auto& [count, line] : hottest) {
+      output << "  " << std::left << std::setw(28) << line << std::right
+             << std::setw(16) << count;
+      percent(count);
+      output << "\n";
+    }
+  }
+
+  static int size(int handler) {
+    const auto code = handler_ops[handler].code;
+    return code == opcode::illegal ? 1 : op_size(code);
+  }
+
+  // Describes a combination of opcode and parameter modes, for example
+  // "add *a, b, base[c]".
+  static std::string name(int handler) {
+    const op op = handler_ops[handler];
+    std::string result;
+    switch (op.code) {
+      case opcode::illegal: return "illegal";
+      case opcode::add: result = "add"; break;
+      case opcode::mul: result = "mul"; break;
+      case opcode::input: result = "in"; break;
+      case opcode::output: result = "out"; break;
+      case opcode::jump_if_true: result = "jnz"; break;
+      case opcode::jump_if_false: result = "jz"; break;
+      case opcode::less_than: result = "lt"; break;
+      case opcode::equals: result = "eq"; break;
+      case opcode::adjust_relative_base: result = "arb"; break;
+      case opcode::halt: return "halt";
+    }
+    for (int i = 0; i < op_size(op.code) - 1; i++) {
+      const char operand = 'a' + i;
+      result += i ? ", " : " ";
+      switch (op.params[i]) {
+        case mode::position: result += {'*', operand}; break;
+        case mode::immediate: result += operand; break;
+        case mode::relative: result += std::string("base[") + operand + "]";
+      }
+    }
+    return result;
+  }
+
+  std::array<std::uint64_t, num_handlers> mix_ = {};
+  std::uint64_t total_ = 0;
+  std::vector<counter> image_;
+  sparse_array<counter> beyond_;
+  as::symbol_map symbols_;
+  call_stack stack_;
+  // The total inclusive cost of each function for calls which have finished,
+  // and for those which are running, when the outermost call started.
+  std::vector<std::uint64_t> inclusive_, entered_;
+  std::vector<int> depth_;
+};
+
+// Samples the call stack of a compiled program every so many instructions, and
+// writes the samples in the collapsed stack format used by flamegraph.pl: one
+// line per distinct stack, with the functions from outermost to innermost
+// separated by semicolons, followed by the number of samples.
+export class flame_graph {
+ public:
+  static constexpr bool enabled = true;
+
+  flame_graph(const as::symbol_map& symbols, std::uint64_t interval)
+      : stack_(symbols), interval_(interval), countdown_(interval) {
+    check(interval > 0);
+  }
+
+  void operator()(const memory&, value_type pc) {
+    stack_.step(pc);
+    if (--countdown_) return;
+    countdown_ = interval_;
+    const auto frames = stack_.frames();
+    samples_[std::vector<int>(frames.begin(), frames.end())]++;
+  }
+
+  void report(std::ostream& output) const {
+    for (const auto& [frames, count] : samples_) {
+      bool first = true;
+      for (int function : frames) {
+        if (!first) output << ';';
+        first = false;
+        output << (function == -1 ? "[unknown]" : stack_.name(function));
+      }
+      output << ' ' << count << '\n';
+    }
+  }
+
+ private:
+  call_stack stack_;
+  std::uint64_t interval_, countdown_;
+  std::map<std::vector<int>, std::uint64_t> samples_;
+};
+
+// Returns a mask of the bytes in a block of 64 which are commas.
+std::uint64_t find_commas(const char* block) {
+#if defined(__AVX2__)
+  const __m256i comma = _mm256_set1_epi8(',');
+  const __m256i low = _mm256_loadu_si256((const __m256i*)block);
+  const __m256i high = _mm256_loadu_si256((const __m256i*)(block + 32));
+  return (std::uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(low, comma)) |
+         (std::uint64_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(high, comma))
+             << 32;
+#elif defined(__SSE2__)
+  const __m128i comma = _mm_set1_epi8(',');
+  std::uint64_t mask = 0;
+  for (int i = 0; i < 4; i++) {
+    const __m128i part = _mm_loadu_si128((const __m128i*)(block + 16 * i));
+    mask |= (std::uint64_t)_mm_movemask_epi8(_mm_cmpeq_epi8(part, comma))
+            << 16 * i;
+  }
+  return mask;
+#else
+  std::uint64_t mask = 0;
+  for (int i = 0; i < 64; i++) mask |= (std::uint64_t)(block[i] == ',') << i;
+  return mask;
+#endif
+}
+
+// Parses comma-separated integers. The commas are found a block at a time, so
+// each number can be parsed without waiting for the end of the one before it,
+// and the digits of a number are loaded as a single word and combined with a
+// few multiplications rather than one at a time. Nothing keeps track of lines:
+// anything unusual, including any error, makes this give up so that the
+// caller can fall back to the scanner, which reports exactly where the problem
+// is.
+std::optional<std::vector<value_type>> parse_cells(std::string_view source) {
+  constexpr std::uint64_t ones = 0x0101'0101'0101'0101;
+  const char* const begin = source.data();
+  const char* const end = begin + source.size();
+  // Returns the word at i with each byte in the range 0-9 if it is a digit,
+  // and outside of that range otherwise.
+  const auto load = [](const char* i) {
+    std::uint64_t word;
+    std::memcpy(&word, i, sizeof(word));
+    return word ^ '0' * ones;
+  };
+  // Counts the leading bytes of a word from load() which are digits.
+  const auto count_digits = [](std::uint64_t word) {
+    const std::uint64_t high = word & 0xF0 * ones;
+    const std::uint64_t low =
+        ((word & 0x0F * ones) + 0x06 * ones) & 0x10 * ones;
+    const std::uint64_t not_digit = high | low;
+    return not_digit ? std::countr_zero(not_digit) / 8 : 8;
+  };
+  // Combines the leading n digits of a word from load() into a number.
+  const auto combine = [](std::uint64_t word, int n) {
+    word = word << (64 - 8 * n);
+    word = (word * 10 + (word >> 8)) & 0x00FF'00FF'00FF'00FF;
+    word = (word * 100 + (word >> 16)) & 0x0000'FFFF'0000'FFFF;
+    return (value_type)((word * 10000 + (word >> 32)) & 0xFFFF'FFFF);
+  };
+  std::size_t count = 1;
+  const char* block = begin;
+  for (; end - block >= 64; block += 64) {
+    count += std::popcount(find_commas(block));
+  }
+  count += std::count(block, end, ',');
+  std::vector<value_type> output;
+  output.reserve(count);
+  // Parses the number between two commas.
+  const auto parse = [&](const char* first, const char* last) {
+    const bool negative = first != last && *first == '-';
+    const char* const digits = first + negative;
+    const std::ptrdiff_t n = last - digits;
+    if (0 < n && n <= 8 && end - digits >= 8) {
+      const std::uint64_t word = load(digits);
+      if (count_digits(word) >= n) {
+        const value_type value = combine(word, n);
+        output.push_back(negative ? -value : value);
+        return true;
+      }
+    }
+    while (first != last && is_space(*first)) first++;
+    while (first != last && is_space(last[-1])) last--;
+    value_type value;
+    const auto [next, error] = std::from_chars(first, last, value);
+    if (error != std::errc() || next != last) return false;
+    output.push_back(value);
+    return true;
+  };
+  const char* start = begin;
+  block = begin;
+  for (; end - block >= 64; block += 64) {
+    for (auto mask = find_commas(block); mask; mask &= mask - 1) {
+      const char* const comma = block + std::countr_zero(mask);
+      if (!parse(start, comma)) return std::nullopt;
+      start = comma + 1;
+    }
+  }
+  for (; block != end; block++) {
+    if (*block != ',') continue;
+    if (!parse(start, block)) return std::nullopt;
+    start = block + 1;
+  }
+  if (!parse(start, end)) return std::nullopt;
+  return output;
+}
+
+// The parts of basic_program which don't depend on the tracing policy.
+export class program_base {
+ public:
+  using value_type = ::value_type;
+  using span = std::span<value_type>;
+  using const_span = std::span<const value_type>;
+
+  // The number of cells of memory available to a program.
+  static constexpr value_type memory_size = memory::max_size;
+
+  // Parses a program written as comma-separated integers.
+  static std::vector<value_type> load(std::string_view source) {
+    if (auto output = parse_cells(source)) return std::move(*output);
+    std::vector<value_type> output;
+    scanner scanner(source);
+    (scanner >> output.emplace_back()).check_ok();
+    while (!scanner.done()) {
+      (scanner >> exact(",") >> output.emplace_back()).check_ok();
+    }
+    return output;
+  }
+
+  enum class engine {
+    // Decode each instruction from memory every time it is executed.
+    simple,
+    // Decode each instruction once and execute it from a cache.
+    predecoded,
+    // Like predecoded, but each handler dispatches directly to the next.
+    threaded,
+    // Compile straight-line code to x86-64 machine code.
+    jit,
+  };
+
+  enum state {
+    ready,
+    waiting_for_input,
+    output,
+    halt,
+  };
+};
+
+export template <typename trace_policy = no_trace>
+class basic_program : public program_base {
+ public:
+  basic_program() = default;
+
+  explicit basic_program(const_span source,
+                         engine engine = engine::predecoded,
+                         trace_policy trace = {})
+      : engine_(engine), trace_(std::move(trace)) {
+    for (value_type i = 0, n = source.size(); i < n; i++) {
+      memory_.at(i) = source[i];
+    }
+    start();
+  }
+
+  // Runs the program in place from the given cells instead of copying them
+  // first, so that starting a large program such as a mapped image takes time
+  // proportional to the number of pages rather than the number of cells. The
+  // cells must outlive the program and every fork or snapshot of it.
+  basic_program(std::in_place_t, const_span source,
+                engine engine = engine::predecoded, trace_policy trace = {})
+      : engine_(engine), trace_(std::move(trace)), memory_(source) {
+    start();
+  }
+
+  bool done() const { return state_ == halt; }
+
+  const trace_policy& trace() const { return trace_; }
+
+  void provide_input(value_type x) {
+    check(state_ == waiting_for_input);
+    state_ = ready;
+    store(input_address_, x);
+    pc_ += 2;
+  }
+
+  value_type get_output() {
+    check(state_ == output);
+    state_ = ready;
+    pc_ += 2;
+    return output_;
+  }
+
+  // Returns an independent copy of the program in its current state. The copy
+  // shares memory with the original until either of them writes to it, and
+  // decodes or compiles instructions afresh as it reaches them, so forking
+  // takes constant time regardless of how much memory is in use. The first
+  // write by either program to a shared page copies the page along with the
+  // table and directory above it. With the jit engine, forking also discards
+  // the code compiled by the original, which takes time proportional to the
+  // amount of code.
+  basic_program fork() {
+    basic_program result(engine_, memory_.fork(), trace_);
+    result.state_ = state_;
+    result.pc_ = pc_;
+    result.input_address_ = input_address_;
+    result.output_ = output_;
+    result.relative_base_ = relative_base_;
+    if (jit_) jit_->flush();
+    return result;
+  }
+
+  // The saved state of a program, which can be restored any number of times.
+  // Like a fork, a snapshot shares memory with the program that it was taken
+  // from until either of them writes to it.
+  class snapshot {
+   private:
+    friend class basic_program;
+    snapshot(memory memory, state state, value_type pc,
+             value_type input_address, value_type output,
+             value_type relative_base)
+        : memory_(std::move(memory)), state_(state), pc_(pc),
+          input_address_(input_address), output_(output),
+          relative_base_(relative_base) {}
+
+    memory memory_;
+    state state_;
+    value_type pc_, input_address_, output_, relative_base_;
+  };
+
+  snapshot save() {
+    if (jit_) jit_->flush();
+    return snapshot(memory_.fork(), state_, pc_, input_address_, output_,
+                    relative_base_);
+  }
+
+  void restore(const snapshot& snapshot) {
+    memory_ = snapshot.memory_.fork();
+    state_ = snapshot.state_;
+    pc_ = snapshot.pc_;
+    input_address_ = snapshot.input_address_;
+    output_ = snapshot.output_;
+    relative_base_ = snapshot.relative_base_;
+    // The memory may differ arbitrarily from the memory that instructions were
+    // decoded or compiled from.
+    decoded_.clear();
+    if (jit_) jit_->flush();
+  }
+
+  state resume() {
+    check(state_ == ready);
+    switch (engine_) {
+      case engine::simple: return resume_simple();
+      case engine::predecoded: return resume_predecoded();
+      case engine::threaded: return resume_threaded();
+      case engine::jit: return resume_jit();
+    }
+  }
+
+  span run(const_span input, span output) {
+    unsigned output_size = 0;
+    while (true) {
+      switch (resume()) {
+        case state::ready:
+          continue;
+        case state::waiting_for_input:
+          check(!input.empty());
+          provide_input(input.front());
+          input = input.subspan(1);
+          break;
+        case state::output:
+          check(output_size < output.size());
+          output[output_size++] = get_output();
+          break;
+        case state::halt:
+          return output.subspan(0, output_size);
+      }
+    }
+  }
+
+ private:
+  state resume_simple() {
+    while (true) {
+      if (auto state = step(); state != ready) return state;
+    }
+  }
+
+  // Executes a single instruction. Returns ready if execution can continue.
+  state step() {
+    const auto op = decode_op(memory_[pc_]);
+    auto get = [&](int param_index) {
+      value_type x = memory_[pc_ + param_index + 1];
+      switch (op.params[param_index]) {
+        case mode::position: return memory_[x];
+        case mode::immediate: return x;
+        case mode::relative: return memory_[relative_base_ + x];
+      }
+      assert(false);
+    };
+    auto put = [&](int param_index, value_type value) {
+      value_type x = memory_[pc_ + param_index + 1];
+      switch (op.params[param_index]) {
+        case mode::position: store(x, value); return;
+        case mode::immediate: std::abort();
+        case mode::relative: store(relative_base_ + x, value); return;
+      }
+    };
+    if constexpr (trace_policy::enabled) trace_(memory_, pc_);
+    switch (op.code) {
+      case opcode::illegal:
+        std::cerr << "illegal instruction " << memory_[pc_]
+                  << " at pc_=" << pc_ << "\n";
+        std::abort();
+      case opcode::add:
+        put(2, get(0) + get(1));
+        pc_ += 4;
+        break;
+      case opcode::mul:
+        put(2, get(0) * get(1));
+        pc_ += 4;
+        break;
+      case opcode::input:
+        switch (op.params[0]) {
+          case mode::position:
+            input_address_ = memory_[pc_ + 1];
+            break;
+          case mode::immediate:
+            std::abort();
+          case mode::relative:
+            input_address_ = relative_base_ + memory_[pc_ + 1];
+            break;
+        }
+        return state_ = waiting_for_input;
+      case opcode::output:
+        output_ = get(0);
+        return state_ = output;
+      case opcode::jump_if_true:
+        pc_ = get(0) ? get(1) : pc_ + 3;
+        break;
+      case opcode::jump_if_false:
+        pc_ = get(0) ? pc_ + 3 : get(1);
+        break;
+      case opcode::less_than:
+        put(2, get(0) < get(1));
+        pc_ += 4;
+        break;
+      case opcode::equals:
+        put(2, get(0) == get(1));
+        pc_ += 4;
+        break;
+      case opcode::adjust_relative_base:
+        relative_base_ += get(0);
+        pc_ += 2;
+        break;
+      case opcode::halt:
+        return state_ = halt;
+      default:
+        std::cerr << "illegal instruction " << memory_[pc_]
+                  << " at pc_=" << pc_ << "\n";
+        std::abort();
+    }
+    return ready;
+  }
+
+  // Executes instructions from the decoded cache, decoding each cell the first
+  // time that it is executed as an instruction.
+  state resume_predecoded() {
+    while (true) {
+      const auto& op = fetch();
+      auto get = [&](int param_index) {
+        value_type x = op.args[param_index];
+        switch (op.params[param_index]) {
+          case mode::position: return memory_[x];
+          case mode::immediate: return x;
+          case mode::relative: return memory_[relative_base_ + x];
+        }
+        assert(false);
+      };
+      auto put = [&](int param_index, value_type value) {
+        value_type x = op.args[param_index];
+        switch (op.params[param_index]) {
+          case mode::position: store(x, value); return;
+          case mode::immediate: std::abort();
+          case mode::relative: store(relative_base_ + x, value); return;
+        }
+      };
+      if constexpr (trace_policy::enabled) trace_(memory_, pc_);
+      switch (op.code) {
+        case opcode::illegal:
+          std::cerr << "illegal instruction " << memory_[pc_]
+                    << " at pc_=" << pc_ << "\n";
+          std::abort();
+        case opcode::add:
+          put(2, get(0) + get(1));
+          pc_ += 4;
+          break;
+        case opcode::mul:
+          put(2, get(0) * get(1));
+          pc_ += 4;
+          break;
+        case opcode::input:
+          switch (op.params[0]) {
+            case mode::position:
+              input_address_ = op.args[0];
+              break;
+            case mode::immediate:
+              std::abort();
+            case mode::relative:
+              input_address_ = relative_base_ + op.args[0];
+              break;
+          }
+          return state_ = waiting_for_input;
+        case opcode::output:
+          output_ = get(0);
+          return state_ = output;
+        case opcode::jump_if_true:
+          pc_ = get(0) ? get(1) : pc_ + 3;
+          break;
+        case opcode::jump_if_false:
+          pc_ = get(0) ? pc_ + 3 : get(1);
+          break;
+        case opcode::less_than:
+          put(2, get(0) < get(1));
+          pc_ += 4;
+          break;
+        case opcode::equals:
+          put(2, get(0) == get(1));
+          pc_ += 4;
+          break;
+        case opcode::adjust_relative_base:
+          relative_base_ += get(0);
+          pc_ += 2;
+          break;
+        case opcode::halt:
+          return state_ = halt;
+      }
+    }
+  }
+
+  // Executes instructions from the decoded cache using direct threading: each
+  // handler is specialized for one opcode and one combination of parameter
+  // modes, and ends by jumping straight to the handler for the next
+  // instruction.
+  state resume_threaded() {
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wgnu-label-as-value"
+#define INTCODE_MODES_C(X, name, c)                                    \
+    X(name, 0, 0, c) X(name, 1, 0, c) X(name, 2, 0, c)                 \
+    X(name, 0, 1, c) X(name, 1, 1, c) X(name, 2, 1, c)                 \
+    X(name, 0, 2, c) X(name, 1, 2, c) X(name, 2, 2, c)
+#define INTCODE_MODES1(X, name)                                        \
+    X(name, 0, 0, 0) X(name, 1, 0, 0) X(name, 2, 0, 0)
+#define INTCODE_MODES2(X, name) INTCODE_MODES_C(X, name, 0)
+#define INTCODE_MODES3(X, name)                                        \
+    INTCODE_MODES_C(X, name, 0) INTCODE_MODES_C(X, name, 1)            \
+    INTCODE_MODES_C(X, name, 2)
+#define INTCODE_HANDLERS(X)                                            \
+    INTCODE_MODES3(X, add)                                             \
+    INTCODE_MODES3(X, mul)                                             \
+    INTCODE_MODES1(X, input)                                           \
+    INTCODE_MODES1(X, output)                                          \
+    INTCODE_MODES2(X, jump_if_true)                                    \
+    INTCODE_MODES2(X, jump_if_false)                                   \
+    INTCODE_MODES3(X, less_than)                                       \
+    INTCODE_MODES3(X, equals)                                          \
+    INTCODE_MODES1(X, adjust_relative_base)                            \
+    X(halt, 0, 0, 0)
+#define HANDLER(name, a, b, c) name##_##a##b##c
+#define LABEL(name, a, b, c) &&HANDLER(name, a, b, c),
+#define DISPATCH()                                                     \
+    do {                                                               \
+      op = &fetch();                                                   \
+      if constexpr (trace_policy::enabled) trace_(memory_, pc_);       \
+      goto *handlers[op->handler];                                     \
+    } while (false)
+#define GET(i, m) get<mode(m)>(op->args[i])
+#define PUT(i, m, value) put<mode(m)>(op->args[i], value)
+#define CALCULATION(name, a, b, c, symbol)                             \
+    HANDLER(name, a, b, c):                                            \
+      PUT(2, c, GET(0, a) symbol GET(1, b));                           \
+      pc_ += 4;                                                        \
+      DISPATCH();
+#define ADD(name, a, b, c) CALCULATION(name, a, b, c, +)
+#define MUL(name, a, b, c) CALCULATION(name, a, b, c, *)
+#define LESS_THAN(name, a, b, c) CALCULATION(name, a, b, c, <)
+#define EQUALS(name, a, b, c) CALCULATION(name, a, b, c, ==)
+#define INPUT(name, a, b, c)                                           \
+    HANDLER(name, a, b, c):                                            \
+      if constexpr (mode(a) == mode::immediate) std::abort();          \
+      input_address_ = op->args[0];                                    \
+      if constexpr (mode(a) == mode::relative) {                       \
+        input_address_ += relative_base_;                              \
+      }                                                                \
+      return state_ = waiting_for_input;
+#define OUTPUT(name, a, b, c)                                          \
+    HANDLER(name, a, b, c):                                            \
+      output_ = GET(0, a);                                             \
+      return state_ = output;
+#define JUMP_IF_TRUE(name, a, b, c)                                    \
+    HANDLER(name, a, b, c):                                            \
+      pc_ = GET(0, a) ? GET(1, b) : pc_ + 3;                           \
+      DISPATCH();
+#define JUMP_IF_FALSE(name, a, b, c)                                   \
+    HANDLER(name, a, b, c):                                            \
+      pc_ = GET(0, a) ? pc_ + 3 : GET(1, b);                           \
+      DISPATCH();
+#define ADJUST_RELATIVE_BASE(name, a, b, c)                            \
+    HANDLER(name, a, b, c):                                            \
+      relative_base_ += GET(0, a);                                     \
+      pc_ += 2;                                                        \
+      DISPATCH();
+    static void* const handlers[] = {&&illegal, INTCODE_HANDLERS(LABEL)};
+    static_assert(std::size(handlers) == num_handlers);
+    const decoded_op* op;
+    DISPATCH();
+  illegal:
+    std::cerr << "illegal instruction " << memory_[pc_] << " at pc_=" << pc_
+              << "\n";
+    std::abort();
+    INTCODE_MODES3(ADD, add)
+    INTCODE_MODES3(MUL, mul)
+    INTCODE_MODES1(INPUT, input)
+    INTCODE_MODES1(OUTPUT, output)
+    INTCODE_MODES2(JUMP_IF_TRUE, jump_if_true)
+    INTCODE_MODES2(JUMP_IF_FALSE, jump_if_false)
+    INTCODE_MODES3(LESS_THAN, less_than)
+    INTCODE_MODES3(EQUALS, equals)
+    INTCODE_MODES1(ADJUST_RELATIVE_BASE, adjust_relative_base)
+  halt_000:
+    return state_ = halt;
+#undef ADJUST_RELATIVE_BASE
+#undef JUMP_IF_FALSE
+#undef JUMP_IF_TRUE
+#undef OUTPUT
+#undef INPUT
+#undef EQUALS
+#undef LESS_THAN
+#undef MUL
+#undef ADD
+#undef CALCULATION
+#undef PUT
+#undef GET
+#undef DISPATCH
+#undef LABEL
+#undef HANDLER
+#undef INTCODE_HANDLERS
+#undef INTCODE_MODES3
+#undef INTCODE_MODES2
+#undef INTCODE_MODES1
+#undef INTCODE_MODES_C
+#pragma clang diagnostic pop
+  }
+
+  state resume_jit() {
+    // Compiled code can't be traced, so traced programs use the interpreter.
+    bool interpret = trace_policy::enabled;
+    // The jit is created when it is first needed, so that programs which are
+    // forked but never run don't pay for its buffers.
+    if (!jit_ && !interpret) jit_ = std::make_unique<jit>();
+    while (true) {
+      const jit::block* block = interpret ? nullptr : jit_->get(memory_, pc_);
+      if (block) {
+        pc_ = jit_->run(memory_, *block, relative_base_, interpret);
+      } else {
+        interpret = trace_policy::enabled;
+        if (auto state = step(); state != ready) return state;
+      }
+    }
+  }
+
+  // Prepares the engine. The caches of decoded instructions and compiled code
+  // are filled as instructions are reached, so that starting a large program
+  // doesn't touch all of it.
+  void start() {
+    switch (engine_) {
+      case engine::simple:
+      case engine::predecoded:
+      case engine::threaded:
+        break;
+      case engine::jit:
+#ifndef __x86_64__
+        std::cerr << "The jit engine is only supported on x86-64.\n";
+        std::exit(1);
+#endif
+        break;
+    }
+  }
+
+  // Used by fork(). Instructions are decoded or compiled again as they are
+  // reached, rather than copying the caches of the original program.
+  basic_program(engine engine, memory memory, trace_policy trace)
+      : engine_(engine), trace_(std::move(trace)), memory_(std::move(memory)) {}
+
+  // Returns the decoded instruction at pc_, decoding it if necessary.
+  const decoded_op& fetch() {
+    check((std::uint64_t)pc_ < memory::max_size);
+    auto& op = decoded_[pc_];
+    if (op.code == opcode::illegal) op = decode(pc_);
+    return op;
+  }
+
+  decoded_op decode(value_type pc) {
+    const auto op = decode_op(memory_[pc]);
+    decoded_op result;
+    if (op.code == opcode::illegal) return result;
+    result.code = op.code;
+    result.size = op_size(op.code);
+    result.handler = handler_ids[memory_[pc]];
+    for (int i = 0; i < result.size - 1; i++) {
+      result.params[i] = op.params[i];
+      result.args[i] = memory_[pc + i + 1];
+    }
+    return result;
+  }
+
+  template <mode m>
+  value_type get(value_type x) {
+    if constexpr (m == mode::position) return memory_[x];
+    if constexpr (m == mode::immediate) return x;
+    if constexpr (m == mode::relative) return memory_[relative_base_ + x];
+  }
+
+  template <mode m>
+  void put(value_type x, value_type value) {
+    if constexpr (m == mode::position) store(x, value);
+    if constexpr (m == mode::immediate) std::abort();
+    if constexpr (m == mode::relative) store(relative_base_ + x, value);
+  }
+
+  void store(value_type address, value_type value) {
+    auto& cell = memory_.at(address);
+    if (jit_ && cell != value) jit_->invalidate(address);
+    cell = value;
+    // Overwriting an opcode discards the decoded instruction, whereas
+    // overwriting an operand of a decoded instruction updates it in place.
+    if (auto* op = decoded_.find(address)) op->code = opcode::illegal;
+    for (int i = 1; i <= 3; i++) {
+      auto* op = decoded_.find(address - i);
+      if (op && i < op->size) op->args[i - 1] = value;
+    }
+  }
+
+  const engine engine_ = engine::predecoded;
+  [[no_unique_address]] trace_policy trace_;
+  state state_ = ready;
+  value_type pc_ = 0, input_address_ = 0, output_ = 0, relative_base_ = 0;
+  memory memory_;
+  sparse_array<decoded_op> decoded_;
+  std::unique_ptr<jit> jit_;
+};
+
+export using program = basic_program<>;
+
+// Runs many copies of the same program in lockstep. Copies are split into
+// groups of `width` lanes, and each group stores its memory with the
+// corresponding cells of each lane next to each other, so that an instruction
+// can be executed for every lane of a group at once with vector arithmetic.
+// When the lanes of a group diverge, the group executes the lanes with the
+// lowest pc and masks off the others until they reconverge. Lanes at the same
+// pc which hold different instructions are split up in the same way. Lanes
+// which stay apart are regrouped from time to time: they are sorted by pc and
+// their memory is moved between groups, so that lanes at the same point in the
+// program run together again and lanes which have stopped no longer hold up
+// groups which are still running.
+export class batch {
+ public:
+  using value_type = ::value_type;
+  using state = program::state;
+  // The number of lanes that fit in a vector register. Vectors wider than the
+  // registers are split up by the compiler, which costs more than it saves.
+#if defined(__AVX512F__)
+  static constexpr int width = 8;
+#elif defined(__AVX2__)
+  static constexpr int width = 4;
+#else
+  static constexpr int width = 2;
+#endif
+
+  batch(program::const_span source, int size)
+      : groups_((size + width - 1) / width), lanes_(size), position_(size),
+        lane_at_(groups_.size() * width, -1) {
+    check(source.size() <= (std::uint64_t)memory::max_size);
+    for (auto& group : groups_) {
+      for (int i = 0, n = source.size(); i < n; i++) {
+        group.memory[i] = splat(source[i]);
+      }
+    }
+    for (int i = 0; i < size; i++) position_[i] = lane_at_[i] = i;
+  }
+
+  int size() const { return lanes_.size(); }
+
+  // Accesses the memory of a single copy, for example to set its parameters
+  // before it is run.
+  value_type get(int lane, value_type address) const {
+    const int p = position_[lane];
+    return load(groups_[p / width], address)[p % width];
+  }
+
+  void set(int lane, value_type address, value_type value) {
+    const int p = position_[lane];
+    group& group = groups_[p / width];
+    at(group, address)[p % width] = value;
+    invalidate(group, address);
+  }
+
+  void provide_input(int lane, value_type value) {
+    lanes_[lane].input.push_back(value);
+  }
+
+  std::span<const value_type> output(int lane) const {
+    return lanes_[lane].output;
+  }
+
+  // Returns halt if the copy has halted, or waiting_for_input if it has run
+  // out of input.
+  state get_state(int lane) const { return lanes_[lane].state; }
+
+  // Runs every copy until it halts or needs more input than it has been given.
+  // The groups take turns to run for a while, and the lanes are regrouped
+  // between turns if enough of the groups have diverged, or if the running
+  // lanes would fit in fewer groups. Regrouping copies the memory of every
+  // lane, so it waits until at least as many instructions have run since the
+  // last time as there are cells to copy.
+  void run() {
+    for (int p = 0, n = lane_at_.size(); p < n; p++) {
+      if (lane_at_[p] == -1) continue;
+      lane& lane = lanes_[lane_at_[p]];
+      if (lane.state == program::halt) continue;
+      if (lane.state == program::waiting_for_input &&
+          lane.next_input == lane.input.size()) {
+        continue;
+      }
+      lane.state = program::ready;
+      groups_[p / width].running[p % width] = -1;
+    }
+    constexpr int turn = 4096;
+    std::int64_t steps = 0;
+    while (true) {
+      int num_running = 0, num_diverged = 0, num_lanes = 0;
+      for (int g = 0, n = groups_.size(); g < n; g++) {
+        group& group = groups_[g];
+        for (int i = 0; i < turn && any(group.running); i++, steps++) {
+          step(g);
+        }
+        if (!any(group.running)) continue;
+        num_running++;
+        const value_type pc = group.pc[first(group.running)];
+        if (any(group.running & (group.pc != splat(pc)))) num_diverged++;
+        for (int i = 0; i < width; i++) num_lanes += group.running[i] != 0;
+      }
+      if (num_running == 0) break;
+      const bool spread = 4 * num_diverged >= num_running ||
+                          num_running > (num_lanes + width - 1) / width;
+      if (groups_.size() > 1 && spread && steps >= num_cells()) {
+        regroup();
+        steps = 0;
+      }
+    }
+  }
+
+ private:
+  using vector = value_type
+      __attribute__((vector_size(width * sizeof(value_type))));
+
+  struct group {
+    // memory[i][j] is cell i of lane j. Like the memory of a program, only
+    // the pages which have been written are allocated.
+    sparse_array<vector> memory;
+    // Instructions which are the same in every lane of the group, decoded
+    // ahead of time. Stores to their cells invalidate them.
+    sparse_array<decoded_op> decoded;
+    // The range of cells which the decoded instructions cover.
+    value_type decoded_begin = INT64_MAX, decoded_end = 0;
+    vector pc = {}, relative_base = {};
+    // Each lane is all ones if it can run, or zero otherwise.
+    vector running = {};
+  };
+
+  struct lane {
+    state state = program::ready;
+    std::vector<value_type> input;
+    std::size_t next_input = 0;
+    std::vector<value_type> output;
+  };
+
+  static vector splat(value_type x) { return vector{} + x; }
+
+  static vector select(vector mask, vector a, vector b) {
+    return (a & mask) | (b & ~mask);
+  }
+
+  static bool any(vector mask) {
+    value_type result = 0;
+    for (int i = 0; i < width; i++) result |= mask[i];
+    return result;
+  }
+
+  // Returns the first lane which is set in the mask.
+  static int first(vector mask) {
+    for (int i = 0; i < width; i++) {
+      if (mask[i]) return i;
+    }
+    return width;
+  }
+
+  // Checks whether every selected lane of x has the value in the given lane.
+  static bool uniform(vector mask, vector x, int lane) {
+    return !any(mask & (x != splat(x[lane])));
+  }
+
+  static vector load(const group& group, value_type address) {
+    check(0 <= address && address < memory::max_size);
+    const vector* cell = group.memory.find(address);
+    return cell ? *cell : vector{};
+  }
+
+  static vector& at(group& group, value_type address) {
+    check(0 <= address && address < memory::max_size);
+    return group.memory[address];
+  }
+
+  // Discards the decoded instructions which include the cell at an address.
+  static void invalidate(group& group, value_type address) {
+    if (address < group.decoded_begin || group.decoded_end <= address) return;
+    for (int i = 0; i < 4; i++) {
+      decoded_op* op = group.decoded.find(address - i);
+      if (op && i < op->size) op->code = opcode::illegal;
+    }
+  }
+
+  // Decodes the instruction at pc in the given lane. The result is kept if
+  // every lane holds the same instruction, and otherwise `same` is set to the
+  // lanes which hold the same instruction as the given one.
+  decoded_op decode(group& group, value_type pc, int lane, vector& same,
+                    vector* args) {
+    const vector code = load(group, pc);
+    const auto op = decode_op(code[lane]);
+    decoded_op result;
+    same = code == splat(code[lane]);
+    if (op.code == opcode::illegal) return result;
+    result.code = op.code;
+    result.size = op_size(op.code);
+    bool cached = !any(~same);
+    for (int i = 0; i < result.size - 1; i++) {
+      result.params[i] = op.params[i];
+      args[i] = load(group, pc + i + 1);
+      result.args[i] = args[i][lane];
+      cached = cached && !any(args[i] != splat(result.args[i]));
+    }
+    if (cached) {
+      group.decoded[pc] = result;
+      group.decoded_begin = std::min(group.decoded_begin, pc);
+      group.decoded_end = std::max(group.decoded_end, pc + result.size);
+    }
+    return result;
+  }
+
+  // Executes the instruction at the lowest pc of any running lane in the
+  // group, for every lane which has the same instruction there.
+  void step(int g) {
+    group& group = groups_[g];
+    // Usually every running lane is at the same pc.
+    int first = batch::first(group.running);
+    value_type pc = group.pc[first];
+    vector active = group.running & (group.pc == splat(pc));
+    if (any(group.running & ~active)) {
+      for (int i = 0; i < width; i++) {
+        if (group.running[i] && group.pc[i] < pc) {
+          pc = group.pc[i];
+          first = i;
+        }
+      }
+      active = group.running & (group.pc == splat(pc));
+    }
+    // The operands are the same in every lane when the instruction was
+    // decoded ahead of time.
+    decoded_op op;
+    vector args[3];
+    bool same_args = false;
+    if (const decoded_op* cached = group.decoded.find(pc);
+        cached && cached->code != opcode::illegal) {
+      op = *cached;
+      same_args = true;
+      for (int i = 0; i < op.size - 1; i++) args[i] = splat(op.args[i]);
+    } else {
+      vector same;
+      op = decode(group, pc, first, same, args);
+      active &= same;
+    }
+    const auto address = [&](int i) {
+      return op.params[i] == mode::relative ? args[i] + group.relative_base
+                                            : args[i];
+    };
+    auto get = [&](int i) {
+      if (op.params[i] == mode::immediate) return args[i];
+      if (same_args && op.params[i] == mode::position) {
+        return load(group, op.args[i]);
+      }
+      const vector x = address(i);
+      if (uniform(active, x, first)) return load(group, x[first]);
+      vector result = {};
+      for (int j = 0; j < width; j++) {
+        if (active[j]) result[j] = load(group, x[j])[j];
+      }
+      return result;
+    };
+    auto put = [&](int i, vector value) {
+      check(op.params[i] != mode::immediate);
+      const vector x = address(i);
+      if (uniform(active, x, first)) {
+        vector& cell = at(group, x[first]);
+        cell = select(active, value, cell);
+        invalidate(group, x[first]);
+        return;
+      }
+      for (int j = 0; j < width; j++) {
+        if (!active[j]) continue;
+        at(group, x[j])[j] = value[j];
+        invalidate(group, x[j]);
+      }
+    };
+    // Lanes which run out of input or halt stop running.
+    const auto stop = [&](int i, state state) {
+      group.running[i] = 0;
+      lanes_[lane_at_[g * width + i]].state = state;
+    };
+    switch (op.code) {
+      case opcode::illegal:
+        std::cerr << "illegal instruction " << load(group, pc)[first]
+                  << " at pc_=" << pc << "\n";
+        std::abort();
+      case opcode::add:
+        put(2, get(0) + get(1));
+        group.pc += splat(4) & active;
+        break;
+      case opcode::mul:
+        put(2, get(0) * get(1));
+        group.pc += splat(4) & active;
+        break;
+      case opcode::input: {
+        const vector x = address(0);
+        for (int i = 0; i < width; i++) {
+          if (!active[i]) continue;
+          lane& lane = lanes_[lane_at_[g * width + i]];
+          if (lane.next_input == lane.input.size()) {
+            stop(i, program::waiting_for_input);
+            continue;
+          }
+          at(group, x[i])[i] = lane.input[lane.next_input++];
+          invalidate(group, x[i]);
+          group.pc[i] += 2;
+        }
+        break;
+      }
+      case opcode::output: {
+        const vector value = get(0);
+        for (int i = 0; i < width; i++) {
+          if (!active[i]) continue;
+          lanes_[lane_at_[g * width + i]].output.push_back(value[i]);
+        }
+        group.pc += splat(2) & active;
+        break;
+      }
+      case opcode::jump_if_true:
+      case opcode::jump_if_false: {
+        const vector condition = get(0) != splat(0);
+        const vector taken =
+            active &
+            (op.code == opcode::jump_if_true ? condition : ~condition);
+        group.pc = select(taken, get(1), group.pc + (splat(3) & active));
+        break;
+      }
+      case opcode::less_than:
+        put(2, -(get(0) < get(1)));
+        group.pc += splat(4) & active;
+        break;
+      case opcode::equals:
+        put(2, -(get(0) == get(1)));
+        group.pc += splat(4) & active;
+        break;
+      case opcode::adjust_relative_base:
+        group.relative_base += get(0) & active;
+        group.pc += splat(2) & active;
+        break;
+      case opcode::halt:
+        for (int i = 0; i < width; i++) {
+          if (active[i]) stop(i, program::halt);
+        }
+        break;
+    }
+  }
+
+  // The number of cells of memory allocated across all of the groups.
+  std::int64_t num_cells() const {
+    std::int64_t total = 0;
+    for (const group& group : groups_) {
+      for (value_type i = 0; i < group.memory.num_pages(); i++) {
+        if (group.memory.page(i)) total += sparse_array<vector>::page_size;
+      }
+    }
+    return total;
+  }
+
+  // Moves the lanes between groups so that running lanes are ordered by pc,
+  // followed by the ones which have stopped.
+  void regroup() {
+    const int n = lane_at_.size();
+    std::vector<std::pair<value_type, int>> order;
+    for (int p = 0; p < n; p++) {
+      const group& group = groups_[p / width];
+      const int i = p % width;
+      value_type key = group.running[i] ? group.pc[i] : INT64_MAX;
+      if (lane_at_[p] == -1) key = INT64_MAX;
+      order.emplace_back(key, p);
+    }
+    std::stable_sort(order.begin(), order.end(),
+                     [](auto& l, auto& r) { return l.first < r.first; });
+    std::vector<group> groups(groups_.size());
+    std::vector<int> lane_at(n, -1);
+    for (int p = 0; p < n; p++) {
+      const int from = order[p].second;
+      if (lane_at_[from] == -1) continue;
+      const group& source = groups_[from / width];
+      group& target = groups[p / width];
+      const int i = p % width, j = from % width;
+      for (value_type k = 0; k < source.memory.num_pages(); k++) {
+        const vector* page = source.memory.page(k);
+        if (!page) continue;
+        vector* out = &target.memory[k << sparse_array<vector>::page_bits];
+        for (int c = 0; c < sparse_array<vector>::page_size; c++) {
+          out[c][i] = page[c][j];
+        }
+      }
+      target.pc[i] = source.pc[j];
+      target.relative_base[i] = source.relative_base[j];
+      target.running[i] = source.running[j];
+      lane_at[p] = lane_at_[from];
+      position_[lane_at[p]] = p;
+    }
+    groups_ = std::move(groups);
+    lane_at_ = std::move(lane_at);
+  }
+
+  std::vector<group> groups_;
+  std::vector<lane> lanes_;
+  // Lane i is at position_[i], which is lane position_[i] % width of group
+  // position_[i] / width. lane_at_ is the inverse, with -1 for positions in
+  // the last group which have no lane.
+  std::vector<int> position_;
+  std::vector<int> lane_at_;
 };
@@ -0,0 +1,396 @@
+export module network;
+
+import "../util/check.h";
+import <algorithm>;
+import <atomic>;
+import <bit>;
+import <chrono>;
+import <condition_variable>;
+import <cstddef>;
+import <deque>;
+import <functional>;
+import <memory>;
+import <mutex>;
+import <optional>;
+import <thread>;
+import <vector>;
+import intcode;
+
+using value_type = program::value_type;
+
+// A bounded queue of values with a single producer and a single consumer,
+// which may be on different threads.
+export class channel {
+ public:
+  static constexpr std::size_t default_capacity = 1024;
+
+  explicit channel(std::size_t capacity = default_capacity)
+      : mask_(std::bit_ceil(capacity) - 1),
+        buffer_(std::make_unique<value_type[]>(mask_ + 1)) {}
+
+  channel(const channel&) = delete;
+  channel& operator=(const channel&) = delete;
+
+  // Returns false if the channel is full. Must only be called by the producer.
+  bool push(value_type value) {
+    const std::size_t tail = tail_.load(std::memory_order_relaxed);
+    if (tail - head_cache_ > mask_) {
+      head_cache_ = head_.load(std::memory_order_acquire);
+      if (tail - head_cache_ > mask_) return false;
+    }
+    buffer_[tail & mask_] = value;
+    tail_.store(tail + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Returns nothing if the channel is empty. Must only be called by the
+  // consumer.
+  std::optional<value_type> pop() {
+    const std::size_t head = head_.load(std::memory_order_relaxed);
+    if (head == tail_cache_) {
+      tail_cache_ = tail_.load(std::memory_order_acquire);
+      if (head == tail_cache_) return std::nullopt;
+    }
+    const value_type value = buffer_[head & mask_];
+    head_.store(head + 1, std::memory_order_release);
+    return value;
+  }
+
+  bool empty() const {
+    return head_.load(std::memory_order_acquire) ==
+           tail_.load(std::memory_order_acquire);
+  }
+
+  bool full() const {
+    return tail_.load(std::memory_order_acquire) -
+               head_.load(std::memory_order_acquire) >
+           mask_;
+  }
+
+ private:
+  const std::size_t mask_;
+  const std::unique_ptr<value_type[]> buffer_;
+  // The producer and the consumer each keep a possibly stale copy of the
+  // other's position, so that they only touch the other's cache line when
+  // the channel looks full or empty.
+  alignas(64) std::atomic<std::size_t> head_ = 0;
+  std::size_t tail_cache_ = 0;
+  alignas(64) std::atomic<std::size_t> tail_ = 0;
+  std::size_t head_cache_ = 0;
+};
+
+// Runs a set of programs which communicate through channels, using a pool of
+// threads. Each thread has its own queue of programs which are ready to run,
+// and steals from the queues of other threads when its own queue is empty. A
+// program which is waiting for input from an empty channel, or trying to write
+// to a full one, is parked until the channel changes.
+export class network {
+ public:
+  // Chooses which of a node's output channels each output value is sent to,
+  // by index in the order that they were connected. Called for each value in
+  // turn, so it can keep track of which part of a packet it is routing.
+  using router = std::function<std::size_t(value_type)>;
+
+  // Adds a program to the network and returns its id.
+  int add(program program) {
+    nodes_.push_back(std::make_unique<node>(std::move(program)));
+    return nodes_.size() - 1;
+  }
+
+  // Connects the output of one node to the input of another. A node with
+  // several inputs reads from whichever of them has data.
+  channel& connect(int from, int to,
+                   std::size_t capacity = channel::default_capacity) {
+    return add_channel(from, to, capacity);
+  }
+
+  // Returns a channel which can be used to provide input to a node. It must
+  // only be written to while the network is not running.
+  channel& input(int to, std::size_t capacity = channel::default_capacity) {
+    return add_channel(-1, to, capacity);
+  }
+
+  // Returns a channel which collects output from a node. It must only be read
+  // from while the network is not running.
+  channel& output(int from, std::size_t capacity = channel::default_capacity) {
+    return add_channel(from, -1, capacity);
+  }
+
+  // Sets the router for a node with more than one output channel. Without a
+  // router, all output goes to the first output channel.
+  void route(int id, router router) { nodes_[id]->route = std::move(router); }
+
+  // Makes a node receive the given value when it reads input while all of its
+  // input channels are empty, instead of waiting. Such a node is never
+  // parked, so the network only stops once it halts or stop() is called.
+  void set_default_input(int id, value_type value) {
+    nodes_[id]->default_input = value;
+  }
+
+  program& get(int id) { return nodes_[id]->vm; }
+
+  // Stops the network as soon as possible. Can be called from a router.
+  void stop() { done_ = true; }
+
+  // Runs the network until every node has halted or is waiting for a channel
+  // which will never change, or until stop() is called. Afterwards, the
+  // network can be modified and run again.
+  void run(int num_threads = default_threads()) {
+    check(num_threads > 0);
+    workers_ = std::vector<worker>(num_threads);
+    done_ = false;
+    active_ = 0;
+    for (int i = 0, n = nodes_.size(); i < n; i++) {
+      node& node = *nodes_[i];
+      if (node.state == program::halt) continue;
+      node.status = queued;
+      active_++;
+      workers_[i % num_threads].queue.push_back(i);
+    }
+    if (active_ == 0) return;
+    std::vector<std::thread> threads;
+    for (int i = 1; i < num_threads; i++) threads.emplace_back([this, i] {
+      work(i);
+    });
+    work(0);
+    for (auto& thread : threads) thread.join();
+    for (auto& node : nodes_) {
+      if (node->status != halted) node->status = parked;
+    }
+  }
+
+ private:
+  static int default_threads() {
+    return std::max(1u, std::thread::hardware_concurrency());
+  }
+
+  enum status { parked, queued, running, halted };
+
+  // Maximum number of inputs or outputs that a node handles before giving
+  // other nodes a turn.
+  static constexpr int time_slice = 256;
+
+  struct node {
+    explicit node(program vm) : vm(std::move(vm)) {}
+
+    program vm;
+    // The state that the program last stopped in.
+    program::state state = program::ready;
+    // An output which has been taken from the program but not yet sent.
+    std::optional<value_type> pending;
+    std::vector<int> inputs, outputs;
+    std::size_t next_input = 0;
+    router route;
+    std::optional<value_type> default_input;
+    std::atomic<network::status> status = parked;
+  };
+
+  struct edge {
+    int from, to;
+    std::unique_ptr<::channel> channel;
+  };
+
+  struct worker {
+    std::mutex mutex;
+    // The owner takes work from the back and thieves take it from the front.
+    std::deque<int> queue;
+  };
+
+  enum result { yielded, blocked, finished };
+
+  channel& add_channel(int from, int to, std::size_t capacity) {
+    const int id = edges_.size();
+    edges_.push_back({from, to, std::make_unique<channel>(capacity)});
+    if (from != -1) nodes_[from]->outputs.push_back(id);
+    if (to != -1) nodes_[to]->inputs.push_back(id);
+    return *edges_.back().channel;
+  }
+
+  void work(int self) {
+    while (!done_) {
+      if (auto id = take(self)) {
+        execute(self, *id);
+        continue;
+      }
+      // There is nothing to do for now. Some other thread may queue more work
+      // soon, so wait for a notification but don't rely on it.
+      std::unique_lock lock(idle_mutex_);
+      sleeping_++;
+      idle_.wait_for(lock, std::chrono::milliseconds(1));
+      sleeping_--;
+    }
+  }
+
+  std::optional<int> take(int self) {
+    {
+      worker& w = workers_[self];
+      std::lock_guard lock(w.mutex);
+      if (!w.queue.empty()) {
+        const int id = w.queue.back();
+        w.queue.pop_back();
+        return id;
+      }
+    }
+    const int n = workers_.size();
+    for (int i = 1; i < n; i++) {
+      worker& w = workers_[(self + i) % n];
+      std::lock_guard lock(w.mutex);
+      if (!w.queue.empty()) {
+        const int id = w.queue.front();
+        w.queue.pop_front();
+        return id;
+      }
+    }
+    return std::nullopt;
+  }
+
+  void enqueue(int self, int id, bool urgent) {
+    {
+      worker& w = workers_[self];
+      std::lock_guard lock(w.mutex);
+      if (urgent) {
+        w.queue.push_back(id);
+      } else {
+        w.queue.push_front(id);
+      }
+    }
+    if (sleeping_) idle_.notify_one();
+  }
+
+  void execute(int self, int id) {
+    node& node = *nodes_[id];
+    node.status = running;
+    switch (advance(self, node)) {
+      case yielded:
+        node.status = queued;
+        enqueue(self, id, false);
+        return;
+      case finished:
+        node.status = halted;
+        deactivate();
+        return;
+      case blocked:
+        node.status = parked;
+        // A channel may have changed after the node last checked it but before
+        // it was marked as parked, in which case nobody else will wake it.
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (ready(node)) {
+          auto expected = parked;
+          if (node.status.compare_exchange_strong(expected, queued)) {
+            enqueue(self, id, false);
+            return;
+          }
+        }
+        // Either the node is still parked, or it has been woken by another
+        // thread which has counted it as active again.
+        deactivate();
+        return;
+    }
+  }
+
+  // Runs a node until it has to wait for a channel, or for up to a time slice.
+  result advance(int self, node& node) {
+    for (int i = 0; i < time_slice && !done_; i++) {
+      switch (node.state) {
+        case program::ready:
+          node.state = node.vm.resume();
+          break;
+        case program::waiting_for_input:
+          if (auto value = receive(self, node)) {
+            node.vm.provide_input(*value);
+          } else if (node.default_input) {
+            node.vm.provide_input(*node.default_input);
+            node.state = node.vm.resume();
+            return yielded;
+          } else {
+            return blocked;
+          }
+          node.state = node.vm.resume();
+          break;
+        case program::output:
+          if (!node.pending) node.pending = node.vm.get_output();
+          if (!send(self, node, *node.pending)) return blocked;
+          node.pending.reset();
+          node.state = node.vm.resume();
+          break;
+        case program::halt:
+          return finished;
+      }
+    }
+    return node.state == program::halt ? finished : yielded;
+  }
+
+  std::optional<value_type> receive(int self, node& node) {
+    const std::size_t n = node.inputs.size();
+    for (std::size_t i = 0; i < n; i++) {
+      const edge& e = edges_[node.inputs[node.next_input]];
+      node.next_input = (node.next_input + 1) % n;
+      if (auto value = e.channel->pop()) {
+        if (e.from != -1) wake(self, e.from);
+        return value;
+      }
+    }
+    return std::nullopt;
+  }
+
+  bool send(int self, node& node, value_type value) {
+    check(!node.outputs.empty());
+    const std::size_t index = node.route ? node.route(value) : 0;
+    check(index < node.outputs.size());
+    const edge& e = edges_[node.outputs[index]];
+    if (!e.channel->push(value)) return false;
+    if (e.to != -1) wake(self, e.to);
+    return true;
+  }
+
+  // Checks whether a parked node could make progress.
+  bool ready(const node& node) const {
+    switch (node.state) {
+      case program::waiting_for_input:
+        for (int input : node.inputs) {
+          if (!edges_[input].channel->empty()) return true;
+        }
+        return false;
+      case program::output:
+        for (int output : node.outputs) {
+          if (!edges_[output].channel->full()) return true;
+        }
+        return false;
+      default:
+        return true;
+    }
+  }
+
+  // Called after changing a channel that a node may be parked on.
+  void wake(int self, int id) {
+    node& node = *nodes_[id];
+    // Pairs with the store to status when the node is parked: either the node
+    // sees the change to the channel, or this sees that it is parked.
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    auto expected = parked;
+    if (node.status.load() != parked ||
+        !node.status.compare_exchange_strong(expected, queued)) {
+      return;
+    }
+    active_++;
+    enqueue(self, id, true);
+  }
+
+  // Called when a node stops being queued or running. Once no nodes are
+  // active, nothing can change any channel and so the network is finished.
+  void deactivate() {
+    if (--active_ == 0) {
+      done_ = true;
+      idle_.notify_all();
+    }
+  }
+
+  std::vector<std::unique_ptr<node>> nodes_;
+  std::vector<edge> edges_;
+  std::vector<worker> workers_;
+  std::atomic<bool> done_ = false;
+  std::atomic<int> active_ = 0;
+  std::mutex idle_mutex_;
+  std::condition_variable idle_;
+  std::atomic<int> sleeping_ = 0;
+};
@@ -0,0 +1,288 @@
+module;
+
+#include <cassert>
+#include <sys/mman.h>
+
+export module x86;
+
+import "../util/check.h";
+import <algorithm>;
+import <cstdint>;
+import <cstring>;
+import <initializer_list>;
+import <optional>;
+import <vector>;
+
+namespace x86 {
+
+export enum reg : unsigned char {
+  rax, rcx, rdx, rbx, rsp, rbp, rsi, rdi,
+  r8, r9, r10, r11, r12, r13, r14, r15,
+};
+
+export enum condition : unsigned char {
+  overflow = 0x0,
+  no_overflow = 0x1,
+  below = 0x2,
+  above_or_equal = 0x3,
+  equal = 0x4,
+  not_equal = 0x5,
+  below_or_equal = 0x6,
+  above = 0x7,
+  sign = 0x8,
+  no_sign = 0x9,
+  less = 0xC,
+  greater_or_equal = 0xD,
+  less_or_equal = 0xE,
+  greater = 0xF,
+};
+
+// A memory operand of the form [base + index * scale + displacement].
+export struct mem {
+  reg base;
+  std::optional<reg> index = std::nullopt;
+  unsigned char scale = 1;
+  std::int32_t displacement = 0;
+};
+
+export struct label { int id; };
+
+constexpr bool fits_int8(std::int64_t x) { return -128 <= x && x < 128; }
+constexpr bool fits_int32(std::int64_t x) {
+  return INT32_MIN <= x && x <= INT32_MAX;
+}
+
+// Emits x86-64 machine code into a buffer. Only the handful of instructions
+// needed by the JIT are supported, and all operations are 64-bit unless stated
+// otherwise.
+export class assembler {
+ public:
+  const std::vector<unsigned char>& code() const { return code_; }
+
+  label new_label() {
+    labels_.push_back(-1);
+    return label{(int)labels_.size() - 1};
+  }
+
+  void bind(label l) {
+    assert(labels_[l.id] == -1);
+    labels_[l.id] = code_.size();
+  }
+
+  // Resolves all jumps. No more code may be emitted afterwards.
+  const std::vector<unsigned char>& finish() {
+    for (const auto& [offset, l] : fixups_) {
+      check(labels_[l.id] != -1);
+      const std::int32_t relative = labels_[l.id] - (offset + 4);
+      std::memcpy(code_.data() + offset, &relative, 4);
+    }
+    fixups_.clear();
+    return code_;
+  }
+
+  void mov(reg dst, reg src) { rm(0x8B, dst, src); }
+  void mov(reg dst, mem src) { rm(0x8B, dst, src); }
+  void mov(mem dst, reg src) { rm(0x89, src, dst); }
+
+  void mov(reg dst, std::int64_t value) {
+    if (fits_int32(value)) {
+      // mov r/m64, imm32 (sign extended).
+      rm(0xC7, reg(0), dst);
+      imm32(value);
+    } else {
+      // movabs r64, imm64.
+      rex(true, 0, 0, dst);
+      byte(0xB8 + (dst & 7));
+      imm64(value);
+    }
+  }
+
+  void mov(mem dst, std::int32_t value) {
+    rm(0xC7, reg(0), dst);
+    imm32(value);
+  }
+
+  void lea(reg dst, mem src) { rm(0x8D, dst, src); }
+
+  void add(reg dst, reg src) { rm(0x03, dst, src); }
+  void add(reg dst, mem src) { rm(0x03, dst, src); }
+  void add(reg dst, std::int32_t value) { arithmetic(0, dst, value); }
+
+  void and_(reg dst, std::int32_t value) { arithmetic(4, dst, value); }
+
+  void shr(reg dst, std::uint8_t amount) {
+    rm(0xC1, reg(5), dst);
+    byte(amount);
+  }
+
+  void imul(reg dst, reg src) { rm({0x0F, 0xAF}, dst, src); }
+  void imul(reg dst, mem src) { rm({0x0F, 0xAF}, dst, src); }
+
+  void cmp(reg a, reg b) { rm(0x3B, a, b); }
+  void cmp(reg a, mem b) { rm(0x3B, a, b); }
+  void cmp(mem a, reg b) { rm(0x39, b, a); }
+  void cmp(reg a, std::int32_t value) { arithmetic(7, a, value); }
+
+  // Compares the 32-bit value at the given address with an 8-bit immediate.
+  void cmp32(mem a, std::int8_t value) {
+    rm(0x83, reg(7), a, false);
+    byte(value);
+  }
+
+  void test(reg a, reg b) { rm(0x85, b, a); }
+
+  // Sets dst to 1 if the condition holds, or 0 otherwise.
+  void set(condition c, reg dst) {
+    // setcc r/m8; movzx r32, r/m8. Without a REX prefix, the encodings for the
+    // low bytes of rsp, rbp, rsi, and rdi refer to ah, ch, dh, and bh.
+    assert(dst < rsp || r8 <= dst);
+    if (dst >= r8) rex(false, 0, 0, dst);
+    byte(0x0F);
+    byte(0x90 + c);
+    byte(0xC0 | (dst & 7));
+    rm({0x0F, 0xB6}, dst, dst, false);
+  }
+
+  void push(reg r) {
+    if (r >= 8) byte(0x41);
+    byte(0x50 + (r & 7));
+  }
+
+  void pop(reg r) {
+    if (r >= 8) byte(0x41);
+    byte(0x58 + (r & 7));
+  }
+
+  void ret() { byte(0xC3); }
+
+  void jmp(label l) {
+    byte(0xE9);
+    fixup(l);
+  }
+
+  void j(condition c, label l) {
+    byte(0x0F);
+    byte(0x80 + c);
+    fixup(l);
+  }
+
+ private:
+  void byte(unsigned char x) { code_.push_back(x); }
+
+  void imm32(std::int32_t x) {
+    for (int i = 0; i < 4; i++) byte((std::uint32_t)x >> (8 * i));
+  }
+
+  void imm64(std::int64_t x) {
+    for (int i = 0; i < 8; i++) byte((std::uint64_t)x >> (8 * i));
+  }
+
+  void fixup(label l) {
+    fixups_.push_back({(int)code_.size(), l});
+    imm32(0);
+  }
+
+  void rex(bool wide, int r, int x, int b) {
+    const unsigned char value =
+        0x40 | wide << 3 | (r >> 3) << 2 | (x >> 3) << 1 | b >> 3;
+    if (value != 0x40) byte(value);
+  }
+
+  struct opcode_bytes {
+    opcode_bytes(unsigned char x) : size(1), bytes{x} {}
+    opcode_bytes(std::initializer_list<unsigned char> x) : size(x.size()) {
+      std::copy(x.begin(), x.end(), bytes);
+    }
+    int size;
+    unsigned char bytes[2];
+  };
+
+  void opcode(opcode_bytes o) {
+    for (int i = 0; i < o.size; i++) byte(o.bytes[i]);
+  }
+
+  // Emits an instruction with a register operand and a register r/m operand.
+  void rm(opcode_bytes o, reg r, reg b, bool wide = true) {
+    rex(wide, r, 0, b);
+    opcode(o);
+    byte(0xC0 | (r & 7) << 3 | (b & 7));
+  }
+
+  // Emits an instruction with a register operand and a memory r/m operand.
+  void rm(opcode_bytes o, reg r, mem m, bool wide = true) {
+    assert(!m.index || *m.index != rsp);
+    rex(wide, r, m.index.value_or(rax), m.base);
+    opcode(o);
+    // rbp and r13 can't be used as a base without a displacement, since that
+    // encoding means rip-relative addressing instead.
+    const int mod = m.displacement == 0 && (m.base & 7) != rbp ? 0
+                    : fits_int8(m.displacement)                 ? 1
+                                                                : 2;
+    if (m.index || (m.base & 7) == rsp) {
+      // A SIB byte is needed for indexing, and for using rsp or r12 as a base.
+      const int scale = m.scale == 8 ? 3 : m.scale == 4 ? 2 : m.scale == 2;
+      const int index = m.index ? *m.index & 7 : rsp;
+      byte(mod << 6 | (r & 7) << 3 | rsp);
+      byte(scale << 6 | index << 3 | (m.base & 7));
+    } else {
+      byte(mod << 6 | (r & 7) << 3 | (m.base & 7));
+    }
+    if (mod == 1) byte(m.displacement);
+    if (mod == 2) imm32(m.displacement);
+  }
+
+  void arithmetic(int operation, reg r, std::int32_t value) {
+    if (fits_int8(value)) {
+      rm(0x83, reg(operation), r);
+      byte(value);
+    } else {
+      rm(0x81, reg(operation), r);
+      imm32(value);
+    }
+  }
+
+  std::vector<unsigned char> code_;
+  std::vector<int> labels_;
+  struct jump { int offset; label target; };
+  std::vector<jump> fixups_;
+};
+
+// A region of executable memory which code is appended to. Code is never
+// freed individually: once the region is full, the owner must discard all the
+// code within it by calling clear().
+export class code_buffer {
+ public:
+  static constexpr std::size_t default_size = 16 << 20;
+
+  explicit code_buffer(std::size_t size = default_size) : size_(size) {
+    void* data = mmap(nullptr, size, PROT_READ | PROT_WRITE | PROT_EXEC,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    check(data != MAP_FAILED);
+    data_ = (unsigned char*)data;
+  }
+
+  ~code_buffer() { munmap(data_, size_); }
+
+  code_buffer(const code_buffer&) = delete;
+  code_buffer& operator=(const code_buffer&) = delete;
+
+  // Copies the code into the buffer and returns its address, or nullptr if
+  // there is not enough space left.
+  const void* add(const std::vector<unsigned char>& code) {
+    if (size_ - used_ < code.size()) return nullptr;
+    unsigned char* result = data_ + used_;
+    std::memcpy(result, code.data(), code.size());
+    // Keep entry points aligned for the benefit of the instruction fetcher.
+    used_ = (used_ + code.size() + 15) & ~std::size_t{15};
+    if (used_ > size_) used_ = size_;
+    return result;
+  }
+
+  void clear() { used_ = 0; }
+
+ private:
+  unsigned char* data_;
+  std::size_t size_, used_ = 0;
+};
+
+}  // namespace x86
@@ -8,6 +8,7 @@ module;
 
 export module util.io;
 
+import <algorithm>;
 import <array>;
 import <charconv>;
 import <iomanip>;
@@ -18,6 +19,7 @@ import <stdexcept>;
 import <string>;
 import <string_view>;
 import <sstream>;
+import <vector>;
 
 using std::literals::operator""sv;
 
@@ -44,6 +46,19 @@ export std::string_view contents(const char* filename) {
   return std::string_view(data, info.st_size);
 }
 
+// Maps an open file into memory if it can be: mmap only works for regular
+// files, and not for empty ones. The file descriptor may be closed afterwards.
+export std::optional<std::string_view> map_file(int fd) {
+  struct stat info;
+  if (fstat(fd, &info) < 0 || !S_ISREG(info.st_mode) || info.st_size == 0) {
+    return std::nullopt;
+  }
+  const char* data =
+      (const char*)mmap(nullptr, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  if (data == (caddr_t)-1) return std::nullopt;
+  return std::string_view(data, info.st_size);
+}
+
 export enum whitespace_policy {
   skip_leading_whitespace,
   match_leading_whitespace,
@@ -139,12 +154,42 @@ export auto exact(std::string_view text, whitespace_policy policy) {
   return exact(text, message.str(), policy);
 }
 
+// Finds the line and column of a character in some text. Parsers only need to
+// keep track of where they are in the text, and the start of each line is only
+// found the first time that a position is needed, such as for an error.
+export class line_index {
+ public:
+  struct position {
+    int line, column;
+  };
+
+  explicit line_index(std::string_view text) : text_(text) {}
+
+  position find(const char* where) const {
+    assert(text_.data() <= where && where <= text_.data() + text_.size());
+    if (starts_.empty()) {
+      starts_.push_back(0);
+      for (auto i = text_.find('\n'); i != text_.npos;
+           i = text_.find('\n', i + 1)) {
+        starts_.push_back(i + 1);
+      }
+    }
+    const std::size_t offset = where - text_.data();
+    const auto i = std::upper_bound(starts_.begin(), starts_.end(), offset) - 1;
+    return {int(i - starts_.begin()) + 1, int(offset - *i) + 1};
+  }
+
+ private:
+  std::string_view text_;
+  mutable std::vector<std::size_t> starts_;
+};
+
 export class scanner {
  public:
   struct end_type {};
   static constexpr end_type end;
 
-  scanner(std::string_view source) : source_(source) {}
+  scanner(std::string_view source) : source_(source), lines_(source) {}
 
   bool ok() const { return !error_; }
   operator bool() const { return ok(); }
@@ -210,12 +255,10 @@ export class scanner {
   [[nodiscard]] scanner& operator>>(match_type<predicate, T> m) {
     if (error_.has_value()) return *this;
     if (m.whitespace_policy == skip_leading_whitespace) *this >> whitespace;
-    location l{source_, line_, column_};
+    const std::string_view start = source_;
     if (*this >> m.out && predicate(m.out)) return *this;
-    source_ = l.source;
-    line_ = l.line;
-    column_ = l.column;
-    return set_error(l, "expected " + std::string(m.name));
+    source_ = start;
+    return set_error("expected " + std::string(m.name));
   }
 
   template <auto predicate>
@@ -282,37 +325,25 @@ export class scanner {
     return result;
   }
 
-  int line() const { return line_; }
-  int column() const { return column_; }
+  int line() const { return lines_.find(source_.data()).line; }
+  int column() const { return lines_.find(source_.data()).column; }
 
  private:
-  struct location {
-    std::string_view source;
-    int line = 1, column = 1;
-  };
-
   void advance(std::size_t amount) {
     assert(amount <= source_.length());
-    for (char c : source_.substr(0, amount)) {
-      if (c == '\n') {
-        line_++;
-        column_ = 1;
-      } else {
-        column_++;
-      }
-    }
     source_.remove_prefix(amount);
   }
 
-  scanner& set_error(location l, std::string_view message) {
-    const int index = l.column - 1;
-    const auto line_start = l.source.data() - index;
+  scanner& set_error(std::string_view message) {
+    const auto [line, column] = lines_.find(source_.data());
+    const int index = column - 1;
+    const auto line_start = source_.data() - index;
     const auto line_end =
-        std::find(l.source.data(), l.source.data() + l.source.size(), '\n');
+        std::find(source_.data(), source_.data() + source_.size(), '\n');
     const auto line_contents =
         std::string_view(line_start, line_end - line_start);
     std::ostringstream output;
-    output << l.line << ':' << l.column << ": " << message << "\n";
+    output << line << ':' << column << ": " << message << "\n";
     constexpr int line_length = 80, indent = 4;
     constexpr int midpoint = (line_length - indent) / 2;
     if (line_contents.size() <= line_length - indent) {
@@ -344,13 +375,9 @@ export class scanner {
     return *this;
   }
 
-  scanner& set_error(std::string_view message) {
-    return set_error(location{source_, line_, column_}, message);
-  }
-
   std::optional<std::string> error_;
   std::string_view source_;
-  int line_ = 1, column_ = 1;
+  line_index lines_;
 };
 
 export std::string_view init(int argc, char* argv[]) {